@@ -11,7 +11,37 @@ public:
     point3 min() const { return minimum; }
     point3 max() const { return maximum; }
 
-    bool hit(const ray& r, double t_min, double t_max) const {
+    // An inverted box that any surrounding_box() call will replace.
+    static aabb empty() {
+        return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+    }
+
+    point3 centroid() const { return 0.5 * (minimum + maximum); }
+
+    // Grows the box in place to also enclose b (or the point p). Plain compares
+    // instead of fmin/fmax keep this inline in the BVH builders' inner loops.
+    void expand(const aabb& b) {
+        for (int a = 0; a < 3; a++) {
+            minimum.e[a] = b.minimum.e[a] < minimum.e[a] ? b.minimum.e[a] : minimum.e[a];
+            maximum.e[a] = b.maximum.e[a] > maximum.e[a] ? b.maximum.e[a] : maximum.e[a];
+        }
+    }
+
+    void expand(const point3& p) {
+        for (int a = 0; a < 3; a++) {
+            minimum.e[a] = p.e[a] < minimum.e[a] ? p.e[a] : minimum.e[a];
+            maximum.e[a] = p.e[a] > maximum.e[a] ? p.e[a] : maximum.e[a];
+        }
+    }
+
+    real surface_area() const {
+        auto d = maximum - minimum;
+        if (d.x() < 0 || d.y() < 0 || d.z() < 0)
+            return 0;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    bool hit(const ray& r, real t_min, real t_max) const {
         for (int a = 0; a < 3; a++) {
             auto invD = 1.0f / r.direction()[a];
             auto t0 = (min()[a] - r.origin()[a]) * invD;
@@ -9,13 +9,21 @@ class xy_rect : public hittable {
 public:
     xy_rect() {}
 
-    xy_rect(double _x0, double _x1, double _y0, double _y1, double _k,
+    xy_rect(real _x0, real _x1, real _y0, real _y1, real _k,
         shared_ptr<material> mat)
         : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Z
         // dimension a small amount.
         output_box = aabb(point3(x0, y0, k - 0.0001), point3(x1, y1, k + 0.0001));
@@ -24,20 +32,28 @@ public:
 
 public:
     shared_ptr<material> mp;
-    double x0, x1, y0, y1, k;
+    real x0, x1, y0, y1, k;
 };
 
 class xz_rect : public hittable {
 public:
     xz_rect() {}
 
-    xz_rect(double _x0, double _x1, double _z0, double _z1, double _k,
+    xz_rect(real _x0, real _x1, real _z0, real _z1, real _k,
         shared_ptr<material> mat)
         : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Y
         // dimension a small amount.
         output_box = aabb(point3(x0, k - 0.0001, z0), point3(x1, k + 0.0001, z1));
@@ -46,20 +62,28 @@ public:
 
 public:
     shared_ptr<material> mp;
-    double x0, x1, z0, z1, k;
+    real x0, x1, z0, z1, k;
 };
 
 class yz_rect : public hittable {
 public:
     yz_rect() {}
 
-    yz_rect(double _y0, double _y1, double _z0, double _z1, double _k,
+    yz_rect(real _y0, real _y1, real _z0, real _z1, real _k,
         shared_ptr<material> mat)
         : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the X
         // dimension a small amount.
         output_box = aabb(point3(k - 0.0001, y0, z0), point3(k + 0.0001, y1, z1));
@@ -68,10 +92,10 @@ public:
 
 public:
     shared_ptr<material> mp;
-    double y0, y1, z0, z1, k;
+    real y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool xy_rect::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     auto t = (k - r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max)
         return false;
@@ -79,17 +103,34 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto y = r.origin().y() + t * r.direction().y();
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
-    rec.t = t;
+    hit.set(t, this);
+    hit.b[0] = x;
+    hit.b[1] = y;
+    return true;
+}
+
+inline void xy_rect::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    rec.u = (hit.b[0] - x0) / (x1 - x0);
+    rec.v = (hit.b[1] - y0) / (y1 - y0);
+    rec.t = hit.t;
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.p = r.at(rec.t);
+    rec.p[2] = k;  // exactly on the plane
+    rec.p_error = 0;
+}
+
+inline bool xy_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().z()) / r.direction().z();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
+    return !(x < x0 || x > x1 || y < y0 || y > y1);
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool xz_rect::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     auto t = (k - r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -97,17 +138,34 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    hit.set(t, this);
+    hit.b[0] = x;
+    hit.b[1] = z;
+    return true;
+}
+
+inline void xz_rect::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    rec.u = (hit.b[0] - x0) / (x1 - x0);
+    rec.v = (hit.b[1] - z0) / (z1 - z0);
+    rec.t = hit.t;
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.p = r.at(rec.t);
+    rec.p[1] = k;
+    rec.p_error = 0;
+}
+
+inline bool xz_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().y()) / r.direction().y();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto z = r.origin().z() + t * r.direction().z();
+    return !(x < x0 || x > x1 || z < z0 || z > z1);
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool yz_rect::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     auto t = (k - r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -115,14 +173,31 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
-    rec.u = (y - y0) / (y1 - y0);
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    hit.set(t, this);
+    hit.b[0] = y;
+    hit.b[1] = z;
+    return true;
+}
+
+inline void yz_rect::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    rec.u = (hit.b[0] - y0) / (y1 - y0);
+    rec.v = (hit.b[1] - z0) / (z1 - z0);
+    rec.t = hit.t;
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.p = r.at(rec.t);
+    rec.p[0] = k;
+    rec.p_error = 0;
+}
+
+inline bool yz_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().x()) / r.direction().x();
+    if (t < t_min || t > t_max)
+        return false;
+    auto y = r.origin().y() + t * r.direction().y();
+    auto z = r.origin().z() + t * r.direction().z();
+    return !(y < y0 || y > y1 || z < z0 || z > z1);
 }
 
 #endif
\ No newline at end of file
@@ -3,43 +3,121 @@
 
 #include "rtweekend.h"
 
-#include "aarect.h"
-#include "hittable_list.h"
+#include "hittable.h"
 
+// An axis-aligned box, intersected with one slab test. The face a ray enters
+// or leaves through is the axis whose slab decided that end of the interval,
+// and its normal and uv match what the six-rectangle box used to report.
 class box : public hittable {
 public:
     box() {}
-    box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
+    box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+        : box_min(p0), box_max(p1), mp(ptr) {}
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    // The hit's primitive is the face: 2 * axis, plus one for the max side.
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
         output_box = aabb(box_min, box_max);
         return true;
     }
 
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        real t_enter, t_exit;
+        int enter_axis, exit_axis;
+        if (!slabs(r, t_enter, t_exit, enter_axis, exit_axis))
+            return false;
+        return (t_enter >= t_min && t_enter <= t_max) || (t_exit >= t_min && t_exit <= t_max);
+    }
+
+    virtual bool hit_interval(const ray& r, real& t_enter, real& t_exit) const override {
+        int enter_axis, exit_axis;
+        return slabs(r, t_enter, t_exit, enter_axis, exit_axis);
+    }
+
+    // Where the ray's line enters and leaves the box, and through which axis'
+    // faces. Distances are computed as (plane - origin) / direction, the same
+    // way the rectangles did, so hits land on exactly the same points.
+    bool slabs(const ray& r, real& t_enter, real& t_exit, int& enter_axis, int& exit_axis) const {
+        t_enter = -infinity;
+        t_exit = infinity;
+        enter_axis = exit_axis = -1;
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (box_min[a] - r.origin()[a]) / r.direction()[a];
+            auto t1 = (box_max[a] - r.origin()[a]) / r.direction()[a];
+            if (t1 < t0)
+                std::swap(t0, t1);
+            if (t0 > t_enter) {
+                t_enter = t0;
+                enter_axis = a;
+            }
+            if (t1 < t_exit) {
+                t_exit = t1;
+                exit_axis = a;
+            }
+        }
+        return enter_axis >= 0 && exit_axis >= 0 && t_enter <= t_exit;
+    }
+
 public:
     point3 box_min;
     point3 box_max;
-    hittable_list sides;
+    shared_ptr<material> mp;
 };
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
-    box_min = p0;
-    box_max = p1;
+inline bool box::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+    real t_enter, t_exit;
+    int enter_axis, exit_axis;
+    if (!slabs(r, t_enter, t_exit, enter_axis, exit_axis))
+        return false;
 
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+    // The entry face if it is in range, else the exit face (a ray from inside).
+    real t;
+    int axis;
+    bool entering;
+    if (t_enter >= t_min && t_enter <= t_max) {
+        t = t_enter;
+        axis = enter_axis;
+        entering = true;
+    }
+    else if (t_exit >= t_min && t_exit <= t_max) {
+        t = t_exit;
+        axis = exit_axis;
+        entering = false;
+    }
+    else {
+        return false;
+    }
 
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    // A ray enters through the face it travels away from the min side of.
+    bool max_face = (r.direction()[axis] < 0) == entering;
+    hit.set(t, this, 2 * axis + (max_face ? 1 : 0));
+    return true;
 }
 
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return sides.hit(r, t_min, t_max, rec);
+inline void box::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    int axis = hit.primitive / 2;
+    bool max_face = (hit.primitive & 1) != 0;
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = max_face ? 1 : -1;
+
+    // The uv axes are the other two, in x, y, z order.
+    int ua = (axis == 0) ? 1 : 0;
+    int va = (axis == 2) ? 1 : 2;
+    rec.t = hit.t;
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p[ua] - box_min[ua]) / (box_max[ua] - box_min[ua]);
+    rec.v = (rec.p[va] - box_min[va]) / (box_max[va] - box_min[va]);
+    rec.p[axis] = max_face ? box_max[axis] : box_min[axis];  // exactly on the face
+    rec.p_error = 0;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mp.get();
 }
 
-#endif
\ No newline at end of file
+#endif
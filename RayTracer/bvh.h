@@ -17,33 +17,92 @@
 #include "hittable_list.h"
 
 #include <algorithm>
+#include <vector>
+
+
+// Parameters of the surface area heuristic builder. Costs are relative: the SAH
+// cost of a tree is the expected cost of one ray query, in units of these.
+struct bvh_build_options {
+    static constexpr int max_bins = 64;
+
+    int bin_count = 16;             // centroid bins per axis, at most max_bins
+    int max_leaf_size = 1;          // leaves never hold more objects than this
+    int build_threads = 0;          // builders that run in parallel; 0 = all cores
+    real traversal_cost = 1.0;    // one node visit (box test)
+    real intersection_cost = 1.0; // one object hit() test
+    real rebuild_threshold = 1.5; // refit subtrees costing this much more than when built are rebuilt
+
+    // Spatial splits (SBVH): extra references they may add, as a fraction of
+    // the primitive count; 0 builds with object splits only. They are only
+    // tried where the object split's children overlap by more than
+    // spatial_split_alpha of the root's surface area.
+    real spatial_split_budget = 0.0;
+    real spatial_split_alpha = 1e-5;
+};
+
+// One object as the builders see it: its bounds, their centroid, and the index
+// of the object in the source array.
+struct bvh_primitive_ref {
+    aabb box;
+    point3 centroid;
+    size_t index;
+};
+
+std::vector<bvh_primitive_ref> make_primitive_refs(
+    const std::vector<shared_ptr<hittable>>& objects, real time0, real time1);
+
+size_t sah_partition(
+    std::vector<bvh_primitive_ref>& refs, size_t start, size_t end,
+    const bvh_build_options& options, int* split_axis = nullptr, real* split_cost = nullptr);
 
 
 class bvh_node : public hittable {
 public:
-    bvh_node();
+    bvh_node() {}
 
-    bvh_node(const hittable_list& list, double time0, double time1)
+    bvh_node(const hittable_list& list, real time0, real time1)
         : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
     {}
 
+    // Builds the tree with binned SAH splits instead of random-axis median splits.
+    bvh_node(
+        const hittable_list& list, real time0, real time1, const bvh_build_options& options);
+
     bvh_node(
         const std::vector<shared_ptr<hittable>>& src_objects,
-        size_t start, size_t end, double time0, double time1);
+        size_t start, size_t end, real time0, real time1);
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    virtual void intersect_packet(ray_packet& p, uint32_t active) const override;
 
 public:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb box;
+
+private:
+    void build_median(
+        std::vector<shared_ptr<hittable>>& objects,
+        size_t start, size_t end, real time0, real time1);
+
+    static shared_ptr<hittable> build_sah(
+        const std::vector<shared_ptr<hittable>>& objects, std::vector<bvh_primitive_ref>& refs,
+        size_t start, size_t end, const bvh_build_options& options);
 };
 
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
+inline bool box_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b, int axis) {
     aabb box_a;
     aabb box_b;
 
@@ -54,25 +113,33 @@ inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable>
 }
 
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 0);
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 1);
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
     return box_compare(a, b, 2);
 }
 
 
 bvh_node::bvh_node(
     const std::vector<shared_ptr<hittable>>& src_objects,
-    size_t start, size_t end, double time0, double time1
+    size_t start, size_t end, real time0, real time1
 ) {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
+    // Copy the range once and sort it in place at every level below.
+    std::vector<shared_ptr<hittable>> objects(src_objects.begin() + start, src_objects.begin() + end);
+    build_median(objects, 0, objects.size(), time0, time1);
+}
+
 
+void bvh_node::build_median(
+    std::vector<shared_ptr<hittable>>& objects,
+    size_t start, size_t end, real time0, real time1
+) {
     int axis = random_int(0, 2);
     auto comparator = (axis == 0) ? box_x_compare
         : (axis == 1) ? box_y_compare
@@ -97,8 +164,12 @@ bvh_node::bvh_node(
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
         auto mid = start + object_span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+        auto left_node = make_shared<bvh_node>();
+        left_node->build_median(objects, start, mid, time0, time1);
+        auto right_node = make_shared<bvh_node>();
+        right_node->build_median(objects, mid, end, time0, time1);
+        left = left_node;
+        right = right_node;
     }
 
     aabb box_left, box_right;
@@ -112,21 +183,251 @@ bvh_node::bvh_node(
 }
 
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+std::vector<bvh_primitive_ref> make_primitive_refs(
+    const std::vector<shared_ptr<hittable>>& objects, real time0, real time1
+) {
+    std::vector<bvh_primitive_ref> refs(objects.size());
+
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (!objects[i]->bounding_box(time0, time1, refs[i].box))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        refs[i].centroid = refs[i].box.centroid();
+        refs[i].index = i;
+    }
+
+    return refs;
+}
+
+
+// Reorders refs[start, end) around the cheapest binned SAH split and returns the
+// split position, or returns end when keeping the range as one leaf is cheaper.
+// The axis and SAH cost of the chosen split are stored in split_axis and
+// split_cost when they are given; a fallback median split costs infinity.
+size_t sah_partition(
+    std::vector<bvh_primitive_ref>& refs, size_t start, size_t end,
+    const bvh_build_options& options, int* split_axis, real* split_cost
+) {
+    size_t count = end - start;
+    if (split_cost) *split_cost = infinity;
+    if (count <= 1)
+        return end;
+
+    aabb bounds = aabb::empty();
+    aabb centroid_bounds = aabb::empty();
+    for (size_t i = start; i < end; i++) {
+        bounds.expand(refs[i].box);
+        centroid_bounds.expand(refs[i].centroid);
+    }
+
+    const int bins = std::min(std::max(options.bin_count, 2), bvh_build_options::max_bins);
+    const real leaf_cost = options.intersection_cost * count;
+    const real inv_area = 1.0 / std::max(bounds.surface_area(), real(1e-12));
+
+    // Bin all three axes in one pass over the references.
+    real lo[3], scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        lo[axis] = centroid_bounds.min()[axis];
+        real extent = centroid_bounds.max()[axis] - lo[axis];
+        scale[axis] = extent > 0 ? bins / extent : 0;
+    }
+
+    auto bin_of = [&](const point3& c, int axis) {
+        return std::min(bins - 1, static_cast<int>((c[axis] - lo[axis]) * scale[axis]));
+    };
+
+    aabb bin_boxes[3][bvh_build_options::max_bins];
+    size_t bin_counts[3][bvh_build_options::max_bins];
+    for (int axis = 0; axis < 3; axis++) {
+        std::fill(bin_boxes[axis], bin_boxes[axis] + bins, aabb::empty());
+        std::fill(bin_counts[axis], bin_counts[axis] + bins, 0);
+    }
+
+    for (size_t i = start; i < end; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            int b = bin_of(refs[i].centroid, axis);
+            bin_boxes[axis][b].expand(refs[i].box);
+            bin_counts[axis][b]++;
+        }
+    }
+
+    real best_cost = infinity;
+    int best_axis = -1;
+    int best_bin = 0;
+
+    real right_area[bvh_build_options::max_bins];
+    size_t right_count[bvh_build_options::max_bins];
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0)
+            continue;
+
+        // Sweep from the right to get the area and count right of each plane...
+        aabb acc = aabb::empty();
+        size_t n = 0;
+        for (int b = bins - 1; b > 0; b--) {
+            acc.expand(bin_boxes[axis][b]);
+            n += bin_counts[axis][b];
+            right_area[b] = acc.surface_area();
+            right_count[b] = n;
+        }
+
+        // ...then from the left, pricing the split in front of bin b.
+        acc = aabb::empty();
+        n = 0;
+        for (int b = 1; b < bins; b++) {
+            acc.expand(bin_boxes[axis][b - 1]);
+            n += bin_counts[axis][b - 1];
+            if (n == 0 || right_count[b] == 0)
+                continue;
+
+            real cost = options.traversal_cost + options.intersection_cost * inv_area
+                * (acc.surface_area() * n + right_area[b] * right_count[b]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (count <= size_t(std::max(options.max_leaf_size, 1)) && leaf_cost <= best_cost)
+        return end;
+
+    if (best_axis < 0) {
+        // Every centroid coincides; split the range in half.
+        if (split_axis) *split_axis = 0;
+        return start + count / 2;
+    }
+
+    if (split_axis) *split_axis = best_axis;
+    if (split_cost) *split_cost = best_cost;
+
+    auto mid = std::partition(refs.begin() + start, refs.begin() + end,
+        [&](const bvh_primitive_ref& ref) { return bin_of(ref.centroid, best_axis) < best_bin; });
+
+    return static_cast<size_t>(mid - refs.begin());
+}
+
+
+bvh_node::bvh_node(
+    const hittable_list& list, real time0, real time1, const bvh_build_options& options
+) {
+    auto refs = make_primitive_refs(list.objects, time0, time1);
+    auto root = build_sah(list.objects, refs, 0, refs.size(), options);
+
+    auto root_node = std::dynamic_pointer_cast<bvh_node>(root);
+    if (root_node) {
+        left = root_node->left;
+        right = root_node->right;
+        box = root_node->box;
+    }
+    else {
+        left = right = root;
+        root->bounding_box(time0, time1, box);
+    }
+}
+
+
+shared_ptr<hittable> bvh_node::build_sah(
+    const std::vector<shared_ptr<hittable>>& objects, std::vector<bvh_primitive_ref>& refs,
+    size_t start, size_t end, const bvh_build_options& options
+) {
+    if (end - start == 1)
+        return objects[refs[start].index];
+
+    auto mid = sah_partition(refs, start, end, options);
+
+    if (mid == end) {
+        auto leaf = make_shared<hittable_list>();
+        for (size_t i = start; i < end; i++)
+            leaf->add(objects[refs[i].index]);
+        return leaf;
+    }
+
+    auto node = make_shared<bvh_node>();
+    node->left = build_sah(objects, refs, start, mid, options);
+    node->right = build_sah(objects, refs, mid, end, options);
+    node->box = aabb::empty();
+    for (size_t i = start; i < end; i++)
+        node->box = surrounding_box(node->box, refs[i].box);
+
+    return node;
+}
+
+
+bool bvh_node::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     if (!box.hit(r, t_min, t_max))
         return false;
 
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    bool hit_left = left->intersect(r, t_min, t_max, hit);
+    bool hit_right = right->intersect(r, t_min, hit_left ? hit.t : t_max, hit);
 
     return hit_left || hit_right;
 }
 
 
-bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
+// One box test for the packet, then both children in the same order as
+// intersect(). A lone ray left in a subtree gains nothing from the packet and
+// takes the scalar path.
+void bvh_node::intersect_packet(ray_packet& p, uint32_t active) const {
+    if (!p.coherent || !(active & (active - 1))) {
+        hittable::intersect_packet(p, active);
+        return;
+    }
+
+    real lo[3] = { box.min().x(), box.min().y(), box.min().z() };
+    real hi[3] = { box.max().x(), box.max().y(), box.max().z() };
+    if (!p.frustum_hits(lo, hi, active))
+        return;
+    active &= p.box_lanes<false>(lo, hi);
+    if (!active)
+        return;
+
+    left->intersect_packet(p, active);
+    right->intersect_packet(p, active);
+}
+
+
+bool bvh_node::occluded(const ray& r, real t_min, real t_max) const {
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
+}
+
+
+bool bvh_node::bounding_box(real time0, real time1, aabb& output_box) const {
     output_box = box;
     return true;
 }
 
 
+// Expected cost of one ray query against a tree of bvh_nodes, hittable_list
+// leaves and single objects under the surface area heuristic. It applies to
+// trees from either constructor, so the two builders can be compared per scene.
+real bvh_sah_cost(const hittable& node, const bvh_build_options& options) {
+    if (auto list = dynamic_cast<const hittable_list*>(&node))
+        return options.intersection_cost * list->objects.size();
+
+    auto inner = dynamic_cast<const bvh_node*>(&node);
+    if (!inner)
+        return options.intersection_cost;
+
+    auto area = inner->box.surface_area();
+    if (area <= 0)
+        area = 1e-12;
+
+    real cost = options.traversal_cost;
+    for (const auto& child : { inner->left, inner->right }) {
+        aabb child_box;
+        child->bounding_box(0, 1, child_box);
+        cost += child_box.surface_area() / area * bvh_sah_cost(*child, options);
+        if (inner->left == inner->right)
+            break;
+    }
+
+    return cost;
+}
+
+
 #endif
@@ -0,0 +1,251 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Cache file layout: this header, then the node, index and cost arrays, each
+// starting on a 64-byte boundary, exactly as linear_bvh_tree holds them. A file
+// is only used if every field of the header matches what this build expects.
+struct bvh_cache_header {
+    static const uint32_t current_version = 1;
+    static const uint32_t byte_order_mark = 0x01020304;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t node_size;
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t node_count;
+    uint64_t index_count;
+    uint64_t nodes_offset;
+    uint64_t indices_offset;
+    uint64_t costs_offset;
+};
+
+inline uint64_t bvh_cache_align(uint64_t offset) {
+    return (offset + 63) & ~uint64_t(63);
+}
+
+// Identifies a build by everything that decides its result: the primitives'
+// bounds in order, the builder options and the file format.
+inline uint64_t bvh_cache_key(
+    const std::vector<bvh_primitive_ref>& refs, const bvh_build_options& options
+) {
+    uint64_t h = hash_mix(bvh_cache_header::current_version ^ (uint64_t(sizeof(linear_bvh_node)) << 32));
+    auto mix = [&h](double x) {
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        h = hash_mix(h ^ bits);
+    };
+
+    mix(double(refs.size()));
+    for (const auto& ref : refs) {
+        for (int a = 0; a < 3; a++) {
+            mix(ref.box.min()[a]);
+            mix(ref.box.max()[a]);
+        }
+    }
+
+    mix(options.bin_count);
+    mix(options.max_leaf_size);
+    mix(options.traversal_cost);
+    mix(options.intersection_cost);
+    mix(options.spatial_split_budget);
+    mix(options.spatial_split_alpha);
+    return h;
+}
+
+inline std::string bvh_cache_path(const std::string& dir, uint64_t key) {
+    char name[40];
+    snprintf(name, sizeof(name), "bvh_%016llx.bin", static_cast<unsigned long long>(key));
+    return dir.empty() ? std::string(name) : dir + "/" + name;
+}
+
+// Checks that the mapped arrays form a tree the traversals can walk. Walking
+// from the root, every node must be reached exactly once and no deeper than
+// the traversal stacks allow, children must follow their parent (refit()
+// relies on it), leaf ranges must lie in the index array and hold no more
+// than the builder puts in a leaf, and every index must name one of the
+// primitives. A file that passes the header checks can still be corrupt, and
+// these are what a render trusts.
+inline bool bvh_cache_is_valid(
+    const linear_bvh_node* nodes, uint64_t node_count,
+    const uint32_t* indices, uint64_t index_count,
+    size_t primitive_count, const bvh_build_options& options
+) {
+    // The builder only exceeds max_leaf_size where it stops splitting, at the
+    // deepest level the stack allows.
+    const uint64_t max_leaf_size = static_cast<uint64_t>(std::max(options.max_leaf_size, 1));
+    const int leaf_depth = linear_bvh_tree::max_depth - 1;
+
+    struct entry {
+        uint64_t node;
+        int depth;
+    };
+    std::vector<entry> stack{ { 0, 0 } };
+    std::vector<bool> reached(static_cast<size_t>(node_count), false);
+    uint64_t reached_count = 0;
+
+    while (!stack.empty()) {
+        auto e = stack.back();
+        stack.pop_back();
+        if (e.depth >= linear_bvh_tree::max_depth || reached[e.node])
+            return false;
+        reached[e.node] = true;
+        reached_count++;
+
+        const auto& n = nodes[e.node];
+        if (n.is_leaf()) {
+            if (n.offset > index_count || n.count > index_count - n.offset
+                || (n.count > max_leaf_size && e.depth < leaf_depth))
+                return false;
+        }
+        else {
+            if (e.node + 1 >= node_count || n.offset <= e.node + 1 || n.offset >= node_count)
+                return false;
+            stack.push_back({ n.offset, e.depth + 1 });
+            stack.push_back({ e.node + 1, e.depth + 1 });
+        }
+    }
+    if (reached_count != node_count)
+        return false;
+
+    for (uint64_t k = 0; k < index_count; k++)
+        if (indices[k] >= primitive_count)
+            return false;
+    return true;
+}
+
+// Points tree at the arrays in a mapped cache file. Returns false, leaving the
+// tree alone, if the file is missing, truncated, was written for another key,
+// format version or node layout, or holds a tree that is not valid over
+// primitive_count primitives built with options.
+inline bool load_bvh_cache(
+    const std::string& path, uint64_t key, size_t primitive_count,
+    const bvh_build_options& options, linear_bvh_tree& tree
+) {
+    auto file = mapped_file::open(path);
+    if (!file || file->size() < sizeof(bvh_cache_header))
+        return false;
+
+    bvh_cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, "RTBVHC", 7) != 0
+        || header.version != bvh_cache_header::current_version
+        || header.byte_order != bvh_cache_header::byte_order_mark
+        || header.node_size != sizeof(linear_bvh_node)
+        || header.key != key
+        || header.node_count == 0)
+        return false;
+
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % 64 == 0 && offset <= file->size()
+            && count <= (file->size() - offset) / size;
+    };
+    if (!fits(header.nodes_offset, header.node_count, sizeof(linear_bvh_node))
+        || !fits(header.indices_offset, header.index_count, sizeof(uint32_t))
+        || !fits(header.costs_offset, header.node_count, sizeof(float)))
+        return false;
+
+    auto nodes = reinterpret_cast<const linear_bvh_node*>(file->data() + header.nodes_offset);
+    auto indices = reinterpret_cast<const uint32_t*>(file->data() + header.indices_offset);
+    if (!bvh_cache_is_valid(
+            nodes, header.node_count, indices, header.index_count, primitive_count, options))
+        return false;
+
+    tree.nodes.clear();
+    tree.indices.clear();
+    tree.built_cost.clear();
+    tree.mapped_nodes = nodes;
+    tree.mapped_indices = indices;
+    tree.mapped_costs = reinterpret_cast<const float*>(file->data() + header.costs_offset);
+    tree.mapped_node_count = static_cast<size_t>(header.node_count);
+    tree.mapped_index_count = static_cast<size_t>(header.index_count);
+    tree.mapping = file;
+    return true;
+}
+
+// Writes tree to path. The file is written under a temporary name and renamed
+// into place, so a concurrent reader never maps a partial file.
+inline bool save_bvh_cache(const std::string& path, uint64_t key, const linear_bvh_tree& tree) {
+    bvh_cache_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "RTBVHC", 7);
+    header.version = bvh_cache_header::current_version;
+    header.byte_order = bvh_cache_header::byte_order_mark;
+    header.node_size = sizeof(linear_bvh_node);
+    header.key = key;
+    header.node_count = tree.node_count();
+    header.index_count = tree.index_count();
+    header.nodes_offset = bvh_cache_align(sizeof(header));
+    header.indices_offset = bvh_cache_align(header.nodes_offset + header.node_count * sizeof(linear_bvh_node));
+    header.costs_offset = bvh_cache_align(header.indices_offset + header.index_count * sizeof(uint32_t));
+
+    auto temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        auto write_at = [&](uint64_t offset, const void* data, size_t bytes) {
+            static const char zeros[64] = {};
+            auto pos = static_cast<uint64_t>(out.tellp());
+            out.write(zeros, static_cast<std::streamsize>(offset - pos));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        };
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_at(header.nodes_offset, tree.node_data(), header.node_count * sizeof(linear_bvh_node));
+        write_at(header.indices_offset, tree.index_data(), header.index_count * sizeof(uint32_t));
+        write_at(header.costs_offset, tree.cost_data(), header.node_count * sizeof(float));
+        if (!out)
+            return false;
+    }
+
+    // rename() replaces the target atomically on POSIX but fails on Windows if
+    // it exists, so remove it there and try again.
+    if (std::rename(temp.c_str(), path.c_str()) == 0)
+        return true;
+    std::remove(path.c_str());
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// Maps the tree for refs from the cache in dir when an earlier run built the
+// same thing, and otherwise builds it and writes it there for the next run.
+// Returns true when the tree came from the cache.
+inline bool build_with_cache(
+    linear_bvh_tree& tree, std::vector<bvh_primitive_ref>& refs,
+    const bvh_build_options& options, const std::string& dir
+) {
+    auto key = bvh_cache_key(refs, options);
+    auto path = bvh_cache_path(dir, key);
+
+    auto start_time = std::chrono::steady_clock::now();
+    if (load_bvh_cache(path, key, refs.size(), options, tree)) {
+        tree.build_stats = bvh_build_stats();
+        tree.build_stats.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+        return true;
+    }
+
+    tree.build(refs, options);
+    if (!save_bvh_cache(path, key, tree))
+        std::cerr << "Could not write BVH cache " << path << ".\n";
+    return false;
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "vec3.h"
 #include "rtweekend.h"
 #include <iostream>
+#include <fstream>
 
 void write_color(std::ofstream& out, color pixel_color, int samples_per_pixel) {
     auto r = pixel_color.x();
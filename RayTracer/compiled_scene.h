@@ -0,0 +1,508 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "rtweekend.h"
+
+#include "aarect.h"
+#include "box.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "lazy_bvh.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "motion_bvh.h"
+#include "moving_sphere.h"
+#include "sphere.h"
+#include "texture.h"
+#include "wide_bvh.h"
+
+#include <cstdint>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// A hit from compiled_scene: the usual record plus the compiled material, or
+// no_material when the object that was hit leaves its material to rec.mat_ptr.
+struct compiled_hit {
+    hit_record rec;
+    uint32_t material;
+};
+
+// A render-time form of a scene built with the hittable / material / texture
+// classes, which stay the authoring API. The scene is flattened through lists
+// and BVHs; primitives of the built-in types are copied into one array per
+// type, materials and textures become tagged entries, and one linear BVH is
+// built over everything. Hits, scattering, emission and texture lookups then
+// dispatch with a switch on the tag and call the type's own member functions
+// non-virtually, so the compiler can inline them (their kernels are declared
+// inline for that). In a scene of a single primitive kind the per-primitive
+// switch is resolved once per ray instead.
+//
+// Types are matched exactly (a subclass may override what is being inlined);
+// anything else (wrappers, media, meshes, sphere sets, derived types) is kept
+// as an object and called virtually, as are materials and textures outside
+// the built-in set.
+class compiled_scene : public hittable {
+public:
+    // mixed is not the kind of any primitive: it marks a scene of several kinds.
+    enum class primitive_kind : uint8_t {
+        sphere, moving_sphere, xy_rect, xz_rect, yz_rect, box, object, mixed
+    };
+    enum class material_kind : uint8_t { lambertian, metal, dielectric, diffuse_light, isotropic, other };
+    enum class texture_kind : uint8_t { solid, checker, noise, image, other };
+
+    static const uint32_t no_material = UINT32_MAX;
+
+    struct primitive_entry {
+        primitive_kind kind;
+        uint32_t index;     // into the array for kind
+        uint32_t material;  // no_material for objects
+    };
+
+    struct material_entry {
+        material_kind kind;
+        uint32_t texture;   // albedo or emission, for the kinds that have one
+        const material* source;
+    };
+
+    struct texture_entry {
+        texture_kind kind;
+        color value;        // solid
+        uint32_t even, odd; // checker
+        const texture* source;
+    };
+
+    compiled_scene(
+        const hittable_list& world, real time0, real time1,
+        const bvh_build_options& options = bvh_build_options());
+
+    bool hit(const ray& r, real t_min, real t_max, compiled_hit& hit) const;
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        compiled_hit h;
+        if (!hit(r, t_min, t_max, h))
+            return false;
+        rec = h.rec;
+        return true;
+    }
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+        if (tree.empty())
+            return false;
+        output_box = tree.bounds();
+        return true;
+    }
+
+    // material::emitted() and material::scatter() for the material of a hit.
+    color emitted(const compiled_hit& hit) const;
+    bool scatter(const ray& r_in, const compiled_hit& hit, color& attenuation, ray& scattered) const;
+
+    color texture_value(uint32_t id, real u, real v, const point3& p) const;
+
+    size_t compiled_count() const { return primitives.size() - objects.size(); }
+
+public:
+    std::vector<sphere> spheres;
+    std::vector<moving_sphere> moving_spheres;
+    std::vector<xy_rect> xy_rects;
+    std::vector<xz_rect> xz_rects;
+    std::vector<yz_rect> yz_rects;
+    std::vector<box> boxes;
+    std::vector<shared_ptr<hittable>> objects;
+
+    std::vector<primitive_entry> primitives;
+    std::vector<material_entry> materials;
+    std::vector<texture_entry> textures;
+    linear_bvh_tree tree;
+    bool scan = false;  // the tree is a single leaf: test every primitive in order
+    primitive_kind uniform_kind = primitive_kind::mixed;  // shared by every primitive, if any
+
+private:
+    void add_object(const shared_ptr<hittable>& object);
+    uint32_t add_material(const material* m);
+    uint32_t add_texture(const texture* t);
+
+    template <typename T>
+    void add_primitive(primitive_kind kind, std::vector<T>& array, const T& object, const material* m) {
+        primitives.push_back({ kind, static_cast<uint32_t>(array.size()), add_material(m) });
+        array.push_back(object);
+    }
+
+    const hittable& primitive(const primitive_entry& p) const;
+
+    // tree.traverse(), except that a scene small enough to be one leaf is
+    // scanned like a list: entering the tree would cost more than its box saves.
+    template <bool any_hit = false, typename Intersect>
+    bool traverse(const ray& r, real t_min, real t_max, Intersect&& intersect) const {
+        if (!scan)
+            return tree.traverse<any_hit>(r, t_min, t_max, intersect);
+
+        bool hit_anything = false;
+        for (uint32_t i = 0; i < primitives.size(); i++) {
+            if (intersect(i, t_min, t_max)) {
+                if (any_hit)
+                    return true;
+                hit_anything = true;
+            }
+        }
+        return hit_anything;
+    }
+
+    // Per-primitive dispatch. In a scene of one kind, K is that kind and the
+    // switch folds away; otherwise K is mixed and the entry's tag decides.
+    template <primitive_kind K>
+    bool hit_as(const ray& r, real t_min, real t_max, compiled_hit& hit) const;
+
+    template <primitive_kind K>
+    bool occluded_as(const ray& r, real t_min, real t_max) const {
+        return traverse<true>(r, t_min, t_max, [&](uint32_t index, real t0, real t1) {
+            return occluded_primitive<K>(primitives[index], r, t0, t1);
+        });
+    }
+
+    template <primitive_kind K>
+    bool intersect_primitive(
+        const primitive_entry& p, const ray& r, real t_min, real t_max, surface_hit& hit) const {
+        switch (K == primitive_kind::mixed ? p.kind : K) {
+        case primitive_kind::sphere:
+            return spheres[p.index].sphere::intersect(r, t_min, t_max, hit);
+        case primitive_kind::moving_sphere:
+            return moving_spheres[p.index].moving_sphere::intersect(r, t_min, t_max, hit);
+        case primitive_kind::xy_rect:
+            return xy_rects[p.index].xy_rect::intersect(r, t_min, t_max, hit);
+        case primitive_kind::xz_rect:
+            return xz_rects[p.index].xz_rect::intersect(r, t_min, t_max, hit);
+        case primitive_kind::yz_rect:
+            return yz_rects[p.index].yz_rect::intersect(r, t_min, t_max, hit);
+        case primitive_kind::box:
+            return boxes[p.index].box::intersect(r, t_min, t_max, hit);
+        default:
+            return objects[p.index]->intersect(r, t_min, t_max, hit);
+        }
+    }
+
+    template <primitive_kind K>
+    bool occluded_primitive(const primitive_entry& p, const ray& r, real t_min, real t_max) const {
+        switch (K == primitive_kind::mixed ? p.kind : K) {
+        case primitive_kind::sphere:
+            return spheres[p.index].sphere::occluded(r, t_min, t_max);
+        case primitive_kind::moving_sphere:
+            return moving_spheres[p.index].moving_sphere::occluded(r, t_min, t_max);
+        case primitive_kind::xy_rect:
+            return xy_rects[p.index].xy_rect::occluded(r, t_min, t_max);
+        case primitive_kind::xz_rect:
+            return xz_rects[p.index].xz_rect::occluded(r, t_min, t_max);
+        case primitive_kind::yz_rect:
+            return yz_rects[p.index].yz_rect::occluded(r, t_min, t_max);
+        case primitive_kind::box:
+            return boxes[p.index].box::occluded(r, t_min, t_max);
+        default:
+            return objects[p.index]->occluded(r, t_min, t_max);
+        }
+    }
+
+    template <primitive_kind K>
+    void resolve_primitive(
+        const primitive_entry& p, const ray& r, const surface_hit& hit, hit_record& rec) const {
+        switch (K == primitive_kind::mixed ? p.kind : K) {
+        case primitive_kind::sphere: spheres[p.index].sphere::resolve_hit(r, hit, rec); break;
+        case primitive_kind::moving_sphere: moving_spheres[p.index].moving_sphere::resolve_hit(r, hit, rec); break;
+        case primitive_kind::xy_rect: xy_rects[p.index].xy_rect::resolve_hit(r, hit, rec); break;
+        case primitive_kind::xz_rect: xz_rects[p.index].xz_rect::resolve_hit(r, hit, rec); break;
+        case primitive_kind::yz_rect: yz_rects[p.index].yz_rect::resolve_hit(r, hit, rec); break;
+        case primitive_kind::box: boxes[p.index].box::resolve_hit(r, hit, rec); break;
+        default: resolve_surface_hit(r, hit, rec); break;
+        }
+    }
+
+    std::unordered_set<const hittable*> visited;
+    std::unordered_map<const material*, uint32_t> material_ids;
+    std::unordered_map<const texture*, uint32_t> texture_ids;
+};
+
+compiled_scene::compiled_scene(
+    const hittable_list& world, real time0, real time1, const bvh_build_options& options
+) {
+    for (const auto& object : world.objects)
+        add_object(object);
+
+    std::vector<bvh_primitive_ref> refs(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++) {
+        if (!primitive(primitives[i]).bounding_box(time0, time1, refs[i].box))
+            std::cerr << "No bounding box in compiled_scene constructor.\n";
+        refs[i].centroid = refs[i].box.centroid();
+        refs[i].index = i;
+    }
+    // Inlined primitive tests cost little next to a node visit, so leaves
+    // may hold a few of them.
+    auto tree_options = options;
+    tree_options.max_leaf_size = std::max(options.max_leaf_size, 4);
+    tree_options.intersection_cost *= 0.5;
+    tree.build(refs, tree_options);
+    scan = tree.node_count() == 1;
+
+    if (!primitives.empty() && primitives[0].kind != primitive_kind::object) {
+        uniform_kind = primitives[0].kind;
+        for (const auto& p : primitives)
+            if (p.kind != uniform_kind)
+                uniform_kind = primitive_kind::mixed;
+    }
+
+    visited.clear();
+    material_ids.clear();
+    texture_ids.clear();
+}
+
+void compiled_scene::add_object(const shared_ptr<hittable>& object) {
+    const auto& type = typeid(*object);
+
+    // Aggregates are opened up; their contents join the one compiled tree.
+    if (type == typeid(hittable_list)) {
+        for (const auto& child : static_cast<const hittable_list&>(*object).objects)
+            add_object(child);
+        return;
+    }
+    if (type == typeid(bvh_node)) {
+        // A median-split node over one object holds it on both sides.
+        const auto& node = static_cast<const bvh_node&>(*object);
+        add_object(node.left);
+        add_object(node.right);
+        return;
+    }
+    const std::vector<shared_ptr<hittable>>* children = nullptr;
+    if (type == typeid(linear_bvh))
+        children = &static_cast<const linear_bvh&>(*object).objects;
+    else if (type == typeid(wide_bvh))
+        children = &static_cast<const wide_bvh&>(*object).objects;
+    else if (type == typeid(motion_bvh))
+        children = &static_cast<const motion_bvh&>(*object).objects;
+    else if (type == typeid(lazy_bvh))
+        children = &static_cast<const lazy_bvh&>(*object).objects;
+    if (children) {
+        for (const auto& child : *children)
+            add_object(child);
+        return;
+    }
+
+    if (!visited.insert(object.get()).second)
+        return;
+
+    if (type == typeid(sphere)) {
+        const auto& s = static_cast<const sphere&>(*object);
+        add_primitive(primitive_kind::sphere, spheres, s, s.mat_ptr.get());
+    }
+    else if (type == typeid(moving_sphere)) {
+        const auto& s = static_cast<const moving_sphere&>(*object);
+        add_primitive(primitive_kind::moving_sphere, moving_spheres, s, s.mat_ptr.get());
+    }
+    else if (type == typeid(xy_rect)) {
+        const auto& rect = static_cast<const xy_rect&>(*object);
+        add_primitive(primitive_kind::xy_rect, xy_rects, rect, rect.mp.get());
+    }
+    else if (type == typeid(xz_rect)) {
+        const auto& rect = static_cast<const xz_rect&>(*object);
+        add_primitive(primitive_kind::xz_rect, xz_rects, rect, rect.mp.get());
+    }
+    else if (type == typeid(yz_rect)) {
+        const auto& rect = static_cast<const yz_rect&>(*object);
+        add_primitive(primitive_kind::yz_rect, yz_rects, rect, rect.mp.get());
+    }
+    else if (type == typeid(box)) {
+        const auto& b = static_cast<const box&>(*object);
+        add_primitive(primitive_kind::box, boxes, b, b.mp.get());
+    }
+    else {
+        primitives.push_back({ primitive_kind::object, static_cast<uint32_t>(objects.size()), no_material });
+        objects.push_back(object);
+    }
+}
+
+uint32_t compiled_scene::add_material(const material* m) {
+    auto found = material_ids.find(m);
+    if (found != material_ids.end())
+        return found->second;
+
+    material_entry entry{ material_kind::other, 0, m };
+    const auto& type = typeid(*m);
+    if (type == typeid(lambertian)) {
+        entry.kind = material_kind::lambertian;
+        entry.texture = add_texture(static_cast<const lambertian*>(m)->albedo.get());
+    }
+    else if (type == typeid(metal)) {
+        entry.kind = material_kind::metal;
+    }
+    else if (type == typeid(dielectric)) {
+        entry.kind = material_kind::dielectric;
+    }
+    else if (type == typeid(diffuse_light)) {
+        entry.kind = material_kind::diffuse_light;
+        entry.texture = add_texture(static_cast<const diffuse_light*>(m)->emit.get());
+    }
+    else if (type == typeid(isotropic)) {
+        entry.kind = material_kind::isotropic;
+        entry.texture = add_texture(static_cast<const isotropic*>(m)->albedo.get());
+    }
+
+    auto id = static_cast<uint32_t>(materials.size());
+    materials.push_back(entry);
+    material_ids[m] = id;
+    return id;
+}
+
+uint32_t compiled_scene::add_texture(const texture* t) {
+    auto found = texture_ids.find(t);
+    if (found != texture_ids.end())
+        return found->second;
+
+    texture_entry entry{ texture_kind::other, color(0, 0, 0), 0, 0, t };
+    const auto& type = typeid(*t);
+    if (type == typeid(solid_color)) {
+        entry.kind = texture_kind::solid;
+        entry.value = t->value(0, 0, point3(0, 0, 0));
+    }
+    else if (type == typeid(checker_texture)) {
+        auto checker = static_cast<const checker_texture*>(t);
+        entry.kind = texture_kind::checker;
+        entry.even = add_texture(checker->even.get());
+        entry.odd = add_texture(checker->odd.get());
+    }
+    else if (type == typeid(noise_texture)) {
+        entry.kind = texture_kind::noise;
+    }
+    else if (type == typeid(image_texture)) {
+        entry.kind = texture_kind::image;
+    }
+
+    // Children were added first, so this entry goes after them.
+    auto id = static_cast<uint32_t>(textures.size());
+    textures.push_back(entry);
+    texture_ids[t] = id;
+    return id;
+}
+
+const hittable& compiled_scene::primitive(const primitive_entry& p) const {
+    switch (p.kind) {
+    case primitive_kind::sphere: return spheres[p.index];
+    case primitive_kind::moving_sphere: return moving_spheres[p.index];
+    case primitive_kind::xy_rect: return xy_rects[p.index];
+    case primitive_kind::xz_rect: return xz_rects[p.index];
+    case primitive_kind::yz_rect: return yz_rects[p.index];
+    case primitive_kind::box: return boxes[p.index];
+    default: return *objects[p.index];
+    }
+}
+
+bool compiled_scene::hit(const ray& r, real t_min, real t_max, compiled_hit& hit) const {
+    switch (uniform_kind) {
+    case primitive_kind::sphere: return hit_as<primitive_kind::sphere>(r, t_min, t_max, hit);
+    case primitive_kind::moving_sphere: return hit_as<primitive_kind::moving_sphere>(r, t_min, t_max, hit);
+    case primitive_kind::xy_rect: return hit_as<primitive_kind::xy_rect>(r, t_min, t_max, hit);
+    case primitive_kind::xz_rect: return hit_as<primitive_kind::xz_rect>(r, t_min, t_max, hit);
+    case primitive_kind::yz_rect: return hit_as<primitive_kind::yz_rect>(r, t_min, t_max, hit);
+    case primitive_kind::box: return hit_as<primitive_kind::box>(r, t_min, t_max, hit);
+    default: return hit_as<primitive_kind::mixed>(r, t_min, t_max, hit);
+    }
+}
+
+bool compiled_scene::occluded(const ray& r, real t_min, real t_max) const {
+    switch (uniform_kind) {
+    case primitive_kind::sphere: return occluded_as<primitive_kind::sphere>(r, t_min, t_max);
+    case primitive_kind::moving_sphere: return occluded_as<primitive_kind::moving_sphere>(r, t_min, t_max);
+    case primitive_kind::xy_rect: return occluded_as<primitive_kind::xy_rect>(r, t_min, t_max);
+    case primitive_kind::xz_rect: return occluded_as<primitive_kind::xz_rect>(r, t_min, t_max);
+    case primitive_kind::yz_rect: return occluded_as<primitive_kind::yz_rect>(r, t_min, t_max);
+    case primitive_kind::box: return occluded_as<primitive_kind::box>(r, t_min, t_max);
+    default: return occluded_as<primitive_kind::mixed>(r, t_min, t_max);
+    }
+}
+
+template <compiled_scene::primitive_kind K>
+bool compiled_scene::hit_as(const ray& r, real t_min, real t_max, compiled_hit& hit) const {
+    surface_hit h;
+    uint32_t closest = 0;
+    bool hit_anything = traverse(r, t_min, t_max, [&](uint32_t index, real t0, real& t1) {
+        if (!intersect_primitive<K>(primitives[index], r, t0, t1, h))
+            return false;
+        closest = index;
+        t1 = h.t;
+        return true;
+    });
+    if (!hit_anything)
+        return false;
+
+    const auto& p = primitives[closest];
+    resolve_primitive<K>(p, r, h, hit.rec);
+    hit.material = p.material;
+    return true;
+}
+
+color compiled_scene::emitted(const compiled_hit& hit) const {
+    const auto& rec = hit.rec;
+    if (hit.material == no_material)
+        return rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+    const auto& m = materials[hit.material];
+    switch (m.kind) {
+    case material_kind::diffuse_light:
+        return texture_value(m.texture, rec.u, rec.v, rec.p);
+    case material_kind::other:
+        return m.source->emitted(rec.u, rec.v, rec.p);
+    default:
+        return color(0, 0, 0);
+    }
+}
+
+bool compiled_scene::scatter(
+    const ray& r_in, const compiled_hit& hit, color& attenuation, ray& scattered
+) const {
+    const auto& rec = hit.rec;
+    if (hit.material == no_material)
+        return rec.mat_ptr->scatter(r_in, rec, attenuation, scattered);
+
+    const auto& m = materials[hit.material];
+    switch (m.kind) {
+    case material_kind::lambertian:
+        scattered = lambertian::scatter_ray(r_in, rec);
+        attenuation = texture_value(m.texture, rec.u, rec.v, rec.p);
+        return true;
+    case material_kind::metal:
+        return static_cast<const metal*>(m.source)->metal::scatter(r_in, rec, attenuation, scattered);
+    case material_kind::dielectric:
+        return static_cast<const dielectric*>(m.source)->dielectric::scatter(
+            r_in, rec, attenuation, scattered);
+    case material_kind::diffuse_light:
+        return false;
+    case material_kind::isotropic:
+        scattered = isotropic::scatter_ray(r_in, rec);
+        attenuation = texture_value(m.texture, rec.u, rec.v, rec.p);
+        return true;
+    default:
+        return m.source->scatter(r_in, rec, attenuation, scattered);
+    }
+}
+
+color compiled_scene::texture_value(uint32_t id, real u, real v, const point3& p) const {
+    while (true) {
+        const auto& t = textures[id];
+        switch (t.kind) {
+        case texture_kind::solid:
+            return t.value;
+        case texture_kind::checker:
+            id = checker_texture::odd_cell(p) ? t.odd : t.even;
+            continue;
+        case texture_kind::noise:
+            return static_cast<const noise_texture*>(t.source)->noise_texture::value(u, v, p);
+        case texture_kind::image:
+            return static_cast<const image_texture*>(t.source)->image_texture::value(u, v, p);
+        default:
+            return t.source->value(u, v, p);
+        }
+    }
+}
+
+#endif
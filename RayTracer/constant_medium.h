@@ -9,76 +9,86 @@
 
 class constant_medium : public hittable {
 public:
-    constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
+    constant_medium(shared_ptr<hittable> b, real d, shared_ptr<texture> a)
         : boundary(b),
         neg_inv_density(-1 / d),
         phase_function(make_shared<isotropic>(a))
     {}
 
-    constant_medium(shared_ptr<hittable> b, double d, color c)
+    constant_medium(shared_ptr<hittable> b, real d, color c)
         : boundary(b),
         neg_inv_density(-1 / d),
         phase_function(make_shared<isotropic>(c))
     {}
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    // The scattering distance is drawn here, once; resolve_hit() only fills
+    // in the record at the chosen point.
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
         return boundary->bounding_box(time0, time1, output_box);
     }
 
 public:
     shared_ptr<hittable> boundary;
     shared_ptr<material> phase_function;
-    double neg_inv_density;
+    real neg_inv_density;
 };
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool constant_medium::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     // Print occasional samples when debugging. To enable, set enableDebug true.
     const bool enableDebug = false;
     const bool debugging = enableDebug && random_double() < 0.00001;
 
-    hit_record rec1, rec2;
-
-    if (!boundary->hit(r, -infinity, infinity, rec1))
+    // Entry and exit in one call: a single slab test for a box boundary.
+    real t1, t2;
+    if (!boundary->hit_interval(r, t1, t2))
         return false;
 
-    if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2))
-        return false;
-
-    if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
+    if (debugging) std::cerr << "\nt_min=" << t1 << ", t_max=" << t2 << '\n';
 
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
+    if (t1 < t_min) t1 = t_min;
+    if (t2 > t_max) t2 = t_max;
 
-    if (rec1.t >= rec2.t)
+    if (t1 >= t2)
         return false;
 
-    if (rec1.t < 0)
-        rec1.t = 0;
+    if (t1 < 0)
+        t1 = 0;
 
     const auto ray_length = r.direction().length();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+    const auto distance_inside_boundary = (t2 - t1) * ray_length;
     const auto hit_distance = neg_inv_density * log(random_double());
 
     if (hit_distance > distance_inside_boundary)
         return false;
 
-    rec.t = rec1.t + hit_distance / ray_length;
-    rec.p = r.at(rec.t);
+    hit.set(t1 + hit_distance / ray_length, this);
 
     if (debugging) {
         std::cerr << "hit_distance = " << hit_distance << '\n'
-            << "rec.t = " << rec.t << '\n'
-            << "rec.p = " << rec.p << '\n';
+            << "hit.t = " << hit.t << '\n'
+            << "p = " << r.at(hit.t) << '\n';
     }
 
+    return true;
+}
+
+void constant_medium::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    rec.t = hit.t;
+    rec.p = r.at(rec.t);
+    rec.p_error = 0;             // inside the volume, not on a surface
     rec.normal = vec3(1, 0, 0);  // arbitrary
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
-
-    return true;
+    rec.mat_ptr = phase_function.get();
 }
 
 #endif
\ No newline at end of file
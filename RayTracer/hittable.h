@@ -4,57 +4,518 @@
 #include "ray.h"
 #include "rtweekend.h"
 #include "aabb.h"
+#include "simd.h"
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
 
 class material;
+class hittable;
+
+// A conservative bound on the rounding error of a few arithmetic operations on
+// values of magnitude up to x.
+inline real error_bound(real x) {
+    return 8 * std::numeric_limits<real>::epsilon() * x;
+}
+
+inline real max_abs(const vec3& v) {
+    return fmax(fabs(v.x()), fmax(fabs(v.y()), fabs(v.z())));
+}
+
+// Moves p, a point on a surface with normal n, off the surface to the side n
+// faces by a fixed number of units in the last place of each coordinate
+// (Waechter and Binder, "A Fast and Robust Method for Avoiding
+// Self-Intersection", Ray Tracing Gems, 2019). This covers the rounding of p
+// itself at any scale and in either precision.
+inline point3 offset_ray_origin(const point3& p, const vec3& n) {
+    // Near zero the spacing of values vanishes; there a tiny fixed step is used.
+    const real origin = real(1.0 / 32);
+    const real float_scale = real(1.0 / 65536);
+    const real int_scale = 256;
+
+    point3 q;
+    for (int a = 0; a < 3; a++) {
+        real x = p[a];
+        auto step = static_cast<real_bits>(int_scale * n[a]);
+        real_bits bits;
+        std::memcpy(&bits, &x, sizeof(x));
+        bits += (x < 0) ? -step : step;
+        real moved;
+        std::memcpy(&moved, &bits, sizeof(x));
+        q[a] = fabs(x) < origin ? x + float_scale * n[a] : moved;
+    }
+    return q;
+}
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
-    double t;
-    double u;
-    double v;
+    const material* mat_ptr;  // owned by the scene, which outlives every hit
+    real t;
+    real u;
+    real v;
+    real p_error = 0;  // how far p may be from the true surface, along any axis
     bool front_face;
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // Origin for a ray leaving the hit point in direction d: p moved off the
+    // surface, on the side d goes to, past the error of p, so the ray cannot
+    // find this hit again. This replaces a fixed t_min, which is too large for
+    // small scenes, too small for large ones and much too small in float; rays
+    // started here are traced from t_min = 0.
+    point3 spawn_point(const vec3& d) const {
+        vec3 n = dot(d, normal) < 0 ? -normal : normal;
+        real distance = p_error * (fabs(n.x()) + fabs(n.y()) + fabs(n.z()));
+        return offset_ray_origin(p + distance * n, n);
+    }
+};
+
+// What the intersection pass keeps about the closest hit so far: its distance,
+// the object that can work out the rest, and whatever that object needs to do
+// so (a primitive index and local coordinates). The wrappers the ray was
+// transformed by on its way down are kept too, innermost first, so that
+// resolve_hit() can map the ray down and the result back up.
+struct surface_hit {
+    static const int max_transforms = 4;
+
+    real t;
+    const hittable* object;
+    uint32_t primitive;
+    real b[3];                  // barycentrics or other local coordinates
+    real t_min, t_max;          // the interval object was searched over
+    const hittable* transforms[max_transforms];
+    int transform_count;
+    pcg32 replay;               // see push_transform()
+
+    // A hit at distance _t that _object resolves itself.
+    void set(real _t, const hittable* _object, uint32_t _primitive = 0) {
+        t = _t;
+        object = _object;
+        primitive = _primitive;
+        transform_count = 0;
+    }
+};
+
+// Index of the lowest set bit of a nonzero mask.
+inline int lowest_lane(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+    unsigned long k;
+    _BitScanForward(&k, mask);
+    return static_cast<int>(k);
+#else
+    int k = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        k++;
+    }
+    return k;
+#endif
+}
+
+const int ray_packet_max_size = 16;
+
+// The slab test of aabb::hit() (closed = false) or linear_bvh_node::hit()
+// (closed = true) from t_min = 0, for count rays from one origin at once: bit
+// k of the result is set where ray k's own test passes. offset_lo / offset_hi
+// are the box corners minus the origin. The near plane is picked per lane by
+// sign and max / min keep the old value on a NaN operand, as the scalar
+// ternaries do, so every lane rounds exactly like the scalar test.
+template <bool closed, typename T>
+uint32_t packet_slab_lanes_generic(
+    const T (*inv_dir)[ray_packet_max_size], const T* t_max, int count,
+    const T* offset_lo, const T* offset_hi
+) {
+    uint32_t mask = 0;
+    for (int k = 0; k < count; k++) {
+        T t0 = 0;
+        T t1 = t_max[k];
+        for (int a = 0; a < 3; a++) {
+            T inv = inv_dir[a][k];
+            T tl = offset_lo[a] * inv;
+            T th = offset_hi[a] * inv;
+            T tn = inv < 0 ? th : tl;
+            T tf = inv < 0 ? tl : th;
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        if (closed ? t0 <= t1 : t0 < t1)
+            mask |= 1u << k;
+    }
+    return mask;
+}
+
+#ifdef RT_X86
+// SSE2 versions: two lanes per instruction in double, four in float. count
+// must be a multiple of the width; ray_packet pads its arrays to that.
+template <bool closed>
+uint32_t packet_slab_lanes(
+    const double (*inv_dir)[ray_packet_max_size], const double* t_max, int count,
+    const double* offset_lo, const double* offset_hi
+) {
+    const __m128d zero = _mm_setzero_pd();
+    uint32_t mask = 0;
+    for (int k = 0; k < count; k += 2) {
+        __m128d t0 = zero;
+        __m128d t1 = _mm_load_pd(t_max + k);
+        for (int a = 0; a < 3; a++) {
+            __m128d inv = _mm_load_pd(inv_dir[a] + k);
+            __m128d tl = _mm_mul_pd(_mm_set1_pd(offset_lo[a]), inv);
+            __m128d th = _mm_mul_pd(_mm_set1_pd(offset_hi[a]), inv);
+            __m128d neg = _mm_cmplt_pd(inv, zero);
+            __m128d tn = _mm_or_pd(_mm_and_pd(neg, th), _mm_andnot_pd(neg, tl));
+            __m128d tf = _mm_or_pd(_mm_and_pd(neg, tl), _mm_andnot_pd(neg, th));
+            t0 = _mm_max_pd(tn, t0);
+            t1 = _mm_min_pd(tf, t1);
+        }
+        __m128d pass = closed ? _mm_cmple_pd(t0, t1) : _mm_cmplt_pd(t0, t1);
+        mask |= static_cast<uint32_t>(_mm_movemask_pd(pass)) << k;
+    }
+    return mask;
+}
+
+template <bool closed>
+uint32_t packet_slab_lanes(
+    const float (*inv_dir)[ray_packet_max_size], const float* t_max, int count,
+    const float* offset_lo, const float* offset_hi
+) {
+    const __m128 zero = _mm_setzero_ps();
+    uint32_t mask = 0;
+    for (int k = 0; k < count; k += 4) {
+        __m128 t0 = zero;
+        __m128 t1 = _mm_load_ps(t_max + k);
+        for (int a = 0; a < 3; a++) {
+            __m128 inv = _mm_load_ps(inv_dir[a] + k);
+            __m128 tl = _mm_mul_ps(_mm_set1_ps(offset_lo[a]), inv);
+            __m128 th = _mm_mul_ps(_mm_set1_ps(offset_hi[a]), inv);
+            __m128 neg = _mm_cmplt_ps(inv, zero);
+            __m128 tn = _mm_or_ps(_mm_and_ps(neg, th), _mm_andnot_ps(neg, tl));
+            __m128 tf = _mm_or_ps(_mm_and_ps(neg, tl), _mm_andnot_ps(neg, th));
+            t0 = _mm_max_ps(tn, t0);
+            t1 = _mm_min_ps(tf, t1);
+        }
+        __m128 pass = closed ? _mm_cmple_ps(t0, t1) : _mm_cmplt_ps(t0, t1);
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(pass)) << k;
+    }
+    return mask;
+}
+#else
+template <bool closed, typename T>
+uint32_t packet_slab_lanes(
+    const T (*inv_dir)[ray_packet_max_size], const T* t_max, int count,
+    const T* offset_lo, const T* offset_hi
+) {
+    return packet_slab_lanes_generic<closed>(inv_dir, t_max, count, offset_lo, offset_hi);
+}
+#endif
+
+// Up to ray_packet_max_size rays from one origin (the camera rays of a pinhole
+// camera), traced through the scene together. Each ray is a lane, and a mask of
+// lanes says which rays a step applies to. Directions and closest distances are
+// stored structure-of-arrays so one SIMD slab test covers a node for the whole
+// packet. When the rays also agree on the sign of every direction component
+// (coherent), they visit BVH children in the same order and bound a frustum
+// that can reject a node for all of them with one test; only coherent packets
+// are traced as packets, the rest go ray by ray.
+struct ray_packet {
+    int size = 0;
+    uint32_t found = 0;               // lanes whose hits[] hold a hit
+    bool coherent = false;
+    point3 origin;
+    int dir_is_neg[3];
+    real inv_lo[3], inv_hi[3];        // range of inv_dir over the packet, per axis
+
+    alignas(16) real inv_dir[3][ray_packet_max_size];
+    alignas(16) real t_max[ray_packet_max_size];  // closest hit so far, per lane
+    ray rays[ray_packet_max_size];
+    surface_hit hits[ray_packet_max_size];
+    pcg32 rng[ray_packet_max_size];   // each ray's generator, for media sampled while intersecting
+
+    void clear() {
+        size = 0;
+        found = 0;
+    }
+
+    void add(const ray& r, const pcg32& gen) {
+        int k = size++;
+        rays[k] = r;
+        rng[k] = gen;
+        t_max[k] = infinity;
+        for (int a = 0; a < 3; a++)
+            inv_dir[a][k] = 1 / r.direction()[a];
+    }
+
+    uint32_t lanes() const { return (1u << size) - 1; }
+
+    // The SIMD kernels work in groups of four lanes; lanes past size are padding.
+    int padded_size() const { return (size + 3) & ~3; }
+
+    // Call once all rays are added: pads the arrays for the SIMD kernels and
+    // works out whether the packet is coherent.
+    void prepare() {
+        for (int k = size; k < padded_size(); k++) {
+            t_max[k] = -1;
+            for (int a = 0; a < 3; a++)
+                inv_dir[a][k] = 1;
+        }
+
+        coherent = size > 0;
+        if (!coherent)
+            return;
+
+        origin = rays[0].origin();
+        for (int k = 1; k < size; k++) {
+            auto o = rays[k].origin();
+            if (o.x() != origin.x() || o.y() != origin.y() || o.z() != origin.z())
+                coherent = false;
+        }
+
+        for (int a = 0; a < 3; a++) {
+            inv_lo[a] = inv_hi[a] = inv_dir[a][0];
+            for (int k = 1; k < size; k++) {
+                inv_lo[a] = fmin(inv_lo[a], inv_dir[a][k]);
+                inv_hi[a] = fmax(inv_hi[a], inv_dir[a][k]);
+            }
+            dir_is_neg[a] = inv_lo[a] < 0;
+            if (!std::isfinite(inv_lo[a]) || !std::isfinite(inv_hi[a]) || !(inv_lo[a] > 0 || inv_hi[a] < 0))
+                coherent = false;
+        }
+    }
+
+    // Whether any ray in active may enter the box [lo, hi]. Each ray's entry and
+    // exit distances lie between those of the packet's extreme inverse
+    // directions, so a box this rejects fails every ray's own slab test.
+    // Coherent packets only.
+    bool frustum_hits(const real* lo, const real* hi, uint32_t active) const {
+        real t1 = 0;
+        for (uint32_t m = active; m; m &= m - 1) {
+            real t = t_max[lowest_lane(m)];
+            t1 = t > t1 ? t : t1;
+        }
+
+        // Plain compares: none of these products is NaN, and fmin / fmax
+        // would not inline here.
+        real t0 = 0;
+        for (int a = 0; a < 3; a++) {
+            real near_plane = (dir_is_neg[a] ? hi[a] : lo[a]) - origin[a];
+            real far_plane = (dir_is_neg[a] ? lo[a] : hi[a]) - origin[a];
+            real n0 = near_plane * inv_lo[a], n1 = near_plane * inv_hi[a];
+            real f0 = far_plane * inv_lo[a], f1 = far_plane * inv_hi[a];
+            real tn = n0 < n1 ? n0 : n1;
+            real tf = f0 > f1 ? f0 : f1;
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        return t0 <= t1;
+    }
+
+    // The lanes whose rays pass the slab test against [lo, hi]; see
+    // packet_slab_lanes(). Not masked by any active set.
+    template <bool closed>
+    uint32_t box_lanes(const real* lo, const real* hi) const {
+        real offset_lo[3], offset_hi[3];
+        for (int a = 0; a < 3; a++) {
+            offset_lo[a] = lo[a] - origin[a];
+            offset_hi[a] = hi[a] - origin[a];
+        }
+        return packet_slab_lanes<closed>(inv_dir, t_max, padded_size(), offset_lo, offset_hi)
+            & lanes();
+    }
 };
 
 class hittable {
 public:
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const = 0;
+
+    // First phase of hit(): finds the closest hit within [t_min, t_max] but
+    // only records what resolve_hit() needs to finish it later. hit is left
+    // alone on a miss, so aggregates can pass one record down to every child.
+    // The default runs hit() and keeps nothing, leaving resolve_hit() to run
+    // it again; primitives that defer the work override both.
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+        hit_record rec;
+        if (!this->hit(r, t_min, t_max, rec))
+            return false;
+        hit.set(rec.t, this);
+        hit.t_min = t_min;
+        hit.t_max = t_max;
+        return true;
+    }
+
+    // Second phase: fills in the full record for a hit this object reported
+    // from intersect(), with r the same ray it was given there.
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+        this->hit(r, hit.t_min, hit.t_max, rec);
+    }
+
+    // Whether anything lies along r within [t_min, t_max]. Unlike hit() this may
+    // stop at the first intersection found and fills in no shading data, which
+    // is all a shadow or occlusion ray needs.
+    virtual bool occluded(const ray& r, real t_min, real t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Where the line of r first enters the object and next leaves it, for the
+    // closed convex boundaries of participating media. The default finds them
+    // with two hit() calls; simple shapes answer directly.
+    virtual bool hit_interval(const ray& r, real& t_enter, real& t_exit) const {
+        hit_record rec1, rec2;
+        if (!hit(r, -infinity, infinity, rec1))
+            return false;
+        if (!hit(r, rec1.t + 0.0001, infinity, rec2))
+            return false;
+        t_enter = rec1.t;
+        t_exit = rec2.t;
+        return true;
+    }
+
+    // intersect() for the rays of p in active, each from t_min = 0 up to its own
+    // closest hit so far. Each ray must meet the same primitives in the same
+    // order as its own intersect() call would, so packets find the same hits and
+    // media draw the same random numbers. The default goes ray by ray.
+    virtual void intersect_packet(ray_packet& p, uint32_t active) const;
 };
 
+// Traces lane k of p alone through object, with the ray's own generator
+// swapped in as the thread's for the duration.
+inline void intersect_lane(const hittable& object, ray_packet& p, int k) {
+    auto& gen = thread_sampler().gen;
+    gen = p.rng[k];
+    if (object.intersect(p.rays[k], 0, p.t_max[k], p.hits[k])) {
+        p.t_max[k] = p.hits[k].t;
+        p.found |= 1u << k;
+    }
+    p.rng[k] = gen;
+}
+
+inline void hittable::intersect_packet(ray_packet& p, uint32_t active) const {
+    for (; active; active &= active - 1)
+        intersect_lane(*this, p, lowest_lane(active));
+}
+
+// Finishes a hit found by intersect() on the ray r, going through the
+// transform wrappers it recorded.
+inline void resolve_surface_hit(const ray& r, const surface_hit& hit, hit_record& rec) {
+    if (hit.transform_count > 0)
+        hit.transforms[hit.transform_count - 1]->resolve_hit(r, hit, rec);
+    else
+        hit.object->resolve_hit(r, hit, rec);
+}
+
+// Runs intersect() and resolves the result, for objects whose hit() is just the
+// two phases in a row.
+inline bool intersect_and_resolve(
+    const hittable& object, const ray& r, real t_min, real t_max, hit_record& rec) {
+    surface_hit hit;
+    if (!object.intersect(r, t_min, t_max, hit))
+        return false;
+    resolve_surface_hit(r, hit, rec);
+    return true;
+}
+
+// For transform wrappers: records wrapper on a hit its inner object found, so
+// resolving goes through it. start is the thread's generator as it was before
+// the inner search. When the record is already full, the wrapper becomes the
+// resolving object itself and resolves with a plain hit() call, run by
+// replay_hit() from start so that it draws what the search drew (media pick
+// their scattering distance at random) and finds the same surface at hit.t.
+inline bool push_transform(
+    const hittable* wrapper, const pcg32& start, real t_min, real t_max, surface_hit& hit) {
+    if (hit.transform_count < surface_hit::max_transforms) {
+        hit.transforms[hit.transform_count++] = wrapper;
+        return true;
+    }
+    hit.set(hit.t, wrapper);
+    hit.t_min = t_min;
+    hit.t_max = t_max;
+    hit.replay = start;
+    return true;
+}
+
+// Resolves a hit that wrapper took over in push_transform().
+inline void replay_hit(const hittable& wrapper, const ray& r, const surface_hit& hit, hit_record& rec) {
+    auto& gen = thread_sampler().gen;
+    auto current = gen;
+    gen = hit.replay;
+    wrapper.hit(r, hit.t_min, hit.t_max, rec);
+    gen = current;
+}
+
+// The same hit with the outermost wrapper taken off, for that wrapper's
+// resolve_hit() to pass on. A wrapper asked to resolve a hit with no wrappers
+// left is the resolving object itself, from the fallback above.
+inline surface_hit inner_hit(const surface_hit& hit) {
+    surface_hit inner = hit;
+    inner.transform_count--;
+    return inner;
+}
+
 class translate : public hittable {
 public:
     translate(shared_ptr<hittable> p, const vec3& displacement)
         : ptr(p), offset(displacement) {}
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const override {
+        auto start = thread_sampler().gen;
+        if (!ptr->intersect(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max, hit))
+            return false;
+        return push_transform(this, start, t_min, t_max, hit);
+    }
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+    }
+
+    virtual bool hit_interval(const ray& r, real& t_enter, real& t_exit) const override {
+        return ptr->hit_interval(ray(r.origin() - offset, r.direction(), r.time()), t_enter, t_exit);
+    }
 
 public:
     shared_ptr<hittable> ptr;
     vec3 offset;
 };
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool translate::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     ray moved_r(r.origin() - offset, r.direction(), r.time());
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
     rec.p += offset;
+    rec.p_error += error_bound(max_abs(rec.p));
     rec.set_face_normal(moved_r, rec.normal);
 
     return true;
 }
 
-bool translate::bounding_box(double time0, double time1, aabb& output_box) const {
+void translate::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    if (hit.transform_count == 0) {
+        replay_hit(*this, r, hit, rec);
+        return;
+    }
+
+    ray moved_r(r.origin() - offset, r.direction(), r.time());
+    resolve_surface_hit(moved_r, inner_hit(hit), rec);
+    rec.p += offset;
+    rec.p_error += error_bound(max_abs(rec.p));
+    rec.set_face_normal(moved_r, rec.normal);
+}
+
+bool translate::bounding_box(real time0, real time1, aabb& output_box) const {
     if (!ptr->bounding_box(time0, time1, output_box))
         return false;
 
@@ -67,25 +528,59 @@ bool translate::bounding_box(double time0, double time1, aabb& output_box) const
 
 class rotate_y : public hittable {
 public:
-    rotate_y(shared_ptr<hittable> p, double angle);
+    rotate_y(shared_ptr<hittable> p, real angle);
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
         output_box = bbox;
         return hasbox;
     }
 
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const override {
+        auto start = thread_sampler().gen;
+        if (!ptr->intersect(to_object(r), t_min, t_max, hit))
+            return false;
+        return push_transform(this, start, t_min, t_max, hit);
+    }
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return ptr->occluded(to_object(r), t_min, t_max);
+    }
+
+    virtual bool hit_interval(const ray& r, real& t_enter, real& t_exit) const override {
+        return ptr->hit_interval(to_object(r), t_enter, t_exit);
+    }
+
+    // r expressed in the unrotated object's frame.
+    ray to_object(const ray& r) const {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+
+        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+        return ray(origin, direction, r.time());
+    }
+
+    // Maps a hit on the object-frame ray rotated_r back into the world frame.
+    void to_world(const ray& rotated_r, hit_record& rec) const;
+
 public:
     shared_ptr<hittable> ptr;
-    double sin_theta;
-    double cos_theta;
+    real sin_theta;
+    real cos_theta;
     bool hasbox;
     aabb bbox;
 };
 
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
+rotate_y::rotate_y(shared_ptr<hittable> p, real angle) : ptr(p) {
     auto radians = degrees_to_radians(angle);
     sin_theta = sin(radians);
     cos_theta = cos(radians);
@@ -117,21 +612,28 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    ray rotated_r = to_object(r);
 
-    origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-    origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+    if (!ptr->hit(rotated_r, t_min, t_max, rec))
+        return false;
 
-    direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-    direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+    to_world(rotated_r, rec);
+    return true;
+}
 
-    ray rotated_r(origin, direction, r.time());
+void rotate_y::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    if (hit.transform_count == 0) {
+        replay_hit(*this, r, hit, rec);
+        return;
+    }
 
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
-        return false;
+    ray rotated_r = to_object(r);
+    resolve_surface_hit(rotated_r, inner_hit(hit), rec);
+    to_world(rotated_r, rec);
+}
 
+void rotate_y::to_world(const ray& rotated_r, hit_record& rec) const {
     auto p = rec.p;
     auto normal = rec.normal;
 
@@ -141,10 +643,10 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
     normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
+    // A rotation can mix the error of two axes into one.
     rec.p = p;
+    rec.p_error = 2 * rec.p_error + error_bound(max_abs(p));
     rec.set_face_normal(rotated_r, normal);
-
-    return true;
 }
 
 #endif
\ No newline at end of file
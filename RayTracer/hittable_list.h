@@ -19,32 +19,51 @@ public:
     void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
 
     virtual bool bounding_box(
-        double time0, double time1, aabb& output_box) const override;
+        real time0, real time1, aabb& output_box) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    virtual void intersect_packet(ray_packet& p, uint32_t active) const override {
+        for (const auto& object : objects)
+            object->intersect_packet(p, active);
+    }
 
 public:
     std::vector<shared_ptr<hittable>> objects;
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
+bool hittable_list::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->intersect(r, t_min, closest_so_far, hit)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = hit.t;
         }
     }
 
     return hit_anything;
 }
 
-bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
+bool hittable_list::occluded(const ray& r, real t_min, real t_max) const {
+    for (const auto& object : objects) {
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+
+    return false;
+}
+
+bool hittable_list::bounding_box(real time0, real time1, aabb& output_box) const {
     if (objects.empty()) return false;
 
     aabb temp_box;
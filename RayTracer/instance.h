@@ -0,0 +1,248 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+// An affine transform stored as the top three rows of a 4x4 matrix.
+class transform {
+public:
+    transform() {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = (i == j) ? 1.0 : 0.0;
+    }
+
+    static transform translate(const vec3& offset) {
+        transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = offset[i];
+        return t;
+    }
+
+    // Rotation about the Y axis, in the same sense as rotate_y.
+    static transform rotate_y(real sin_theta, real cos_theta) {
+        transform t;
+        t.m[0][0] = cos_theta;  t.m[0][2] = sin_theta;
+        t.m[2][0] = -sin_theta; t.m[2][2] = cos_theta;
+        return t;
+    }
+
+    static transform rotate_y(real angle) {
+        auto radians = degrees_to_radians(angle);
+        return rotate_y(sin(radians), cos(radians));
+    }
+
+    static transform scale(const vec3& s) {
+        transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][i] = s[i];
+        return t;
+    }
+
+    // The transform that applies b first and then this one.
+    transform operator*(const transform& b) const {
+        transform t;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                t.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j];
+                if (j == 3)
+                    t.m[i][j] += m[i][3];
+            }
+        }
+        return t;
+    }
+
+    transform inverse() const {
+        transform t;
+        auto det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+            - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+            + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        auto inv_det = 1.0 / det;
+
+        t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = -(t.m[i][0] * m[0][3] + t.m[i][1] * m[1][3] + t.m[i][2] * m[2][3]);
+
+        return t;
+    }
+
+    point3 point(const point3& p) const {
+        return point3(
+            m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+            m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+            m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(
+            m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+            m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+            m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    // Applies the transpose of the linear part. With the inverse transform this
+    // carries normals, which must stay perpendicular to transformed surfaces.
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(
+            m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+            m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+            m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+    }
+
+    // Largest absolute row sum of the linear part: the most the map can grow
+    // an error that is bounded the same along every axis.
+    real norm() const {
+        real n = 0;
+        for (int i = 0; i < 3; i++)
+            n = fmax(n, fabs(m[i][0]) + fabs(m[i][1]) + fabs(m[i][2]));
+        return n;
+    }
+
+    aabb box(const aabb& b) const {
+        aabb out = aabb::empty();
+        for (int i = 0; i < 2; i++)
+            for (int j = 0; j < 2; j++)
+                for (int k = 0; k < 2; k++)
+                    out.expand(point(point3(
+                        i ? b.max().x() : b.min().x(),
+                        j ? b.max().y() : b.min().y(),
+                        k ? b.max().z() : b.min().z())));
+        return out;
+    }
+
+public:
+    real m[3][4];
+};
+
+// A placement of a shared object (typically a BVH: the bottom-level structure)
+// under one affine transform. Any number of instances may share one object;
+// each ray pays one transform per instance it enters.
+class instance : public hittable {
+public:
+    instance(shared_ptr<hittable> p, const transform& object_to_world)
+        : ptr(p), to_world(object_to_world), to_object(object_to_world.inverse())
+    {
+        aabb object_box;
+        hasbox = ptr->bounding_box(0, 1, object_box);
+        bbox = to_world.box(object_box);
+    }
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+        output_box = bbox;
+        return hasbox;
+    }
+
+    virtual bool intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const override {
+        auto start = thread_sampler().gen;
+        if (!ptr->intersect(object_ray(r), t_min, t_max, hit))
+            return false;
+        return push_transform(this, start, t_min, t_max, hit);
+    }
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override {
+        if (hit.transform_count == 0) {
+            replay_hit(*this, r, hit, rec);
+            return;
+        }
+
+        resolve_surface_hit(object_ray(r), inner_hit(hit), rec);
+        to_world_hit(rec);
+    }
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return ptr->occluded(object_ray(r), t_min, t_max);
+    }
+
+    virtual bool hit_interval(const ray& r, real& t_enter, real& t_exit) const override {
+        return ptr->hit_interval(object_ray(r), t_enter, t_exit);
+    }
+
+    // The direction is not renormalized, so t means the same in both spaces.
+    ray object_ray(const ray& r) const {
+        return ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+    }
+
+    // The object-space normal already faces the ray; an affine map keeps the
+    // sign of dot(direction, normal), so front_face carries over unchanged.
+    void to_world_hit(hit_record& rec) const {
+        auto object_error = rec.p_error + error_bound(max_abs(rec.p));
+        rec.p = to_world.point(rec.p);
+        rec.p_error = to_world.norm() * object_error + error_bound(max_abs(rec.p));
+        rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+    }
+
+public:
+    shared_ptr<hittable> ptr;
+    transform to_world;
+    transform to_object;
+    bool hasbox;
+    aabb bbox;
+};
+
+bool instance::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!ptr->hit(object_ray(r), t_min, t_max, rec))
+        return false;
+
+    to_world_hit(rec);
+    return true;
+}
+
+// Strips a chain of translate / rotate_y / instance wrappers from object and
+// returns the object underneath together with the combined transform.
+shared_ptr<hittable> unwrap_transforms(shared_ptr<hittable> object, transform& object_to_world) {
+    while (true) {
+        if (auto t = std::dynamic_pointer_cast<translate>(object)) {
+            object_to_world = object_to_world * transform::translate(t->offset);
+            object = t->ptr;
+        }
+        else if (auto r = std::dynamic_pointer_cast<rotate_y>(object)) {
+            object_to_world = object_to_world * transform::rotate_y(r->sin_theta, r->cos_theta);
+            object = r->ptr;
+        }
+        else if (auto i = std::dynamic_pointer_cast<instance>(object)) {
+            object_to_world = object_to_world * i->to_world;
+            object = i->ptr;
+        }
+        else {
+            return object;
+        }
+    }
+}
+
+// Two-level acceleration structure for a scene: every top-level object wrapped
+// in translate / rotate_y becomes a single instance of the object underneath,
+// and a linear BVH (the top level) is built over the result.
+shared_ptr<linear_bvh> make_tlas(
+    const hittable_list& objects, real time0, real time1,
+    const bvh_build_options& options = bvh_build_options())
+{
+    hittable_list instances;
+    for (const auto& object : objects.objects) {
+        transform object_to_world;
+        auto base = unwrap_transforms(object, object_to_world);
+        if (base == object)
+            instances.add(object);
+        else
+            instances.add(make_shared<instance>(base, object_to_world));
+    }
+
+    return make_shared<linear_bvh>(instances, time0, time1, options);
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef LAZY_BVH_H
+#define LAZY_BVH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A linear BVH whose top levels are built up front and whose lower subtrees
+// are built the first time a ray reaches them. Rendering can start as soon as
+// the top is ready, and parts of the scene no ray visits are never built.
+//
+// The top is an ordinary linear_bvh_tree whose leaves each hold one entry: the
+// slot of a subtree over a contiguous range of the partitioned references.
+// The first thread to reach an unbuilt slot builds it while any others that
+// arrive wait for it; after that the finished tree is read without locking.
+class lazy_bvh : public hittable {
+public:
+    // A subtree over refs[start, end), built on first use.
+    struct lazy_subtree {
+        size_t start, end;
+        std::once_flag once;
+        std::atomic<bool> ready{ false };
+        linear_bvh_tree tree;
+    };
+
+    lazy_bvh(
+        const hittable_list& list, real time0, real time1,
+        const bvh_build_options& _options = bvh_build_options(), size_t _subtree_size = 4096)
+        : objects(list.objects), options(_options), subtree_size(std::max<size_t>(_subtree_size, 1))
+    {
+        auto start_time = std::chrono::steady_clock::now();
+
+        // Subtrees are built from inside render threads, which already keep
+        // every core busy.
+        options.build_threads = 1;
+        options.spatial_split_budget = 0;
+
+        refs = make_primitive_refs(objects, time0, time1);
+        if (!refs.empty())
+            build_top(0, refs.size(), 0);
+
+        build_stats.peak_bytes = refs.size() * sizeof(bvh_primitive_ref) + top.memory_bytes();
+        build_stats.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return traverse<true>(r, t_min, t_max, [&](uint32_t index, real t0, real t1) {
+            return objects[index]->occluded(r, t0, t1);
+        });
+    }
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+        if (top.empty())
+            return false;
+        output_box = top.bounds();
+        return true;
+    }
+
+    // Same contract as linear_bvh_tree::traverse(), building subtrees as the
+    // walk enters them.
+    template <bool any_hit = false, typename Intersect>
+    bool traverse(const ray& r, real t_min, real t_max, Intersect&& intersect) const {
+        return top.traverse<any_hit>(r, t_min, t_max, [&](uint32_t slot, real t0, real& t1) {
+            return subtree(slot).template traverse<any_hit>(r, t0, t1,
+                [&](uint32_t index, real s0, real& s1) {
+                    if (!intersect(index, s0, s1))
+                        return false;
+                    t1 = s1;
+                    return true;
+                });
+        });
+    }
+
+    // The finished tree for a slot, built by this call if nobody has yet.
+    const linear_bvh_tree& subtree(uint32_t slot) const {
+        auto& s = *subtrees[slot];
+        if (!s.ready.load(std::memory_order_acquire))
+            std::call_once(s.once, [&] { build_subtree(s); });
+        return s.tree;
+    }
+
+    // Builds every subtree still missing, e.g. to compare against an eager build.
+    void build_all() const {
+        for (uint32_t slot = 0; slot < subtrees.size(); slot++)
+            subtree(slot);
+    }
+
+    size_t subtree_count() const { return subtrees.size(); }
+    size_t subtrees_built() const { return built_count.load(); }
+
+    // Total time spent building subtrees so far, summed over threads.
+    double lazy_seconds() const { return lazy_nanoseconds.load() * 1e-9; }
+
+private:
+    void build_top(size_t start, size_t end, int depth) {
+        auto index = static_cast<uint32_t>(top.nodes.size());
+        top.nodes.emplace_back();
+
+        aabb box = aabb::empty();
+        for (size_t i = start; i < end; i++)
+            box.expand(refs[i].box);
+        for (int a = 0; a < 3; a++) {
+            top.nodes[index].bounds[0][a] = float_round_down(box.min()[a]);
+            top.nodes[index].bounds[1][a] = float_round_up(box.max()[a]);
+        }
+
+        int axis = 0;
+        size_t mid = end;
+        if (end - start > subtree_size && depth < linear_bvh_tree::max_depth - 1)
+            mid = sah_partition(refs, start, end, options, &axis);
+
+        if (mid == end) {
+            auto slot = static_cast<uint32_t>(subtrees.size());
+            subtrees.emplace_back(new lazy_subtree());
+            subtrees.back()->start = start;
+            subtrees.back()->end = end;
+
+            top.nodes[index].offset = static_cast<uint32_t>(top.indices.size());
+            top.nodes[index].count = 1;
+            top.indices.push_back(slot);
+            return;
+        }
+
+        build_top(start, mid, depth + 1);
+        auto second = static_cast<uint32_t>(top.nodes.size());
+        build_top(mid, end, depth + 1);
+
+        top.nodes[index].offset = second;
+        top.nodes[index].axis = static_cast<uint8_t>(axis);
+    }
+
+    void build_subtree(lazy_subtree& s) const {
+        auto start_time = std::chrono::steady_clock::now();
+
+        std::vector<bvh_primitive_ref> range(refs.begin() + s.start, refs.begin() + s.end);
+        s.tree.build(range, options);
+        s.ready.store(true, std::memory_order_release);
+
+        lazy_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_time).count();
+        built_count++;
+    }
+
+public:
+    std::vector<shared_ptr<hittable>> objects;
+    bvh_build_options options;
+    size_t subtree_size;
+    bvh_build_stats build_stats;  // the eager top levels only
+
+private:
+    std::vector<bvh_primitive_ref> refs;
+    linear_bvh_tree top;
+    std::vector<std::unique_ptr<lazy_subtree>> subtrees;
+    mutable std::atomic<size_t> built_count{ 0 };
+    mutable std::atomic<int64_t> lazy_nanoseconds{ 0 };
+};
+
+bool lazy_bvh::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+    return traverse(r, t_min, t_max, [&](uint32_t index, real t0, real& t1) {
+        if (!objects[index]->intersect(r, t0, t1, hit))
+            return false;
+        t1 = hit.t;
+        return true;
+    });
+}
+
+#endif
@@ -0,0 +1,919 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A ray prepared for box tests: the inverse direction and its sign bits are
+// computed once per query instead of once per node and axis.
+struct bvh_ray {
+    explicit bvh_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = r.origin()[a];
+            inv_dir[a] = 1 / r.direction()[a];
+            dir_is_neg[a] = inv_dir[a] < 0;
+        }
+    }
+
+    real origin[3];
+    real inv_dir[3];
+    int dir_is_neg[3];
+};
+
+// One 32-byte node of a flattened BVH. Nodes are stored depth first, so the
+// first child of an interior node is the next node in the array and only the
+// second child's index is kept. Bounds are rounded outwards to float.
+struct linear_bvh_node {
+    float bounds[2][3];   // [0] = min corner, [1] = max corner
+    uint32_t offset;      // leaf: first entry in the index array; interior: second child
+    uint16_t count;       // primitives in a leaf, 0 for interior nodes
+    uint8_t axis;         // split axis of an interior node
+    uint8_t pad;
+
+    bool is_leaf() const { return count > 0; }
+
+    // Slab test against [t_min, t_max], picking near and far planes by sign.
+    bool hit(const bvh_ray& r, real t_min, real t_max) const {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (bounds[r.dir_is_neg[a]][a] - r.origin[a]) * r.inv_dir[a];
+            auto t1 = (bounds[1 - r.dir_is_neg[a]][a] - r.origin[a]) * r.inv_dir[a];
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+                return false;
+        }
+        return true;
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fill half a cache line");
+
+inline float float_round_down(real x) {
+    auto f = static_cast<float>(x);
+    return (f > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float float_round_up(real x) {
+    auto f = static_cast<float>(x);
+    return (f < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// What the last build cost: wall time and the largest amount of builder-owned
+// memory (references, scratch nodes and the output arrays) alive at once.
+struct bvh_build_stats {
+    double seconds = 0;
+    size_t peak_bytes = 0;
+    int threads = 1;
+};
+
+// What the last update() cost: the refit alone and the refit plus rebuilds,
+// and how much of the tree had to be rebuilt.
+struct bvh_update_stats {
+    double refit_seconds = 0;
+    double seconds = 0;
+    int subtrees_rebuilt = 0;
+    size_t primitives_rebuilt = 0;
+};
+
+class mapped_file;
+
+// The flattened tree itself, independent of what the primitives are. Leaves
+// refer to primitives through the index array; traverse() hands those indices
+// to a callback that performs the actual intersection.
+class linear_bvh_tree {
+public:
+    static const int max_depth = 64;
+
+    // Ranges smaller than this are built serially inside one task.
+    static const size_t parallel_grain = 4096;
+
+    // Builds over refs, reordering them in place. Large inputs are split into
+    // subtree tasks on a work-stealing pool; the subtrees are written to a
+    // shared scratch array and flattened depth first once they are all done.
+    // With a spatial split budget the build is an SBVH instead (see below).
+    void build(std::vector<bvh_primitive_ref>& refs, const bvh_build_options& options) {
+        if (options.spatial_split_budget > 0)
+            build_spatial(refs, options);
+        else
+            build(refs, options, 0);
+    }
+
+    // SBVH build: besides object splits a node may split space, sending each
+    // reference that straddles the plane to both children with its box clipped
+    // to that side. A primitive can then sit in several leaves, so large thin
+    // primitives stop inflating every node above them. Clipping intersects the
+    // reference's box with the half space, which is exact for axis-aligned
+    // rectangles and boxes and conservative for anything else. Builds serially.
+    void build_spatial(const std::vector<bvh_primitive_ref>& refs, const bvh_build_options& options) {
+        auto start_time = std::chrono::steady_clock::now();
+
+        release();
+        build_stats = bvh_build_stats();
+        if (refs.empty())
+            return;
+
+        spatial_state state(options);
+        state.reference_limit = refs.size()
+            + static_cast<size_t>(options.spatial_split_budget * refs.size());
+        state.references = refs.size();
+        state.scratch.emplace_back();
+
+        aabb root = aabb::empty();
+        for (const auto& ref : refs)
+            root.expand(ref.box);
+        state.root_area = std::max(root.surface_area(), real(1e-12));
+
+        build_spatial_range(state, refs, 0, 0);
+
+        nodes.reserve(state.scratch.size());
+        indices.reserve(state.leaf_refs.size());
+        flatten(state.leaf_refs, state.scratch, 0);
+
+        auto cost = subtree_costs(options);
+        built_cost.assign(cost.begin(), cost.end());
+
+        build_stats.peak_bytes = state.peak_bytes + memory_bytes();
+        build_stats.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    // Recomputes every node's bounds from new primitive bounds, keeping the
+    // topology. refs are indexed by primitive, as make_primitive_refs() returns
+    // them. Children are stored after their parent, so one backwards sweep does.
+    void refit(const std::vector<bvh_primitive_ref>& refs) {
+        own();
+        for (size_t i = nodes.size(); i-- > 0;) {
+            auto& n = nodes[i];
+            aabb box;
+            if (n.is_leaf()) {
+                box = aabb::empty();
+                for (uint32_t k = 0; k < n.count; k++)
+                    box.expand(refs[indices[n.offset + k]].box);
+            }
+            else {
+                box = node_box(nodes[i + 1]);
+                box.expand(node_box(nodes[n.offset]));
+            }
+            set_bounds(n, box);
+        }
+    }
+
+    // Refits, then rebuilds from scratch each largest subtree whose SAH cost
+    // has grown past options.rebuild_threshold times its cost when it was built.
+    // Returns the number of subtrees rebuilt; update_stats has the details.
+    int update(const std::vector<bvh_primitive_ref>& refs, const bvh_build_options& options) {
+        auto start_time = std::chrono::steady_clock::now();
+        update_stats = bvh_update_stats();
+        if (empty())
+            return 0;
+
+        refit(refs);
+        update_stats.refit_seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+
+        // Walk down from the root and stop at the first degraded node on each
+        // path. Leaves cannot degrade: their cost depends only on their count.
+        auto cost = subtree_costs(options);
+        std::vector<std::pair<uint32_t, int>> degraded;
+        std::vector<std::pair<uint32_t, int>> stack{ { 0, 0 } };
+        while (!stack.empty()) {
+            auto entry = stack.back();
+            stack.pop_back();
+
+            const auto& n = nodes[entry.first];
+            if (n.is_leaf())
+                continue;
+            if (cost[entry.first] > options.rebuild_threshold * built_cost[entry.first]) {
+                degraded.push_back(entry);
+                continue;
+            }
+            stack.push_back({ entry.first + 1, entry.second + 1 });
+            stack.push_back({ n.offset, entry.second + 1 });
+        }
+
+        if (!degraded.empty() && degraded[0].first == 0) {
+            auto all = refs;
+            build(all, options);
+            update_stats.subtrees_rebuilt = 1;
+            update_stats.primitives_rebuilt = refs.size();
+        }
+        else {
+            // Splice from the back so the node indices still to visit stay valid.
+            std::sort(degraded.begin(), degraded.end(),
+                [](const std::pair<uint32_t, int>& a, const std::pair<uint32_t, int>& b) {
+                    return a.first > b.first;
+                });
+            for (const auto& entry : degraded)
+                rebuild_subtree(entry.first, entry.second, refs, options);
+        }
+
+        update_stats.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+        return update_stats.subtrees_rebuilt;
+    }
+
+    size_t memory_bytes() const {
+        return nodes.capacity() * sizeof(linear_bvh_node) + indices.capacity() * sizeof(uint32_t)
+            + built_cost.capacity() * sizeof(float)
+            + mapped_node_count * (sizeof(linear_bvh_node) + sizeof(float))
+            + mapped_index_count * sizeof(uint32_t);
+    }
+
+    // The arrays as traversal reads them. A tree loaded from a cache file keeps
+    // them in the mapped file (see bvh_cache.h) and leaves the vectors empty
+    // until it is modified.
+    const linear_bvh_node* node_data() const { return mapping ? mapped_nodes : nodes.data(); }
+    const uint32_t* index_data() const { return mapping ? mapped_indices : indices.data(); }
+    const float* cost_data() const { return mapping ? mapped_costs : built_cost.data(); }
+    size_t node_count() const { return mapping ? mapped_node_count : nodes.size(); }
+    size_t index_count() const { return mapping ? mapped_index_count : indices.size(); }
+
+    bool empty() const { return node_count() == 0; }
+
+    aabb bounds() const {
+        return empty() ? aabb() : node_box(node_data()[0]);
+    }
+
+    // Visits leaves front to back, nearer child first, with an explicit stack.
+    // intersect(index, t_min, t_max) tests one primitive and, on a hit, returns
+    // true and lowers t_max to the hit distance. With any_hit set the walk
+    // returns at the first primitive that reports a hit.
+    template <bool any_hit = false, typename Intersect>
+    bool traverse(const ray& r, real t_min, real t_max, Intersect&& intersect) const {
+        const auto* index_array = index_data();
+        return traverse_leaves<any_hit>(r, t_min, t_max,
+            [&](uint32_t first, uint32_t count, real t0, real& t1) {
+                bool hit_anything = false;
+                for (uint32_t i = 0; i < count; i++) {
+                    if (intersect(index_array[first + i], t0, t1)) {
+                        if (any_hit)
+                            return true;
+                        hit_anything = true;
+                    }
+                }
+                return hit_anything;
+            });
+    }
+
+    // The same walk, handing each leaf over whole: intersect_leaf(first, count,
+    // t_min, t_max) tests entries [first, first + count) of the index array,
+    // for primitives that are cheaper to test several at a time. A root other
+    // than 0 walks only the subtree under that node.
+    template <bool any_hit = false, typename IntersectLeaf>
+    bool traverse_leaves(
+        const ray& r, real t_min, real t_max, IntersectLeaf&& intersect_leaf, uint32_t root = 0
+    ) const {
+        if (empty())
+            return false;
+
+        const auto* node_array = node_data();
+        bvh_ray q(r);
+        uint32_t stack[max_depth];
+        int stack_size = 0;
+        uint32_t current = root;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = node_array[current];
+            if (node.hit(q, t_min, t_max)) {
+                if (node.is_leaf()) {
+                    if (intersect_leaf(node.offset, uint32_t(node.count), t_min, t_max)) {
+                        if (any_hit)
+                            return true;
+                        hit_anything = true;
+                    }
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                }
+                else if (q.dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            }
+            else {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_anything;
+    }
+
+    // traverse_leaves() for a coherent ray_packet: one walk in the order all its
+    // rays share, carrying the lanes still inside each subtree. A node is tested
+    // against the packet's frustum first and then lane by lane, so a ray drops
+    // out exactly where its own walk would turn back. intersect_leaf(first,
+    // count, lanes) handles a leaf for some lanes; intersect_subtree(node, lane)
+    // takes over the walk below node when only one lane is left.
+    template <typename IntersectLeaf, typename IntersectSubtree>
+    void traverse_packet(
+        const ray_packet& p, uint32_t active,
+        IntersectLeaf&& intersect_leaf, IntersectSubtree&& intersect_subtree
+    ) const {
+        if (empty() || !active)
+            return;
+
+        const auto* node_array = node_data();
+        uint32_t stack[max_depth];
+        uint32_t stack_lanes[max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            if (!(active & (active - 1))) {
+                intersect_subtree(current, lowest_lane(active));
+            }
+            else {
+                const auto& node = node_array[current];
+                real lo[3] = { node.bounds[0][0], node.bounds[0][1], node.bounds[0][2] };
+                real hi[3] = { node.bounds[1][0], node.bounds[1][1], node.bounds[1][2] };
+                uint32_t lanes = p.frustum_hits(lo, hi, active) ? active & p.box_lanes<true>(lo, hi) : 0;
+
+                if (lanes && !node.is_leaf()) {
+                    bool near_second = p.dir_is_neg[node.axis] != 0;
+                    stack[stack_size] = near_second ? current + 1 : node.offset;
+                    stack_lanes[stack_size++] = lanes;
+                    current = near_second ? node.offset : current + 1;
+                    active = lanes;
+                    continue;
+                }
+                if (lanes)
+                    intersect_leaf(node.offset, uint32_t(node.count), lanes);
+            }
+
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+            active = stack_lanes[stack_size];
+        }
+    }
+
+    // Expected cost of one ray query under the surface area heuristic, in the
+    // same units as bvh_sah_cost().
+    real sah_cost(const bvh_build_options& options) const {
+        if (empty())
+            return 0;
+        return subtree_costs(options)[0];
+    }
+
+    // The SAH cost of the subtree under every node.
+    std::vector<real> subtree_costs(const bvh_build_options& options) const {
+        const auto* node_array = node_data();
+        std::vector<real> cost(node_count());
+        for (size_t i = cost.size(); i-- > 0;) {
+            const auto& n = node_array[i];
+            if (n.is_leaf()) {
+                cost[i] = options.intersection_cost * n.count;
+                continue;
+            }
+
+            auto area = std::max(node_box(n).surface_area(), real(1e-12));
+            cost[i] = options.traversal_cost
+                + node_box(node_array[i + 1]).surface_area() / area * cost[i + 1]
+                + node_box(node_array[n.offset]).surface_area() / area * cost[n.offset];
+        }
+        return cost;
+    }
+
+    static aabb node_box(const linear_bvh_node& n) {
+        return aabb(point3(n.bounds[0][0], n.bounds[0][1], n.bounds[0][2]),
+            point3(n.bounds[1][0], n.bounds[1][1], n.bounds[1][2]));
+    }
+
+public:
+    std::vector<linear_bvh_node> nodes;
+    std::vector<uint32_t> indices;
+    std::vector<float> built_cost;  // subtree SAH cost of each node when it was built
+    bvh_build_stats build_stats;
+    bvh_update_stats update_stats;
+
+    // Set while the arrays live in a mapped cache file.
+    std::shared_ptr<mapped_file> mapping;
+    const linear_bvh_node* mapped_nodes = nullptr;
+    const uint32_t* mapped_indices = nullptr;
+    const float* mapped_costs = nullptr;
+    size_t mapped_node_count = 0;
+    size_t mapped_index_count = 0;
+
+private:
+    // Copies mapped arrays into the vectors so the tree can be modified.
+    void own() {
+        if (!mapping)
+            return;
+        nodes.assign(mapped_nodes, mapped_nodes + mapped_node_count);
+        indices.assign(mapped_indices, mapped_indices + mapped_index_count);
+        built_cost.assign(mapped_costs, mapped_costs + mapped_node_count);
+        drop_mapping();
+    }
+
+    void release() {
+        nodes.clear();
+        indices.clear();
+        built_cost.clear();
+        drop_mapping();
+    }
+
+    void drop_mapping() {
+        mapping.reset();
+        mapped_nodes = nullptr;
+        mapped_indices = nullptr;
+        mapped_costs = nullptr;
+        mapped_node_count = 0;
+        mapped_index_count = 0;
+    }
+
+    // depth is that of the root within the whole tree, so a rebuilt subtree
+    // stays inside the traversal stack.
+    void build(std::vector<bvh_primitive_ref>& refs, const bvh_build_options& options, int depth) {
+        auto start_time = std::chrono::steady_clock::now();
+
+        release();
+        build_stats = bvh_build_stats();
+        if (refs.empty())
+            return;
+
+        std::vector<build_node> scratch(2 * refs.size());
+        std::atomic<uint32_t> used{ 1 };
+
+        int threads = thread_pool::default_thread_count(options.build_threads);
+        if (threads > 1 && refs.size() >= 2 * parallel_grain) {
+            thread_pool pool(threads);
+            pool.submit(0, [&](int worker) {
+                build_range(refs, scratch, used, 0, 0, refs.size(), options, depth, &pool, worker);
+            });
+            pool.run_all();
+        }
+        else {
+            threads = 1;
+            build_range(refs, scratch, used, 0, 0, refs.size(), options, depth, nullptr, 0);
+        }
+
+        nodes.reserve(used);
+        indices.reserve(refs.size());
+        flatten(refs, scratch, 0);
+
+        auto cost = subtree_costs(options);
+        built_cost.assign(cost.begin(), cost.end());
+
+        build_stats.threads = threads;
+        build_stats.peak_bytes = refs.size() * sizeof(bvh_primitive_ref)
+            + scratch.size() * sizeof(build_node) + memory_bytes();
+        build_stats.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    static void set_bounds(linear_bvh_node& n, const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            n.bounds[0][a] = float_round_down(box.min()[a]);
+            n.bounds[1][a] = float_round_up(box.max()[a]);
+        }
+    }
+
+    // Replaces the subtree under root, at the given depth, with a fresh build
+    // over the same primitives. A subtree is a contiguous run of nodes ending
+    // at its rightmost leaf, and its leaves share a contiguous run of indices
+    // starting at its leftmost leaf's.
+    void rebuild_subtree(
+        uint32_t root, int depth, const std::vector<bvh_primitive_ref>& refs,
+        const bvh_build_options& options
+    ) {
+        uint32_t last = root;
+        while (!nodes[last].is_leaf())
+            last = nodes[last].offset;
+        uint32_t end = last + 1;
+
+        uint32_t first = root;
+        while (!nodes[first].is_leaf())
+            first++;
+        uint32_t first_index = nodes[first].offset;
+
+        size_t count = 0;
+        for (uint32_t i = root; i < end; i++)
+            count += nodes[i].count;
+
+        std::vector<bvh_primitive_ref> subset;
+        subset.reserve(count);
+        for (size_t k = first_index; k < first_index + count; k++)
+            subset.push_back(refs[indices[k]]);
+
+        // Object splits only, so the subtree keeps exactly its share of indices.
+        linear_bvh_tree sub;
+        sub.build(subset, options, depth);
+        for (auto& n : sub.nodes)
+            n.offset += n.is_leaf() ? first_index : root;
+
+        // Second-child links that point past the subtree move with its new size.
+        auto delta = static_cast<int64_t>(sub.nodes.size()) - static_cast<int64_t>(end - root);
+        if (delta != 0) {
+            for (uint32_t i = 0; i < nodes.size(); i++) {
+                auto& n = nodes[i];
+                if ((i < root || i >= end) && !n.is_leaf() && n.offset >= end)
+                    n.offset = static_cast<uint32_t>(n.offset + delta);
+            }
+        }
+
+        nodes.erase(nodes.begin() + root, nodes.begin() + end);
+        nodes.insert(nodes.begin() + root, sub.nodes.begin(), sub.nodes.end());
+        built_cost.erase(built_cost.begin() + root, built_cost.begin() + end);
+        built_cost.insert(built_cost.begin() + root, sub.built_cost.begin(), sub.built_cost.end());
+        std::copy(sub.indices.begin(), sub.indices.end(), indices.begin() + first_index);
+
+        update_stats.subtrees_rebuilt++;
+        update_stats.primitives_rebuilt += count;
+    }
+
+    // A node of the unflattened tree. Leaves keep their range of refs.
+    struct build_node {
+        aabb box;
+        uint32_t first_child;  // children are first_child and first_child + 1
+        uint32_t start;
+        uint32_t count;        // 0 for interior nodes
+        int axis;
+    };
+
+    struct spatial_state {
+        explicit spatial_state(const bvh_build_options& o) : options(o) {}
+
+        const bvh_build_options& options;
+        size_t reference_limit = 0;
+        size_t references = 0;
+        real root_area = 1;
+        size_t live_bytes = 0;
+        size_t peak_bytes = 0;
+        std::vector<build_node> scratch;
+        std::vector<bvh_primitive_ref> leaf_refs;
+    };
+
+    // Builds the subtree for refs into state.scratch[index]. The references of
+    // each child are copied out, since a spatial split may duplicate some.
+    static void build_spatial_range(
+        spatial_state& state, const std::vector<bvh_primitive_ref>& refs, uint32_t index, int depth
+    ) {
+        const auto& options = state.options;
+
+        aabb box = aabb::empty();
+        for (const auto& ref : refs)
+            box.expand(ref.box);
+        state.scratch[index].box = box;
+
+        auto make_leaf = [&] {
+            state.scratch[index].start = static_cast<uint32_t>(state.leaf_refs.size());
+            state.scratch[index].count = static_cast<uint32_t>(refs.size());
+            state.leaf_refs.insert(state.leaf_refs.end(), refs.begin(), refs.end());
+        };
+
+        if (refs.size() <= 1 || (depth >= max_depth - 1 && refs.size() <= UINT16_MAX)) {
+            make_leaf();
+            return;
+        }
+
+        // The best object split, as the plain builder would choose it.
+        std::vector<bvh_primitive_ref> sorted = refs;
+        int axis = 0;
+        real object_cost;
+        size_t mid = sah_partition(sorted, 0, sorted.size(), options, &axis, &object_cost);
+        if (mid == sorted.size() && sorted.size() > UINT16_MAX)
+            mid = sorted.size() / 2;
+        if (mid == sorted.size()) {
+            make_leaf();
+            return;
+        }
+
+        std::vector<bvh_primitive_ref> left, right;
+
+        // Only look for a spatial split where the object split's children
+        // overlap noticeably and there are references left in the budget.
+        aabb left_box = aabb::empty(), right_box = aabb::empty();
+        for (size_t i = 0; i < sorted.size(); i++)
+            (i < mid ? left_box : right_box).expand(sorted[i].box);
+
+        real overlap = 0;
+        point3 lo, hi;
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::max(left_box.min()[a], right_box.min()[a]);
+            hi[a] = std::min(left_box.max()[a], right_box.max()[a]);
+        }
+        if (lo.x() <= hi.x() && lo.y() <= hi.y() && lo.z() <= hi.z())
+            overlap = aabb(lo, hi).surface_area();
+
+        if (depth < max_depth - 1 && state.references < state.reference_limit
+            && overlap > options.spatial_split_alpha * state.root_area) {
+            int spatial_axis;
+            real plane;
+            real spatial_cost = find_spatial_split(options, refs, box, spatial_axis, plane);
+            if (spatial_cost < object_cost
+                && split_spatially(refs, spatial_axis, plane, left, right)
+                && state.references + left.size() + right.size() - refs.size() <= state.reference_limit) {
+                state.references += left.size() + right.size() - refs.size();
+                axis = spatial_axis;
+            }
+            else {
+                left.clear();
+                right.clear();
+            }
+        }
+
+        if (left.empty()) {
+            left.assign(sorted.begin(), sorted.begin() + mid);
+            right.assign(sorted.begin() + mid, sorted.end());
+        }
+        sorted.clear();
+        sorted.shrink_to_fit();
+
+        state.live_bytes += (left.size() + right.size()) * sizeof(bvh_primitive_ref);
+        state.peak_bytes = std::max(state.peak_bytes, state.live_bytes
+            + state.scratch.capacity() * sizeof(build_node)
+            + state.leaf_refs.capacity() * sizeof(bvh_primitive_ref));
+
+        auto children = static_cast<uint32_t>(state.scratch.size());
+        state.scratch.resize(state.scratch.size() + 2);
+        state.scratch[index].first_child = children;
+        state.scratch[index].count = 0;
+        state.scratch[index].axis = axis;
+
+        build_spatial_range(state, left, children, depth + 1);
+        build_spatial_range(state, right, children + 1, depth + 1);
+        state.live_bytes -= (left.size() + right.size()) * sizeof(bvh_primitive_ref);
+    }
+
+    // Bins every reference's clipped box into equal slabs of box along each
+    // axis, counting where references enter and leave, and returns the SAH cost
+    // of the cheapest slab boundary (infinity if there is none).
+    static real find_spatial_split(
+        const bvh_build_options& options, const std::vector<bvh_primitive_ref>& refs,
+        const aabb& box, int& best_axis, real& best_plane
+    ) {
+        const int bins = std::min(std::max(options.bin_count, 2), bvh_build_options::max_bins);
+        const real inv_area = 1.0 / std::max(box.surface_area(), real(1e-12));
+        real best_cost = infinity;
+
+        for (int axis = 0; axis < 3; axis++) {
+            real lo = box.min()[axis];
+            real width = (box.max()[axis] - lo) / bins;
+            if (!(width > 0))
+                continue;
+
+            aabb bin_boxes[bvh_build_options::max_bins];
+            size_t entries[bvh_build_options::max_bins];
+            size_t exits[bvh_build_options::max_bins];
+            std::fill(bin_boxes, bin_boxes + bins, aabb::empty());
+            std::fill(entries, entries + bins, 0);
+            std::fill(exits, exits + bins, 0);
+
+            // Bins follow the rule split_spatially() applies at each plane, so
+            // the split priced is the one carried out: a reference is left of
+            // plane b if it starts below it, and right of it if it ends above
+            // it or starts on or above it. One touching the plane from a side
+            // counts on that side only. planes_below() is the number of planes
+            // below x (strict) or at or below it, found from the estimate
+            // against the planes exactly as they will be placed.
+            auto plane_at = [&](int b) { return lo + b * width; };
+            auto planes_below = [&](real x, bool strict) {
+                int k = std::min(bins - 1, std::max(0, static_cast<int>((x - lo) / width)));
+                while (k < bins - 1 && (strict ? plane_at(k + 1) < x : plane_at(k + 1) <= x))
+                    k++;
+                while (k > 0 && (strict ? plane_at(k) >= x : plane_at(k) > x))
+                    k--;
+                return k;
+            };
+
+            for (const auto& ref : refs) {
+                int first = planes_below(ref.box.min()[axis], false);
+                int last = std::max(first, planes_below(ref.box.max()[axis], true));
+                for (int b = first; b <= last; b++) {
+                    bin_boxes[b].expand(clip(ref.box, axis,
+                        b == 0 ? -infinity : plane_at(b),
+                        b == bins - 1 ? infinity : plane_at(b + 1)));
+                }
+                entries[first]++;
+                exits[last]++;
+            }
+
+            real right_area[bvh_build_options::max_bins];
+            size_t right_count[bvh_build_options::max_bins];
+            aabb acc = aabb::empty();
+            size_t n = 0;
+            for (int b = bins - 1; b > 0; b--) {
+                acc.expand(bin_boxes[b]);
+                n += exits[b];
+                right_area[b] = acc.surface_area();
+                right_count[b] = n;
+            }
+
+            acc = aabb::empty();
+            n = 0;
+            for (int b = 1; b < bins; b++) {
+                acc.expand(bin_boxes[b - 1]);
+                n += entries[b - 1];
+                if (n == 0 || right_count[b] == 0)
+                    continue;
+
+                real cost = options.traversal_cost + options.intersection_cost * inv_area
+                    * (acc.surface_area() * n + right_area[b] * right_count[b]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_plane = plane_at(b);
+                }
+            }
+        }
+
+        return best_cost;
+    }
+
+    // Sends each reference to the side(s) of the plane it overlaps, clipped.
+    // Returns false if either side ends up empty.
+    static bool split_spatially(
+        const std::vector<bvh_primitive_ref>& refs, int axis, real plane,
+        std::vector<bvh_primitive_ref>& left, std::vector<bvh_primitive_ref>& right
+    ) {
+        for (const auto& ref : refs) {
+            if (ref.box.min()[axis] < plane) {
+                left.push_back(ref);
+                left.back().box = clip(ref.box, axis, -infinity, plane);
+                left.back().centroid = left.back().box.centroid();
+            }
+            if (ref.box.max()[axis] > plane || ref.box.min()[axis] >= plane) {
+                right.push_back(ref);
+                right.back().box = clip(ref.box, axis, plane, infinity);
+                right.back().centroid = right.back().box.centroid();
+            }
+        }
+
+        return !left.empty() && !right.empty();
+    }
+
+    static aabb clip(const aabb& box, int axis, real lo, real hi) {
+        point3 min = box.min(), max = box.max();
+        min[axis] = std::max(min[axis], lo);
+        max[axis] = std::min(max[axis], hi);
+        return aabb(min, max);
+    }
+
+    static void build_range(
+        std::vector<bvh_primitive_ref>& refs, std::vector<build_node>& scratch,
+        std::atomic<uint32_t>& used, uint32_t index, size_t start, size_t end,
+        const bvh_build_options& options, int depth, thread_pool* pool, int worker
+    ) {
+        auto& node = scratch[index];
+        node.box = aabb::empty();
+        for (size_t i = start; i < end; i++)
+            node.box.expand(refs[i].box);
+
+        // Below the stack limit every range becomes a leaf; leaves are split
+        // regardless once they outgrow the 16-bit count.
+        int axis = 0;
+        size_t mid = (depth >= max_depth - 1) ? end : sah_partition(refs, start, end, options, &axis);
+        if (mid == end && end - start > UINT16_MAX)
+            mid = start + (end - start) / 2;
+
+        if (mid == end) {
+            node.start = static_cast<uint32_t>(start);
+            node.count = static_cast<uint32_t>(end - start);
+            return;
+        }
+
+        auto children = used.fetch_add(2);
+        node.first_child = children;
+        node.count = 0;
+        node.axis = axis;
+
+        if (pool && mid - start >= parallel_grain) {
+            pool->submit(worker, [&refs, &scratch, &used, &options, children, start, mid, depth, pool](int w) {
+                build_range(refs, scratch, used, children, start, mid, options, depth + 1, pool, w);
+            });
+        }
+        else {
+            build_range(refs, scratch, used, children, start, mid, options, depth + 1, pool, worker);
+        }
+        build_range(refs, scratch, used, children + 1, mid, end, options, depth + 1, pool, worker);
+    }
+
+    uint32_t flatten(
+        const std::vector<bvh_primitive_ref>& refs, const std::vector<build_node>& scratch,
+        uint32_t source
+    ) {
+        const auto& from = scratch[source];
+
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        set_bounds(nodes[index], from.box);
+
+        if (from.count > 0) {
+            nodes[index].offset = static_cast<uint32_t>(indices.size());
+            nodes[index].count = static_cast<uint16_t>(from.count);
+            for (uint32_t i = from.start; i < from.start + from.count; i++)
+                indices.push_back(static_cast<uint32_t>(refs[i].index));
+            return index;
+        }
+
+        flatten(refs, scratch, from.first_child);
+        auto second = flatten(refs, scratch, from.first_child + 1);
+
+        nodes[index].offset = second;
+        nodes[index].axis = static_cast<uint8_t>(from.axis);
+        return index;
+    }
+};
+
+// Drop-in replacement for bvh_node: the same SAH tree, flattened into one
+// array and traversed without recursion, virtual calls or refcounting.
+class linear_bvh : public hittable {
+public:
+    linear_bvh() {}
+
+    linear_bvh(
+        const hittable_list& list, real time0, real time1,
+        const bvh_build_options& options = bvh_build_options())
+        : objects(list.objects)
+    {
+        auto refs = make_primitive_refs(objects, time0, time1);
+        tree.build(refs, options);
+    }
+
+    // Brings the tree up to date with the objects' bounds over [time0, time1]
+    // by refitting and rebuilding degraded subtrees; see linear_bvh_tree::update().
+    int update(
+        real time0, real time1, const bvh_build_options& options = bvh_build_options()) {
+        return tree.update(make_primitive_refs(objects, time0, time1), options);
+    }
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+        if (tree.empty())
+            return false;
+        output_box = tree.bounds();
+        return true;
+    }
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return tree.traverse<true>(r, t_min, t_max, [&](uint32_t index, real t0, real t1) {
+            return objects[index]->occluded(r, t0, t1);
+        });
+    }
+
+    virtual void intersect_packet(ray_packet& p, uint32_t active) const override;
+
+public:
+    std::vector<shared_ptr<hittable>> objects;
+    linear_bvh_tree tree;
+};
+
+bool linear_bvh::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+    return tree.traverse(r, t_min, t_max, [&](uint32_t index, real t0, real& t1) {
+        if (!objects[index]->intersect(r, t0, t1, hit))
+            return false;
+        t1 = hit.t;
+        return true;
+    });
+}
+
+void linear_bvh::intersect_packet(ray_packet& p, uint32_t active) const {
+    if (!p.coherent) {
+        hittable::intersect_packet(p, active);
+        return;
+    }
+
+    const auto* index_array = tree.index_data();
+    tree.traverse_packet(p, active,
+        [&](uint32_t first, uint32_t count, uint32_t lanes) {
+            for (uint32_t i = 0; i < count; i++)
+                objects[index_array[first + i]]->intersect_packet(p, lanes);
+        },
+        [&](uint32_t node, int k) {
+            tree.traverse_leaves(p.rays[k], 0, p.t_max[k],
+                [&](uint32_t first, uint32_t count, real /*t0*/, real& t1) {
+                    for (uint32_t i = 0; i < count; i++)
+                        intersect_lane(*objects[index_array[first + i]], p, k);
+                    bool closer = p.t_max[k] < t1;
+                    t1 = p.t_max[k];
+                    return closer;
+                }, node);
+        });
+}
+
+#endif
@@ -5,6 +5,8 @@
 #include <time.h>  
 #include <stdlib.h>
 #include <algorithm>
+#include <string>
+#include <atomic>
 #include "color.h"
 #include "vec3.h"
 #include "ray.h"
@@ -19,8 +21,23 @@
 #include "box.h"
 #include "constant_medium.h"
 #include "bvh.h"
-
-double hit_sphere(const point3& center, double radius, const ray& r) { //old
+#include "linear_bvh.h"
+#include "bvh_cache.h"
+#include "lazy_bvh.h"
+#include "sphere_set.h"
+#include "motion_bvh.h"
+#include "wide_bvh.h"
+#include "instance.h"
+#include "triangle_mesh.h"
+#include "mesh_loader.h"
+#include "compiled_scene.h"
+#include "renderer.h"
+#include "scene_arena.h"
+#include "scene_optimizer.h"
+#include "wavefront.h"
+#include "perf_counters.h"
+
+real hit_sphere(const point3& center, real radius, const ray& r) { //old
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -35,39 +52,277 @@ double hit_sphere(const point3& center, double radius, const ray& r) { //old
     }
 }
 
-color ray_color(const ray& r, const color& background, const hittable& world, int depth) {
+// Bounces a path makes before Russian roulette may end it; 0 turns it off.
+int roulette_depth = 5;
+
+// Rays traced by ray_color(), for the average path length of a render.
+std::atomic<uint64_t> path_segments{ 0 };
+
+// Follows a path of up to max_depth rays as a loop, carrying the product of
+// the attenuations so far (the throughput) instead of recursing. The first ray
+// r has already been traced: found says whether it hit anything, at rec.
+color continue_path(
+    const ray& r, bool found, hit_record& rec, const color& background, const hittable& world,
+    int max_depth
+) {
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray path = r;
+    int bounce = 1;
+
+    while (true) {
+        // If the ray hits nothing, the background is all it carries.
+        if (!found) {
+            radiance += throughput * background;
+            break;
+        }
+
+        //surface normals for task 1 basic scene
+        //vec3 N = rec.normal;
+        //return 0.5 * color(N.x() + 1, N.y() + 1, N.z() + 1);
+        //surface normals for task 1 basic scene
+
+        ray scattered;
+        color attenuation;
+        radiance += throughput * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+        if (!rec.mat_ptr->scatter(path, rec, attenuation, scattered))
+            break;
+
+        throughput = throughput * attenuation;
+        if (!survives_roulette(bounce, roulette_depth, throughput) || bounce == max_depth)
+            break;
+        path = scattered;
+
+        // Key the random numbers of this bounce to (pixel, sample, depth).
+        seed_bounce(max_depth - bounce);
+        bounce++;
+        found = world.hit(path, 0, infinity, rec);
+    }
+
+    path_segments.fetch_add(bounce, std::memory_order_relaxed);
+    return radiance;
+}
+
+color ray_color(const ray& r, const color& background, const hittable& world, int max_depth) {
+    if (max_depth <= 0)
+        return color(0, 0, 0);
+
+    seed_bounce(max_depth);
     hit_record rec;
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
+    bool found = world.hit(r, 0, infinity, rec);
+    return continue_path(r, found, rec, background, world, max_depth);
+}
+
+// ray_color() for count camera rays at once: their first bounce is traced as
+// one ray_packet, with each ray's generator seeded as ray_color() seeds it, and
+// the rest of every path then follows in turn.
+void trace_camera_packet(
+    const ray* rays, const uint64_t* keys, int count, color* radiance,
+    const color& background, const hittable& world, int max_depth
+) {
+    if (max_depth <= 0) {
+        std::fill(radiance, radiance + count, color(0, 0, 0));
+        return;
+    }
+
+    ray_packet packet;
+    for (int k = 0; k < count; k++) {
+        resume_sample(keys[k]);
+        seed_bounce(max_depth);
+        packet.add(rays[k], thread_sampler().gen);
+    }
+    packet.prepare();
+    world.intersect_packet(packet, packet.lanes());
+
+    for (int k = 0; k < count; k++) {
+        resume_sample(keys[k]);
+        thread_sampler().gen = packet.rng[k];
+        hit_record rec;
+        bool found = (packet.found >> k) & 1;
+        if (found)
+            resolve_surface_hit(rays[k], packet.hits[k], rec);
+        radiance[k] = continue_path(rays[k], found, rec, background, world, max_depth);
+    }
+}
+
+// ray_color() over a compiled scene: the same path, with materials and
+// textures dispatched by tag instead of through virtual calls.
+color ray_color(const ray& r, const color& background, const compiled_scene& world, int max_depth) {
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray path = r;
+    int bounce = 0;
+
+    while (bounce < max_depth) {
+        seed_bounce(max_depth - bounce);
+        bounce++;
+
+        compiled_hit hit;
+        if (!world.hit(path, 0, infinity, hit)) {
+            radiance += throughput * background;
+            break;
+        }
+
+        ray scattered;
+        color attenuation;
+        radiance += throughput * world.emitted(hit);
+
+        if (!world.scatter(path, hit, attenuation, scattered))
+            break;
+
+        throughput = throughput * attenuation;
+        if (!survives_roulette(bounce, roulette_depth, throughput))
+            break;
+        path = scattered;
+    }
+
+    path_segments.fetch_add(bounce, std::memory_order_relaxed);
+    return radiance;
+}
+
+// Ambient occlusion: white where a cosine-weighted probe from the first surface
+// hit escapes to the given distance, black where it is blocked. The probe only
+// needs to know whether anything is in the way, so it uses occluded().
+color ambient_occlusion(const ray& r, const hittable& world, real distance) {
+    hit_record rec;
+    seed_bounce(1);
+
+    if (!world.hit(r, 0, infinity, rec))
+        return color(1, 1, 1);
+
+    auto direction = rec.normal + random_unit_vector();
+    if (direction.near_zero())
+        direction = rec.normal;
+
+    ray probe(rec.spawn_point(direction), direction, r.time());
+    if (world.occluded(probe, 0, distance / direction.length()))
         return color(0, 0, 0);
+    return color(1, 1, 1);
+}
+
+// Owns the objects, materials and textures of the scene (and its BVHs) for the
+// whole run, so that hits can refer to them by plain pointer.
+scene_arena scene_storage;
+
+// BVH builder used by the scenes, chosen on the command line.
+enum class bvh_kind { median, sah, linear, wide, motion, sbvh, lazy };
+bvh_kind bvh_builder = bvh_kind::median;
+bvh_build_options bvh_options;
+int motion_segments = 1;
+real sbvh_budget = 1.0;
+std::string bvh_cache_dir;  // empty: no cache
+size_t lazy_subtree_size = 4096;
+bool use_sphere_sets = false;  // pack spheres into a sphere_set before building
+bool defer_scene_bvhs = false;  // scenes leave their BVHs to the optimizer
+std::vector<shared_ptr<lazy_bvh>> lazy_bvhs;  // for the on-demand build report
+
+void print_build_stats(const bvh_build_stats& stats) {
+    std::cerr << "  built in " << stats.seconds << " s on " << stats.threads << " thread(s), peak "
+        << stats.peak_bytes / (1024.0 * 1024.0) << " MiB\n";
+}
+
+// Builds a linear BVH over objects, or maps an identical one cached by an earlier
+// run when --bvh-cache is given.
+shared_ptr<linear_bvh> make_linear_bvh(
+    const hittable_list& objects, real time0, real time1, const bvh_build_options& options
+) {
+    if (bvh_cache_dir.empty())
+        return scene_storage.make<linear_bvh>(objects, time0, time1, options);
+
+    auto bvh = scene_storage.make<linear_bvh>();
+    bvh->objects = objects.objects;
+    auto refs = make_primitive_refs(bvh->objects, time0, time1);
+    bool cached = build_with_cache(bvh->tree, refs, options, bvh_cache_dir);
+    std::cerr << (cached ? "Mapped cached" : "Built and cached") << " BVH over "
+        << objects.objects.size() << " objects\n";
+    return bvh;
+}
+
+shared_ptr<hittable> build_bvh(const hittable_list& objects, real time0, real time1) {
+    if (bvh_builder == bvh_kind::linear) {
+        auto bvh = make_linear_bvh(objects, time0, time1, bvh_options);
+        std::cerr << "Linear BVH over " << objects.objects.size() << " objects, "
+            << bvh->tree.node_count() << " nodes, SAH cost " << bvh->tree.sah_cost(bvh_options) << '\n';
+        print_build_stats(bvh->tree.build_stats);
+        return bvh;
+    }
+
+    if (bvh_builder == bvh_kind::sbvh) {
+        auto options = bvh_options;
+        options.spatial_split_budget = sbvh_budget;
+        auto bvh = make_linear_bvh(objects, time0, time1, options);
+        std::cerr << "SBVH over " << objects.objects.size() << " objects, "
+            << bvh->tree.index_count() << " references, " << bvh->tree.node_count()
+            << " nodes, SAH cost " << bvh->tree.sah_cost(options) << '\n';
+        print_build_stats(bvh->tree.build_stats);
+        return bvh;
+    }
 
-    // If the ray hits nothing, return the background color.
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
+    if (bvh_builder == bvh_kind::lazy) {
+        auto bvh = scene_storage.make<lazy_bvh>(objects, time0, time1, bvh_options, lazy_subtree_size);
+        std::cerr << "Lazy BVH over " << objects.objects.size() << " objects, "
+            << bvh->subtree_count() << " subtrees left to build on demand\n";
+        print_build_stats(bvh->build_stats);
+        lazy_bvhs.push_back(bvh);
+        return bvh;
+    }
 
-    //surface normals for task 1 basic scene
-    //vec3 N = rec.normal;
-    //return 0.5 * color(N.x() + 1, N.y() + 1, N.z() + 1);
-    //surface normals for task 1 basic scene
+    if (bvh_builder == bvh_kind::motion) {
+        auto bvh = scene_storage.make<motion_bvh>(objects, time0, time1, motion_segments, bvh_options);
+        std::cerr << "Motion BVH over " << objects.objects.size() << " objects, "
+            << bvh->segments.size() << " time segment(s), " << bvh->node_count() << " nodes, "
+            << bvh->memory_bytes() / 1024 << " KiB\n";
+        print_build_stats(bvh->build_stats);
+        return bvh;
+    }
 
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (bvh_builder == bvh_kind::wide) {
+        auto bvh = scene_storage.make<wide_bvh>(objects, time0, time1, bvh_options);
+        std::cerr << "BVH" << bvh->width() << " over " << objects.objects.size() << " objects, "
+            << bvh->node_count() << " nodes, " << bvh->memory_bytes() / 1024 << " KiB\n";
+        print_build_stats(bvh->build_stats);
+        return bvh;
+    }
 
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
+    bool sah = bvh_builder == bvh_kind::sah;
+    auto node = sah
+        ? scene_storage.make<bvh_node>(objects, time0, time1, bvh_options)
+        : scene_storage.make<bvh_node>(objects, time0, time1);
 
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+    std::cerr << (sah ? "SAH" : "Median") << " BVH over " << objects.objects.size()
+        << " objects, SAH cost " << bvh_sah_cost(*node, bvh_options) << '\n';
+
+    return node;
+}
+
+shared_ptr<hittable> make_bvh(const hittable_list& objects, real time0, real time1) {
+    // The optimizer flattens what the scenes build and builds its own BVH over
+    // the result, so while it is on they get plain lists instead of trees.
+    if (defer_scene_bvhs)
+        return scene_storage.make<hittable_list>(objects);
+
+    if (!use_sphere_sets)
+        return build_bvh(objects, time0, time1);
+
+    auto packed = gather_spheres(objects, time0, time1, bvh_options);
+    if (auto set = std::dynamic_pointer_cast<sphere_set>(packed.objects.back())) {
+        std::cerr << "Sphere set of " << set->size() << " spheres, " << set->materials.size()
+            << " materials, " << set->memory_bytes() / 1024 << " KiB, "
+            << (set->use_avx ? "AVX" : "SSE2") << " kernel\n";
+        print_build_stats(set->tree.build_stats);
+    }
+    return build_bvh(packed, time0, time1);
 }
 
 hittable_list random_scene() {
     hittable_list world;
 
-    //auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    //world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+    //auto ground_material = scene_storage.make<lambertian>(color(0.5, 0.5, 0.5));
+    //world.add(scene_storage.make<sphere>(point3(0, -1000, 0), 1000, ground_material));
     //texture checker
-    auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    auto checker = scene_storage.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    world.add(scene_storage.make<sphere>(point3(0, -1000, 0), 1000, scene_storage.make<lambertian>(checker)));
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -80,46 +335,46 @@ hittable_list random_scene() {
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    sphere_material = scene_storage.make<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0, .5), 0);
-                    world.add(make_shared<moving_sphere>(
+                    world.add(scene_storage.make<moving_sphere>(
                         center, center2, 0.0, 1.0, 0.2, sphere_material));
                 }
                 else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = scene_storage.make<metal>(albedo, fuzz);
+                    world.add(scene_storage.make<sphere>(center, 0.2, sphere_material));
                 }
                 else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = scene_storage.make<dielectric>(1.5);
+                    world.add(scene_storage.make<sphere>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = scene_storage.make<dielectric>(1.5);
+    world.add(scene_storage.make<sphere>(point3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    auto material2 = scene_storage.make<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(scene_storage.make<sphere>(point3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    auto material3 = scene_storage.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(scene_storage.make<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    return world;
+    return hittable_list(make_bvh(world, 0.0, 1.0));
 }
 
 hittable_list two_spheres() {
     hittable_list objects;
 
-    auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    auto checker = scene_storage.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
 
-    objects.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    objects.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    objects.add(scene_storage.make<sphere>(point3(0, -10, 0), 10, scene_storage.make<lambertian>(checker)));
+    objects.add(scene_storage.make<sphere>(point3(0, 10, 0), 10, scene_storage.make<lambertian>(checker)));
 
     return objects;
 }
@@ -127,17 +382,17 @@ hittable_list two_spheres() {
 hittable_list two_perlin_spheres() {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = scene_storage.make<noise_texture>(4);
+    objects.add(scene_storage.make<sphere>(point3(0, -1000, 0), 1000, scene_storage.make<lambertian>(pertext)));
+    objects.add(scene_storage.make<sphere>(point3(0, 2, 0), 2, scene_storage.make<lambertian>(pertext)));
 
     return objects;
 }
 
 hittable_list earth() {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
+    auto earth_texture = scene_storage.make<image_texture>("earthmap.jpg");
+    auto earth_surface = scene_storage.make<lambertian>(earth_texture);
+    auto globe = scene_storage.make<sphere>(point3(0, 0, 0), 2, earth_surface);
 
     return hittable_list(globe);
 }
@@ -145,12 +400,12 @@ hittable_list earth() {
 hittable_list simple_light() {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = scene_storage.make<noise_texture>(4);
+    objects.add(scene_storage.make<sphere>(point3(0, -1000, 0), 1000, scene_storage.make<lambertian>(pertext)));
+    objects.add(scene_storage.make<sphere>(point3(0, 2, 0), 2, scene_storage.make<lambertian>(pertext)));
 
-    auto difflight = make_shared<diffuse_light>(color(4, 4, 4));
-    objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+    auto difflight = scene_storage.make<diffuse_light>(color(4, 4, 4));
+    objects.add(scene_storage.make<xy_rect>(3, 5, 1, 3, -2, difflight));
 
     return objects;
 }
@@ -158,64 +413,64 @@ hittable_list simple_light() {
 hittable_list cornell_box() {
     hittable_list objects;
 
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+    auto red = scene_storage.make<lambertian>(color(.65, .05, .05));
+    auto white = scene_storage.make<lambertian>(color(.73, .73, .73));
+    auto green = scene_storage.make<lambertian>(color(.12, .45, .15));
+    auto light = scene_storage.make<diffuse_light>(color(15, 15, 15));
 
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+    objects.add(scene_storage.make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(scene_storage.make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(scene_storage.make<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(scene_storage.make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(scene_storage.make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(scene_storage.make<xy_rect>(0, 555, 0, 555, 555, white));
 
     //additional 2 boxes
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    shared_ptr<hittable> box1 = scene_storage.make<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+    box1 = scene_storage.make<rotate_y>(box1, 15);
+    box1 = scene_storage.make<translate>(box1, vec3(265, 0, 295));
     objects.add(box1);
 
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    shared_ptr<hittable> box2 = scene_storage.make<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+    box2 = scene_storage.make<rotate_y>(box2, -18);
+    box2 = scene_storage.make<translate>(box2, vec3(130, 0, 65));
     objects.add(box2);
 
-    return objects;
+    return hittable_list(make_bvh(objects, 0.0, 1.0));
 }
 
 hittable_list cornell_smoke() {
     hittable_list objects;
 
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+    auto red = scene_storage.make<lambertian>(color(.65, .05, .05));
+    auto white = scene_storage.make<lambertian>(color(.73, .73, .73));
+    auto green = scene_storage.make<lambertian>(color(.12, .45, .15));
+    auto light = scene_storage.make<diffuse_light>(color(7, 7, 7));
 
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+    objects.add(scene_storage.make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(scene_storage.make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(scene_storage.make<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(scene_storage.make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(scene_storage.make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(scene_storage.make<xy_rect>(0, 555, 0, 555, 555, white));
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    shared_ptr<hittable> box1 = scene_storage.make<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+    box1 = scene_storage.make<rotate_y>(box1, 15);
+    box1 = scene_storage.make<translate>(box1, vec3(265, 0, 295));
 
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    shared_ptr<hittable> box2 = scene_storage.make<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+    box2 = scene_storage.make<rotate_y>(box2, -18);
+    box2 = scene_storage.make<translate>(box2, vec3(130, 0, 65));
 
-    objects.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
-    objects.add(make_shared<constant_medium>(box2, 0.01, color(1, 1, 1)));
+    objects.add(scene_storage.make<constant_medium>(box1, 0.01, color(0, 0, 0)));
+    objects.add(scene_storage.make<constant_medium>(box2, 0.01, color(1, 1, 1)));
 
-    return objects;
+    return hittable_list(make_bvh(objects, 0.0, 1.0));
 }
 
-hittable_list final_scene() {
+hittable_list final_scene(int sphere_count = 1000) {
     hittable_list boxes1;
-    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    auto ground = scene_storage.make<lambertian>(color(0.48, 0.83, 0.53));
 
     const int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; i++) {
@@ -228,48 +483,48 @@ hittable_list final_scene() {
             auto y1 = random_double(1, 101);
             auto z1 = z0 + w;
 
-            boxes1.add(make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+            boxes1.add(scene_storage.make<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
         }
     }
 
     hittable_list objects;
 
-    objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+    objects.add(make_bvh(boxes1, 0, 1));
 
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
-    objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+    auto light = scene_storage.make<diffuse_light>(color(7, 7, 7));
+    objects.add(scene_storage.make<xz_rect>(123, 423, 147, 412, 554, light));
 
     auto center1 = point3(400, 400, 200);
     auto center2 = center1 + vec3(30, 0, 0);
-    auto moving_sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-    objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+    auto moving_sphere_material = scene_storage.make<lambertian>(color(0.7, 0.3, 0.1));
+    objects.add(scene_storage.make<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
 
-    objects.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-    objects.add(make_shared<sphere>(
-        point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
+    objects.add(scene_storage.make<sphere>(point3(260, 150, 45), 50, scene_storage.make<dielectric>(1.5)));
+    objects.add(scene_storage.make<sphere>(
+        point3(0, 150, 145), 50, scene_storage.make<metal>(color(0.8, 0.8, 0.9), 1.0)
         ));
 
-    auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
+    auto boundary = scene_storage.make<sphere>(point3(360, 150, 145), 70, scene_storage.make<dielectric>(1.5));
     objects.add(boundary);
-    objects.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-    objects.add(make_shared<constant_medium>(boundary, .0001, color(1, 1, 1)));
+    objects.add(scene_storage.make<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
+    boundary = scene_storage.make<sphere>(point3(0, 0, 0), 5000, scene_storage.make<dielectric>(1.5));
+    objects.add(scene_storage.make<constant_medium>(boundary, .0001, color(1, 1, 1)));
 
-    auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-    objects.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
-    auto pertext = make_shared<noise_texture>(0.1);
-    objects.add(make_shared<sphere>(point3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
+    auto emat = scene_storage.make<lambertian>(scene_storage.make<image_texture>("earthmap.jpg"));
+    objects.add(scene_storage.make<sphere>(point3(400, 200, 400), 100, emat));
+    auto pertext = scene_storage.make<noise_texture>(0.1);
+    objects.add(scene_storage.make<sphere>(point3(220, 280, 300), 80, scene_storage.make<lambertian>(pertext)));
 
     hittable_list boxes2;
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    int ns = 1000;
+    auto white = scene_storage.make<lambertian>(color(.73, .73, .73));
+    int ns = sphere_count;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+        boxes2.add(scene_storage.make<sphere>(point3::random(0, 165), 10, white));
     }
 
-    objects.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
+    objects.add(scene_storage.make<translate>(
+        scene_storage.make<rotate_y>(
+            make_bvh(boxes2, 0.0, 1.0), 15),
         vec3(-100, 270, 395)
         )
     );
@@ -280,61 +535,61 @@ hittable_list final_scene() {
 hittable_list task1_basic_scene()
 {
     hittable_list objects;
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_1 = make_shared<lambertian>(color(0.1, 0.2, 0.5)); //blue
-    auto material_2 = make_shared<lambertian>(color(1, 0.7, 1)); //pink
-    auto material_3 = make_shared<lambertian>(color(1, 0.5, 0)); //orange
-    auto material_4 = make_shared<lambertian>(color(0.9, 0, 0.2)); //redish
-    auto material_metal = make_shared<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
-
-    objects.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    objects.add(make_shared<sphere>(point3(-3.0, 1.0, -10.0), 2, material_1));
-    objects.add(make_shared<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_2));
-    objects.add(make_shared<sphere>(point3( 0.0, 0.5, -5.0), 1, material_metal));
-    objects.add(make_shared<sphere>(point3(1, -0.25, -4.0), 0.3, material_4));
-    objects.add(make_shared<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
+    auto material_ground = scene_storage.make<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_1 = scene_storage.make<lambertian>(color(0.1, 0.2, 0.5)); //blue
+    auto material_2 = scene_storage.make<lambertian>(color(1, 0.7, 1)); //pink
+    auto material_3 = scene_storage.make<lambertian>(color(1, 0.5, 0)); //orange
+    auto material_4 = scene_storage.make<lambertian>(color(0.9, 0, 0.2)); //redish
+    auto material_metal = scene_storage.make<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
+
+    objects.add(scene_storage.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    objects.add(scene_storage.make<sphere>(point3(-3.0, 1.0, -10.0), 2, material_1));
+    objects.add(scene_storage.make<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_2));
+    objects.add(scene_storage.make<sphere>(point3( 0.0, 0.5, -5.0), 1, material_metal));
+    objects.add(scene_storage.make<sphere>(point3(1, -0.25, -4.0), 0.3, material_4));
+    objects.add(scene_storage.make<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
     return objects;
 }
 
 hittable_list task3_more_shapes()
 {
     hittable_list objects;
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_1 = make_shared<lambertian>(color(0.1, 0.2, 0.5)); //blue
+    auto material_ground = scene_storage.make<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_1 = scene_storage.make<lambertian>(color(0.1, 0.2, 0.5)); //blue
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(2,2,2), material_1);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(-1, -1, -10));
+    shared_ptr<hittable> box1 = scene_storage.make<box>(point3(0, 0, 0), point3(2,2,2), material_1);
+    box1 = scene_storage.make<rotate_y>(box1, 15);
+    box1 = scene_storage.make<translate>(box1, vec3(-1, -1, -10));
     objects.add(box1);
 
-    //objects.add(make_shared<xy_rect>(-1, 1, -1, 1, -6, material_1));
+    //objects.add(scene_storage.make<xy_rect>(-1, 1, -1, 1, -6, material_1));
 
-    objects.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    objects.add(scene_storage.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
     return objects;
 }
 
 hittable_list task4_diffuse_and_metals()
 {
     hittable_list objects;
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_1 = make_shared<lambertian>(color(0.1, 0.2, 0.5)); //blue
-    auto material_2 = make_shared<lambertian>(color(1, 0.7, 1)); //pink
-    auto material_3 = make_shared<lambertian>(color(1, 0.5, 0)); //orange
-    auto material_4 = make_shared<lambertian>(color(0.9, 0, 0.2)); //redish
-    auto material_metal = make_shared<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
-    auto material_gold = make_shared<metal>(color(0.83, 0.68, 0.21), 0.0); //gold
-
-    objects.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    objects.add(make_shared<sphere>(point3(3.0, 1.0, -10.0), 2, material_gold));
-    objects.add(make_shared<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_2));
-    objects.add(make_shared<sphere>(point3(0.0, 0.5, -5.0), 1, material_metal));
-    objects.add(make_shared<sphere>(point3(1, -0.25, -4.0), 0.3, material_4));
-    objects.add(make_shared<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
+    auto material_ground = scene_storage.make<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_1 = scene_storage.make<lambertian>(color(0.1, 0.2, 0.5)); //blue
+    auto material_2 = scene_storage.make<lambertian>(color(1, 0.7, 1)); //pink
+    auto material_3 = scene_storage.make<lambertian>(color(1, 0.5, 0)); //orange
+    auto material_4 = scene_storage.make<lambertian>(color(0.9, 0, 0.2)); //redish
+    auto material_metal = scene_storage.make<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
+    auto material_gold = scene_storage.make<metal>(color(0.83, 0.68, 0.21), 0.0); //gold
+
+    objects.add(scene_storage.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    objects.add(scene_storage.make<sphere>(point3(3.0, 1.0, -10.0), 2, material_gold));
+    objects.add(scene_storage.make<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_2));
+    objects.add(scene_storage.make<sphere>(point3(0.0, 0.5, -5.0), 1, material_metal));
+    objects.add(scene_storage.make<sphere>(point3(1, -0.25, -4.0), 0.3, material_4));
+    objects.add(scene_storage.make<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
     
     
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(2, 2, 2), material_1);
-    box1 = make_shared<rotate_y>(box1, 45);
-    box1 = make_shared<translate>(box1, vec3(-5, -0.75, -8));
+    shared_ptr<hittable> box1 = scene_storage.make<box>(point3(0, 0, 0), point3(2, 2, 2), material_1);
+    box1 = scene_storage.make<rotate_y>(box1, 45);
+    box1 = scene_storage.make<translate>(box1, vec3(-5, -0.75, -8));
     objects.add(box1);
 
     
@@ -344,32 +599,32 @@ hittable_list task4_diffuse_and_metals()
 hittable_list task5_refraction()
 {
     hittable_list objects;
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_1 = make_shared<lambertian>(color(0.1, 0.2, 0.5)); //blue
-    auto material_2 = make_shared<lambertian>(color(1, 0.7, 1)); //pink
-    auto material_3 = make_shared<lambertian>(color(1, 0.5, 0)); //orange
-    auto material_4 = make_shared<lambertian>(color(0.9, 0, 0.2)); //redish
-    auto material_metal = make_shared<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
-    auto material_gold = make_shared<metal>(color(0.83, 0.68, 0.21), 0.0); //gold
+    auto material_ground = scene_storage.make<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_1 = scene_storage.make<lambertian>(color(0.1, 0.2, 0.5)); //blue
+    auto material_2 = scene_storage.make<lambertian>(color(1, 0.7, 1)); //pink
+    auto material_3 = scene_storage.make<lambertian>(color(1, 0.5, 0)); //orange
+    auto material_4 = scene_storage.make<lambertian>(color(0.9, 0, 0.2)); //redish
+    auto material_metal = scene_storage.make<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
+    auto material_gold = scene_storage.make<metal>(color(0.83, 0.68, 0.21), 0.0); //gold
 
-    auto material_glass = make_shared<dielectric>(1.52);
-    auto material_diamond = make_shared<dielectric>(2.418);
+    auto material_glass = scene_storage.make<dielectric>(1.52);
+    auto material_diamond = scene_storage.make<dielectric>(2.418);
 
 
-    objects.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    objects.add(make_shared<sphere>(point3(3.0, 1.0, -10.0), 2, material_gold));
+    objects.add(scene_storage.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    objects.add(scene_storage.make<sphere>(point3(3.0, 1.0, -10.0), 2, material_gold));
     
-    objects.add(make_shared<sphere>(point3(0.0, 0.5, -5.0), 1, material_metal));
-    objects.add(make_shared<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
+    objects.add(scene_storage.make<sphere>(point3(0.0, 0.5, -5.0), 1, material_metal));
+    objects.add(scene_storage.make<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
 
-    objects.add(make_shared<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_glass));
-    objects.add(make_shared<sphere>(point3(1.1, -0.25, -3.5), 0.4, material_glass));
-    objects.add(make_shared<sphere>(point3(2.5, 0.37, -5.0), -0.75, material_glass));
+    objects.add(scene_storage.make<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_glass));
+    objects.add(scene_storage.make<sphere>(point3(1.1, -0.25, -3.5), 0.4, material_glass));
+    objects.add(scene_storage.make<sphere>(point3(2.5, 0.37, -5.0), -0.75, material_glass));
 
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(2, 2, 2), material_1);
-    box1 = make_shared<rotate_y>(box1, 45);
-    box1 = make_shared<translate>(box1, vec3(-5, -0.75, -8));
+    shared_ptr<hittable> box1 = scene_storage.make<box>(point3(0, 0, 0), point3(2, 2, 2), material_1);
+    box1 = scene_storage.make<rotate_y>(box1, 45);
+    box1 = scene_storage.make<translate>(box1, vec3(-5, -0.75, -8));
     objects.add(box1);
 
 
@@ -379,35 +634,35 @@ hittable_list task5_refraction()
 hittable_list task6_lights()
 {
     hittable_list objects;
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_1 = make_shared<lambertian>(color(0.1, 0.2, 0.5)); //blue
-    auto material_2 = make_shared<lambertian>(color(1, 0.7, 1)); //pink
-    auto material_3 = make_shared<lambertian>(color(1, 0.5, 0)); //orange
-    auto material_4 = make_shared<lambertian>(color(0.9, 0, 0.2)); //redish
-    auto material_metal = make_shared<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
-    auto material_gold = make_shared<metal>(color(0.83, 0.68, 0.21), 0.0); //gold
-    auto material_glass = make_shared<dielectric>(1.52); //glass
+    auto material_ground = scene_storage.make<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_1 = scene_storage.make<lambertian>(color(0.1, 0.2, 0.5)); //blue
+    auto material_2 = scene_storage.make<lambertian>(color(1, 0.7, 1)); //pink
+    auto material_3 = scene_storage.make<lambertian>(color(1, 0.5, 0)); //orange
+    auto material_4 = scene_storage.make<lambertian>(color(0.9, 0, 0.2)); //redish
+    auto material_metal = scene_storage.make<metal>(color(0.4, 0.4, 0.4), 0.0); //metal
+    auto material_gold = scene_storage.make<metal>(color(0.83, 0.68, 0.21), 0.0); //gold
+    auto material_glass = scene_storage.make<dielectric>(1.52); //glass
 
-    objects.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    objects.add(make_shared<sphere>(point3(3.0, 1.0, -10.0), 2, material_gold));
-    //objects.add(make_shared<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_2));
+    objects.add(scene_storage.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    objects.add(scene_storage.make<sphere>(point3(3.0, 1.0, -10.0), 2, material_gold));
+    //objects.add(scene_storage.make<sphere>(point3(-1.5, 0.0, -4.5), 0.5, material_2));
 
-    objects.add(make_shared<sphere>(point3(0.0, 0.5, -5.0), 1, material_metal));
+    objects.add(scene_storage.make<sphere>(point3(0.0, 0.5, -5.0), 1, material_metal));
 
-    //objects.add(make_shared<sphere>(point3(1, -0.25, -4.0), 0.3, material_4));
-    objects.add(make_shared<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
+    //objects.add(scene_storage.make<sphere>(point3(1, -0.25, -4.0), 0.3, material_4));
+    objects.add(scene_storage.make<sphere>(point3(0.0, 2, -5.0), 0.5, material_3));
 
-    objects.add(make_shared<sphere>(point3(2.5, 0.25, -5.0), 0.75, material_glass));
+    objects.add(scene_storage.make<sphere>(point3(2.5, 0.25, -5.0), 0.75, material_glass));
 
-    auto difflight = make_shared<diffuse_light>(color(1, 1, 1));
-    auto difflightpink = make_shared<diffuse_light>(color(1, 0.75, 1));
+    auto difflight = scene_storage.make<diffuse_light>(color(1, 1, 1));
+    auto difflightpink = scene_storage.make<diffuse_light>(color(1, 0.75, 1));
 
-    objects.add(make_shared<sphere>(point3(-1.5, 0.0, -4.5), 0.5, difflight));
-    objects.add(make_shared<sphere>(point3(1, -0.25, -4.0), 0.3, difflightpink));
+    objects.add(scene_storage.make<sphere>(point3(-1.5, 0.0, -4.5), 0.5, difflight));
+    objects.add(scene_storage.make<sphere>(point3(1, -0.25, -4.0), 0.3, difflightpink));
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(2, 2, 2), material_1);
-    box1 = make_shared<rotate_y>(box1, 45);
-    box1 = make_shared<translate>(box1, vec3(-5, -0.75, -8));
+    shared_ptr<hittable> box1 = scene_storage.make<box>(point3(0, 0, 0), point3(2, 2, 2), material_1);
+    box1 = scene_storage.make<rotate_y>(box1, 45);
+    box1 = scene_storage.make<translate>(box1, vec3(-5, -0.75, -8));
     objects.add(box1);
 
 
@@ -417,23 +672,23 @@ hittable_list task6_lights()
 hittable_list task7_get_creative() {
     hittable_list objects;
     int pyramid_base_length =10;
-    double sphere_size = 1;
-    auto checker = make_shared<checker_texture>(color(1, 0.2, 0.2), color(0.9, 0.9, 0.9));
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    real sphere_size = 1;
+    auto checker = scene_storage.make<checker_texture>(color(1, 0.2, 0.2), color(0.9, 0.9, 0.9));
+    objects.add(scene_storage.make<sphere>(point3(0, -1000, 0), 1000, scene_storage.make<lambertian>(checker)));
 
     //box
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+    auto red = scene_storage.make<lambertian>(color(.65, .05, .05));
+    auto white = scene_storage.make<lambertian>(color(.73, .73, .73));
+    auto green = scene_storage.make<lambertian>(color(.12, .45, .15));
+    auto light = scene_storage.make<diffuse_light>(color(15, 15, 15));
 
-    objects.add(make_shared<xz_rect>(-10, 30, -30, 10, 20, white)); //top
-    objects.add(make_shared<xz_rect>(-10, 30, -30, 10, 0, white)); //bottom
+    objects.add(scene_storage.make<xz_rect>(-10, 30, -30, 10, 20, white)); //top
+    objects.add(scene_storage.make<xz_rect>(-10, 30, -30, 10, 0, white)); //bottom
     
-    objects.add(make_shared<xz_rect>(0, 10, -10, 0, 19.8, light)); //light on ceiling
+    objects.add(scene_storage.make<xz_rect>(0, 10, -10, 0, 19.8, light)); //light on ceiling
 
-    objects.add(make_shared<xy_rect>(-10, 30, 0, 20, -30, red)); //left wall
-    objects.add(make_shared<yz_rect>(0, 20, -30, 10, 30, green)); //right wall
+    objects.add(scene_storage.make<xy_rect>(-10, 30, 0, 20, -30, red)); //left wall
+    objects.add(scene_storage.make<yz_rect>(0, 20, -30, 10, 30, green)); //right wall
 
     for (int ix = 0; ix < pyramid_base_length; ix++)
     {
@@ -449,38 +704,332 @@ hittable_list task7_get_creative() {
                 if (choose_mat < 0.25) {
                     // diffuse
                     auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    objects.add(make_shared<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
+                    sphere_material = scene_storage.make<lambertian>(albedo);
+                    objects.add(scene_storage.make<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
                 }
                 else if (choose_mat < 0.65) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    objects.add(make_shared<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
+                    sphere_material = scene_storage.make<metal>(albedo, fuzz);
+                    objects.add(scene_storage.make<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
                 }
                 
                 else if (choose_mat < 0.75) //light
                 {
-                    sphere_material = make_shared<diffuse_light>(vec3((0.1 * (rand() % 10 + 1)), (0.1 * (rand() % 10 + 1)), (0.1 * (rand() % 100 + 1))));
-                    objects.add(make_shared<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
+                    sphere_material = scene_storage.make<diffuse_light>(vec3(0.1 * random_int(1, 10), 0.1 * random_int(1, 10), 0.1 * random_int(1, 100)));
+                    objects.add(scene_storage.make<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
                 }
 
                 else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    objects.add(make_shared<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
+                    sphere_material = scene_storage.make<dielectric>(1.5);
+                    objects.add(scene_storage.make<sphere>(point3(0 + (2 * ix) + iy, sphere_size + iy * sqrt(2), 0 - (2 * iz) - iy), 1, sphere_material));
                 }
             }
             
         }
 
     }
+    return hittable_list(make_bvh(objects, 0.0, 1.0));
+    }
+
+hittable_list instanced_crates(int copies = 4000) {
+    // One small bottom-level BVH placed thousands of times under a top-level BVH.
+    hittable_list crate;
+    auto wood = scene_storage.make<lambertian>(color(0.55, 0.35, 0.20));
+    auto trim = scene_storage.make<metal>(color(0.80, 0.80, 0.85), 0.2);
+    crate.add(scene_storage.make<box>(point3(0, 0, 0), point3(10, 10, 10), wood));
+    crate.add(scene_storage.make<box>(point3(2, 10, 2), point3(8, 16, 8), wood));
+    crate.add(scene_storage.make<sphere>(point3(5, 19, 5), 3, trim));
+    auto blas = scene_storage.make<linear_bvh>(crate, 0, 1, bvh_options);
+
+    hittable_list instances;
+    for (int i = 0; i < copies; i++) {
+        auto size = random_double(0.5, 2.0);
+        auto placement = transform::translate(vec3(random_double(-800, 800), 0, random_double(-800, 800)))
+            * transform::rotate_y(random_double(0, 360))
+            * transform::scale(vec3(size, size, size));
+        instances.add(scene_storage.make<instance>(blas, placement));
+    }
+
+    hittable_list objects;
+    objects.add(scene_storage.make<linear_bvh>(instances, 0, 1, bvh_options));
+
+    auto ground = scene_storage.make<lambertian>(scene_storage.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9)));
+    objects.add(scene_storage.make<sphere>(point3(0, -100000, 0), 100000, ground));
+
+    return objects;
+}
+
+hittable_list swarm(int sphere_count = 2000) {
+    // Spheres that each fly between two unrelated random points over the
+    // shutter, so a tree built for the first frame is a poor fit for the last.
+    hittable_list objects;
+    for (int i = 0; i < sphere_count; i++) {
+        auto start = point3(random_double(-50, 50), random_double(0, 40), random_double(-50, 50));
+        auto end = point3(random_double(-50, 50), random_double(0, 40), random_double(-50, 50));
+        auto albedo = color::random() * color::random();
+        objects.add(scene_storage.make<moving_sphere>(
+            start, end, 0.0, 1.0, random_double(0.5, 1.5), scene_storage.make<lambertian>(albedo)));
+    }
+
+    auto ground = scene_storage.make<lambertian>(scene_storage.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9)));
+    objects.add(scene_storage.make<sphere>(point3(0, -100000, 0), 100000, ground));
+
+    return objects;
+}
+
+// A torus around the Y axis, tessellated into rings x sides quads, with normals
+// and texture coordinates; it stands in for a scanned asset when none is given.
+shared_ptr<triangle_mesh> make_torus_mesh(
+    shared_ptr<material> mat, int rings, int sides, real radius = 1.0, real tube = 0.4
+) {
+    auto mesh = scene_storage.make<triangle_mesh>(mat);
+    for (int i = 0; i <= rings; i++) {
+        auto phi = 2 * pi * i / rings;
+        for (int j = 0; j <= sides; j++) {
+            auto theta = 2 * pi * j / sides;
+            auto n = vec3(cos(phi) * cos(theta), sin(theta), sin(phi) * cos(theta));
+            auto p = point3(radius * cos(phi), 0, radius * sin(phi)) + tube * n;
+            mesh->px.push_back(float(p.x())); mesh->py.push_back(float(p.y())); mesh->pz.push_back(float(p.z()));
+            mesh->nx.push_back(float(n.x())); mesh->ny.push_back(float(n.y())); mesh->nz.push_back(float(n.z()));
+            mesh->tu.push_back(float(real(i) / rings));
+            mesh->tv.push_back(float(real(j) / sides));
+        }
+    }
+
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < sides; j++) {
+            uint32_t a = i * (sides + 1) + j, b = a + sides + 1;
+            mesh->indices.insert(mesh->indices.end(), { a, a + 1, b, b, a + 1, b + 1 });
+        }
+    }
+
+    mesh->build(bvh_options);
+    return mesh;
+}
+
+hittable_list mesh_scene(const std::string& path) {
+    hittable_list objects;
+    auto ground = scene_storage.make<lambertian>(scene_storage.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9)));
+    objects.add(scene_storage.make<sphere>(point3(0, -100000, 0), 100000, ground));
+
+    auto earth = scene_storage.make<lambertian>(scene_storage.make<image_texture>("earthmap.jpg"));
+    auto mesh = path.empty() ? make_torus_mesh(earth, 1024, 512) : load_mesh(path, earth, bvh_options);
+    if (!mesh || mesh->triangle_count() == 0)
+        return objects;
+
+    std::cerr << "Mesh with " << mesh->triangle_count() << " triangles over " << mesh->vertex_count()
+        << " vertices, " << mesh->memory_bytes() / (1024.0 * 1024.0) << " MiB\n";
+    print_build_stats(mesh->tree.build_stats);
+
+    // Scale the mesh to 4 units across and stand it on the ground at the origin.
+    aabb box;
+    mesh->bounding_box(0, 1, box);
+    auto extent = box.max() - box.min();
+    auto size = 4.0 / std::max(extent.x(), std::max(extent.y(), extent.z()));
+    auto base = point3((box.min().x() + box.max().x()) / 2, box.min().y(), (box.min().z() + box.max().z()) / 2);
+    objects.add(scene_storage.make<instance>(mesh,
+        transform::scale(vec3(size, size, size)) * transform::translate(-base)));
+
     return objects;
+}
+
+// Rays per sample of the last render, counted by ray_color().
+void print_path_length(const render_settings& settings, int max_depth) {
+    auto paths = double(settings.image_width) * settings.image_height * settings.samples_per_pixel;
+    std::cerr << "Average path length " << path_segments / paths << " rays of at most " << max_depth;
+    if (roulette_depth > 0)
+        std::cerr << ", Russian roulette after " << roulette_depth << " bounces\n";
+    else
+        std::cerr << ", no Russian roulette\n";
+}
+
+// Cache misses of the last render, in total and per ray traced.
+void print_cache_stats(const cache_counters& counters) {
+    if (!counters.any_available()) {
+        std::cerr << "Cache counters unavailable (no hardware perf events here)\n";
+        return;
     }
 
+    const char* names[] = { "L1D read misses", "LLC references", "LLC misses" };
+    std::cerr << "Cache counters:";
+    for (int e = 0; e < cache_counters::event_count; e++) {
+        auto ev = cache_counters::event(e);
+        std::cerr << ' ' << names[e] << ' ';
+        if (!counters.available(ev))
+            std::cerr << "n/a";
+        else if (path_segments > 0)
+            std::cerr << counters.count(ev) << " (" << double(counters.count(ev)) / path_segments << " per ray)";
+        else
+            std::cerr << counters.count(ev);
+    }
+    std::cerr << '\n';
+}
+
+// Renders frame_count frames that split the [0, 1] shutter between them, so
+// each frame's objects are bounded over its own slice of time only. The BVH is
+// built for the first frame and updated for the rest; a full rebuild is timed
+// next to every update for comparison.
+void render_frames(
+    const hittable_list& world, int frame_count, point3 lookfrom, point3 lookat, vec3 vup,
+    real vfov, real aspect_ratio, real aperture, real dist_to_focus,
+    const color& background, int max_depth, const render_settings& settings
+) {
+    auto animated = scene_storage.make<linear_bvh>(world, 0.0, 1.0 / frame_count, bvh_options);
+    std::cerr << "Animated BVH over " << world.objects.size() << " objects, "
+        << animated->tree.node_count() << " nodes\n";
+    print_build_stats(animated->tree.build_stats);
+
+    for (int f = 0; f < frame_count; f++) {
+        auto time0 = real(f) / frame_count;
+        auto time1 = real(f + 1) / frame_count;
+
+        if (f > 0) {
+            animated->update(time0, time1, bvh_options);
+            linear_bvh rebuilt(world, time0, time1, bvh_options);
+
+            const auto& stats = animated->tree.update_stats;
+            std::cerr << "Frame " << f << ": refit " << stats.refit_seconds * 1000 << " ms, update "
+                << stats.seconds * 1000 << " ms (" << stats.subtrees_rebuilt << " subtree(s), "
+                << stats.primitives_rebuilt << " objects rebuilt), full build "
+                << rebuilt.tree.build_stats.seconds * 1000 << " ms; SAH cost "
+                << animated->tree.sah_cost(bvh_options) << " vs "
+                << rebuilt.tree.sah_cost(bvh_options) << '\n';
+        }
+
+        camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, time0, time1);
+        framebuffer fb(settings.image_width, settings.image_height);
+        path_segments = 0;
+        render(cam, settings, fb, [&](const ray& r) {
+            return ray_color(r, background, *animated, max_depth);
+        });
+        print_path_length(settings, max_depth);
+
+        char name[32];
+        snprintf(name, sizeof(name), "output_%03d.ppm", f);
+        std::ofstream imageFile(name);
+        fb.write_ppm(imageFile, settings.samples_per_pixel);
+    }
+}
+
 int main(int argc, char const* argv[])
 {
+    // Command line: --scene N, --width N, --spp N, --threads N, --tile-size N,
+    // --tile-order scanline|morton|hilbert, --bvh median|sah|linear|wide|motion|sbvh|lazy,
+    // --bvh-bins N, --bvh-leaf-size N, --bvh-threads N, --bvh-rebuild-threshold X,
+    // --motion-segments N, --sbvh-budget X, --bvh-cache DIR, --lazy-subtree-size N,
+    // --sphere-set 0|1, --final-spheres N, --mesh PATH.obj|PATH.ply, --frames N, --ao DIST, --tlas,
+    // --compiled 0|1, --optimize 0|1, --roulette-depth N, --integrator path|wavefront,
+    // --wavefront-batch N, --ray-sort none|octant|morton, --packet-size 0|4|8|16,
+    // --cache-stats 0|1, --reference PATH.ppm
+    auto start_time = std::chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    };
+
+    int scene = 0;
+    int width_override = 0;
+    int spp_override = 0;
+    int final_scene_spheres = 1000;
+    std::string mesh_path;
+    int frame_count = 1;
+    real ao_distance = 0;
+    bool use_tlas = false;
+    bool use_compiled = false;
+    bool optimize_scene = true;
+    bool use_wavefront = false;
+    int wavefront_batch = 1 << 14;
+    int packet_size = ray_packet_max_size;
+    ray_sort wavefront_order = ray_sort::none;
+    bool cache_stats = false;
+    std::string reference_path;
+    render_settings settings;
+
+    for (int a = 1; a < argc; a++) {
+        std::string opt = argv[a];
+        if (opt == "--tlas") {
+            use_tlas = true;
+            continue;
+        }
+
+        if (a + 1 >= argc) {
+            std::cerr << "Missing value for option '" << opt << "'.\n";
+            return 1;
+        }
+        std::string val = argv[++a];
+
+        if (opt == "--scene") scene = std::stoi(val);
+        else if (opt == "--width") width_override = std::stoi(val);
+        else if (opt == "--spp") spp_override = std::stoi(val);
+        else if (opt == "--threads") settings.thread_count = std::stoi(val);
+        else if (opt == "--tile-size") settings.tile_size = std::max(1, std::stoi(val));
+        else if (opt == "--tile-order") {
+            if (val == "scanline") settings.order = tile_order::scanline;
+            else if (val == "morton") settings.order = tile_order::morton;
+            else if (val == "hilbert") settings.order = tile_order::hilbert;
+            else {
+                std::cerr << "Unknown tile order '" << val << "'.\n";
+                return 1;
+            }
+        }
+        else if (opt == "--bvh") {
+            if (val == "median") bvh_builder = bvh_kind::median;
+            else if (val == "sah") bvh_builder = bvh_kind::sah;
+            else if (val == "linear") bvh_builder = bvh_kind::linear;
+            else if (val == "wide") bvh_builder = bvh_kind::wide;
+            else if (val == "motion") bvh_builder = bvh_kind::motion;
+            else if (val == "sbvh") bvh_builder = bvh_kind::sbvh;
+            else if (val == "lazy") bvh_builder = bvh_kind::lazy;
+            else {
+                std::cerr << "Unknown BVH builder '" << val << "'.\n";
+                return 1;
+            }
+        }
+        else if (opt == "--bvh-bins") bvh_options.bin_count = std::max(2, std::stoi(val));
+        else if (opt == "--bvh-leaf-size") bvh_options.max_leaf_size = std::max(1, std::stoi(val));
+        else if (opt == "--bvh-threads") bvh_options.build_threads = std::stoi(val);
+        else if (opt == "--bvh-cache") bvh_cache_dir = val;
+        else if (opt == "--lazy-subtree-size") lazy_subtree_size = std::max(1, std::stoi(val));
+        else if (opt == "--sbvh-budget") sbvh_budget = std::max(0.0, std::stod(val));
+        else if (opt == "--motion-segments") motion_segments = std::max(1, std::stoi(val));
+        else if (opt == "--bvh-rebuild-threshold") bvh_options.rebuild_threshold = std::stod(val);
+        else if (opt == "--ao") ao_distance = std::stod(val);
+        else if (opt == "--frames") frame_count = std::max(1, std::stoi(val));
+        else if (opt == "--mesh") mesh_path = val;
+        else if (opt == "--sphere-set") use_sphere_sets = val != "0";
+        else if (opt == "--compiled") use_compiled = val != "0";
+        else if (opt == "--optimize") optimize_scene = val != "0";
+        else if (opt == "--roulette-depth") roulette_depth = std::max(0, std::stoi(val));
+        else if (opt == "--integrator") {
+            if (val == "path") use_wavefront = false;
+            else if (val == "wavefront") use_wavefront = true;
+            else {
+                std::cerr << "Unknown integrator '" << val << "'.\n";
+                return 1;
+            }
+        }
+        else if (opt == "--wavefront-batch") wavefront_batch = std::max(1, std::stoi(val));
+        else if (opt == "--ray-sort") {
+            if (val == "none") wavefront_order = ray_sort::none;
+            else if (val == "octant") wavefront_order = ray_sort::octant;
+            else if (val == "morton") wavefront_order = ray_sort::morton;
+            else {
+                std::cerr << "Unknown ray sort '" << val << "'.\n";
+                return 1;
+            }
+        }
+        else if (opt == "--cache-stats") cache_stats = val != "0";
+        else if (opt == "--packet-size") packet_size = std::min(std::max(0, std::stoi(val)), ray_packet_max_size);
+        else if (opt == "--reference") reference_path = val;
+        else if (opt == "--final-spheres") final_scene_spheres = std::max(1, std::stoi(val));
+        else {
+            std::cerr << "Unknown option '" << opt << "'.\n";
+            return 1;
+        }
+    }
+
     // Image
     auto aspect_ratio = 16.0 / 9.0;
     int image_width = 600;
@@ -496,7 +1045,8 @@ int main(int argc, char const* argv[])
     color background(0, 0, 0);
     auto dist_to_focus = 10.0;
 
-    switch (0) {
+    defer_scene_bvhs = optimize_scene;
+    switch (scene) {
     case 1:
         world = random_scene();
         background = color(0.70, 0.80, 1.00);
@@ -555,7 +1105,7 @@ int main(int argc, char const* argv[])
         vfov = 40.0;
         break;
     case 8:
-        world = final_scene();
+        world = final_scene(final_scene_spheres);
         aspect_ratio = 1.0;
         image_width = 800;
         samples_per_pixel = 100;
@@ -628,6 +1178,36 @@ int main(int argc, char const* argv[])
         //lookat = point3(0.5, 3.5, -1);
         vfov = 40.0;
         break;
+    case 15:
+        world = instanced_crates();
+        aspect_ratio = 16.0 / 9.0;
+        image_width = 800;
+        samples_per_pixel = 50;
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(0, 250, -1100);
+        lookat = point3(0, 0, 0);
+        vfov = 40.0;
+        break;
+    case 16:
+        world = swarm();
+        aspect_ratio = 16.0 / 9.0;
+        image_width = 600;
+        samples_per_pixel = 20;
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(0, 60, -140);
+        lookat = point3(0, 15, 0);
+        vfov = 40.0;
+        break;
+    case 17:
+        world = mesh_scene(mesh_path);
+        aspect_ratio = 16.0 / 9.0;
+        image_width = 600;
+        samples_per_pixel = 20;
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(0, 5, -9);
+        lookat = point3(0, 1, 0);
+        vfov = 40.0;
+        break;
     default:
     case 14: //Task 7 [Optional]: Lets get creative! (10Pt)  
         world = task7_get_creative();
@@ -642,6 +1222,7 @@ int main(int argc, char const* argv[])
         vfov = 45.0;
         break;
     }
+    defer_scene_bvhs = false;
 
 
     // Camera
@@ -671,64 +1252,156 @@ int main(int argc, char const* argv[])
 
     //material samples
     /*
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_center = make_shared<lambertian>(color(0.1, 0.2, 0.5));
-    auto material_left = make_shared<dielectric>(1.5);
-    auto material_right = make_shared<metal>(color(0.8, 0.6, 0.2), 0.0);
-
-    world.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    world.add(make_shared<sphere>(point3(0.0, 0.0, -1.0), 0.5, material_center));
-    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
-    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), -0.4, material_left));
-    world.add(make_shared<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_right));
+    auto material_ground = scene_storage.make<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_center = scene_storage.make<lambertian>(color(0.1, 0.2, 0.5));
+    auto material_left = scene_storage.make<dielectric>(1.5);
+    auto material_right = scene_storage.make<metal>(color(0.8, 0.6, 0.2), 0.0);
+
+    world.add(scene_storage.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    world.add(scene_storage.make<sphere>(point3(0.0, 0.0, -1.0), 0.5, material_center));
+    world.add(scene_storage.make<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
+    world.add(scene_storage.make<sphere>(point3(-1.0, 0.0, -1.0), -0.4, material_left));
+    world.add(scene_storage.make<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_right));
     */
 
 
+    if (optimize_scene) {
+        auto before = summarize_scene(world);
+        scene_optimizer optimizer(scene_storage, [](const hittable_list& objects) {
+            return make_bvh(objects, 0.0, 1.0);
+        });
+        world = optimizer.optimize(world);
+
+        // One BVH over everything the pass flattened; the TLAS and the animated
+        // path build their own.
+        if (!use_tlas && frame_count <= 1)
+            world = optimizer.accelerate(world);
+
+        auto after = summarize_scene(world);
+        auto print_summary = [](const char* label, const scene_summary& s) {
+            std::cerr << label << s.objects() << " objects (" << s.primitives << " primitives, "
+                << s.wrappers << " wrappers, " << s.aggregates << " lists and BVHs), "
+                << s.materials << " materials, " << s.textures << " textures, "
+                << s.bytes / 1024 << " KiB\n";
+        };
+        print_summary("Scene before optimizing: ", before);
+        print_summary("Scene after optimizing:  ", after);
+        std::cerr << "Optimizer baked " << optimizer.baked << " primitives into world space, collapsed "
+            << optimizer.collapsed << " transform chains, merged " << optimizer.materials_merged
+            << " materials\n";
+    }
+
+    if (use_tlas) {
+        // Collapse wrapper chains into instances and put a BVH over the top level.
+        auto tlas = make_tlas(world, 0.0, 1.0, bvh_options);
+        std::cerr << "TLAS over " << world.objects.size() << " top-level objects, "
+            << tlas->tree.node_count() << " nodes\n";
+        world = hittable_list(tlas);
+    }
+
+    // Animations update the object BVH per frame, so they render from world.
+    std::unique_ptr<compiled_scene> compiled;
+    if (use_compiled && frame_count <= 1) {
+        compiled.reset(new compiled_scene(world, 0.0, 1.0, bvh_options));
+        std::cerr << "Compiled scene: " << compiled->compiled_count() << " of "
+            << compiled->primitives.size() << " primitives inlined, " << compiled->materials.size()
+            << " materials, " << compiled->textures.size() << " textures\n";
+        print_build_stats(compiled->tree.build_stats);
+    }
+
+    if (width_override > 0) image_width = width_override;
+    if (spp_override > 0) samples_per_pixel = spp_override;
+
     //setting up file
     int image_height = static_cast<int>(image_width / aspect_ratio);
-    std::ofstream imageFile("output.ppm");
-    imageFile << "P3\n" << image_width << " " << image_height << "\n255\n";
-    
+
     // main loop & renderer
-    for (int j = image_height - 1; j >= 0; --j)
-    {
-        std::cerr << "\rPicture Progress: " << (int)(((image_height - j) / (float)image_height) * 100) << '%' << std::flush;
-        for (int i = 0; i < image_width; ++i)
-        {
-            color pixel_color(0, 0, 0);
-            
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width - 1);
-                auto v = (j + random_double()) / (image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, background, world, max_depth);
-            }
-            
-            
-            // antialiasing grid
-            /*
-                auto scaling = 1.0 / samples_per_pixel;
+    settings.image_width = image_width;
+    settings.image_height = image_height;
+    settings.samples_per_pixel = samples_per_pixel;
+
+    std::cerr << "Scene arena holds " << scene_storage.object_count() << " objects in "
+        << scene_storage.bytes_used() / 1024 << " KiB (" << scene_storage.bytes_reserved() / 1024
+        << " KiB reserved)\n";
+
+    if (frame_count > 1) {
+        render_frames(world, frame_count, lookfrom, lookat, vup, vfov, aspect_ratio, aperture,
+            dist_to_focus, background, max_depth, settings);
+        return 0;
+    }
 
-                for (double sx = 0; sx <= 1; sx = sx + scaling)
-                {
-                    for (double sy = 0; sy <= 1; sy = sy + scaling)
-                    {
-                        auto u = ((i + sx) / (image_width - 1));
-                        auto v = ((j + sy) / (image_height - 1));
-                        ray r = cam.get_ray(u, v);
-                        pixel_color += ray_color(r, background, world, max_depth);
-
-                    }
-                }
-            
-            */
+    std::ofstream imageFile("output.ppm");
 
-            //for random sample antializing 
-            write_color(imageFile, pixel_color, samples_per_pixel);
-            //for grid sample antializing
-            //write_color(imageFile, pixel_color, pow(samples_per_pixel,2));
-        }
+    framebuffer fb(image_width, image_height);
+    auto setup_seconds = elapsed();
+    render_stats stats;
+    std::unique_ptr<cache_counters> counters;
+    if (cache_stats) {
+        counters.reset(new cache_counters());
+        counters->start();
     }
+    if (use_wavefront && ao_distance <= 0) {
+        // Batches of paths through the hittable world; the compiled scene is
+        // the other answer to virtual dispatch and is not used here.
+        wavefront_integrator wavefront(world, background, max_depth, roulette_depth);
+        wavefront.batch_size = wavefront_batch;
+        wavefront.order = wavefront_order;
+        stats = wavefront.render(cam, settings, fb);
+        path_segments = wavefront.segments.load();
+
+        const char* names[] = { "generate", "reorder", "extend", "sort", "shade", "compact" };
+        std::cerr << "Wavefront stages:";
+        for (int s = 0; s < wavefront_integrator::stage_count; s++)
+            std::cerr << ' ' << names[s] << ' ' << wavefront.stage_seconds[s] << " s";
+        std::cerr << '\n';
+    }
+    else if (packet_size > 1 && aperture == 0 && ao_distance <= 0 && !compiled) {
+        // A pinhole camera's rays share their origin, so they can go as packets.
+        stats = render_packets(cam, settings, fb, packet_size,
+            [&](const ray* rays, const uint64_t* keys, int count, color* radiance) {
+                trace_camera_packet(rays, keys, count, radiance, background, world, max_depth);
+            });
+    }
+    else {
+        stats = render(cam, settings, fb, [&](const ray& r) {
+            if (ao_distance > 0)
+                return ambient_occlusion(r, compiled ? *compiled : static_cast<const hittable&>(world), ao_distance);
+            if (compiled)
+                return ray_color(r, background, *compiled, max_depth);
+            return ray_color(r, background, world, max_depth);
+        });
+    }
+    if (counters)
+        counters->stop();
+
+    // Everything before the first tile is time the user waits for a picture.
+    std::cerr << "Scene ready after " << setup_seconds << " s, first tile after "
+        << setup_seconds + stats.first_tile_seconds << " s, image after "
+        << setup_seconds + stats.seconds << " s\n";
+    if (ao_distance <= 0)
+        print_path_length(settings, max_depth);
+    if (counters)
+        print_cache_stats(*counters);
+    for (const auto& bvh : lazy_bvhs) {
+        std::cerr << "Lazy BVH built " << bvh->subtrees_built() << " of " << bvh->subtree_count()
+            << " subtrees on demand in " << bvh->lazy_seconds() << " s (eager top "
+            << bvh->build_stats.seconds << " s)\n";
+    }
+
+    fb.write_ppm(imageFile, samples_per_pixel);
     imageFile.close();
+
+    // Error against another render, e.g. of a double build when this is a
+    // float one (built with RT_FLOAT).
+    if (!reference_path.empty()) {
+        image_difference diff;
+        if (!compare_ppm("output.ppm", reference_path, diff)) {
+            std::cerr << "Cannot compare with '" << reference_path << "'.\n";
+            return 1;
+        }
+        std::cerr << "Image (" << (sizeof(real) == sizeof(float) ? "float" : "double")
+            << ") against " << reference_path << ": rmse " << diff.rmse << ", max " << diff.max
+            << ", " << diff.differing << " of " << diff.values << " values differ\n";
+    }
     return 0;
 }
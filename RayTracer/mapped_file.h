@@ -0,0 +1,92 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped read-only into memory, unmapped when the last owner goes.
+class mapped_file {
+public:
+    static std::shared_ptr<mapped_file> open(const std::string& path) {
+        std::shared_ptr<mapped_file> file(new mapped_file());
+#ifdef _WIN32
+        file->handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file->handle == INVALID_HANDLE_VALUE)
+            return nullptr;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file->handle, &size) || size.QuadPart == 0)
+            return nullptr;
+        file->length = static_cast<size_t>(size.QuadPart);
+
+        file->mapping = CreateFileMappingA(file->handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!file->mapping)
+            return nullptr;
+
+        file->base = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!file->base)
+            return nullptr;
+#else
+        file->fd = ::open(path.c_str(), O_RDONLY);
+        if (file->fd < 0)
+            return nullptr;
+
+        struct stat st;
+        if (fstat(file->fd, &st) != 0 || st.st_size == 0)
+            return nullptr;
+        file->length = static_cast<size_t>(st.st_size);
+
+        void* base = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (base == MAP_FAILED)
+            return nullptr;
+        file->base = base;
+#endif
+        return file;
+    }
+
+    ~mapped_file() {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+#else
+        if (base) munmap(base, length);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(base); }
+    size_t size() const { return length; }
+
+private:
+    mapped_file() {}
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    void* base = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+#endif
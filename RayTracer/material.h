@@ -8,7 +8,7 @@ struct hit_record;
 
 class material {
 public:
-    virtual color emitted(double u, double v, const point3& p) const {
+    virtual color emitted(real u, real v, const point3& p) const {
         return color(0, 0, 0);
     }
 
@@ -25,15 +25,20 @@ public:
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override {
+        scattered = scatter_ray(r_in, rec);
+        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        return true;
+    }
+
+    // The scattered ray alone, for callers that look the albedo up themselves.
+    static ray scatter_ray(const ray& r_in, const hit_record& rec) {
         auto scatter_direction = rec.normal + random_unit_vector();
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
-        scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
-        return true;
+        return ray(rec.spawn_point(scatter_direction), scatter_direction, r_in.time());
     }
 
 public:
@@ -42,37 +47,38 @@ public:
 
 class metal : public material {
 public:
-    metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    metal(const color& a, real f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+        vec3 direction = reflected + fuzz * random_in_unit_sphere();
+        scattered = ray(rec.spawn_point(direction), direction, r_in.time());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
 public:
     color albedo;
-    double fuzz;
+    real fuzz;
 };
 
 class dielectric : public material {
 public:
-    dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    dielectric(real index_of_refraction) : ir(index_of_refraction) {}
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override {
         attenuation = color(1.0, 1.0, 1.0);
-        double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+        real refraction_ratio = rec.front_face ? (1 / ir) : ir;
 
         vec3 unit_direction = unit_vector(r_in.direction());
-        double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-        double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+        real cos_theta = fmin(dot(-unit_direction, rec.normal), real(1));
+        real sin_theta = sqrt(1 - cos_theta * cos_theta);
 
-        bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+        bool cannot_refract = refraction_ratio * sin_theta > 1;
         vec3 direction;
 
         if (cannot_refract)
@@ -80,15 +86,15 @@ public:
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-        scattered = ray(rec.p, direction, r_in.time());
+        scattered = ray(rec.spawn_point(direction), direction, r_in.time());
         return true;
     }
 
 public:
-    double ir; // Index of Refraction
+    real ir; // Index of Refraction
 
 private:
-    static double reflectance(double cosine, double ref_idx) {
+    static real reflectance(real cosine, real ref_idx) {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1 - ref_idx) / (1 + ref_idx);
         r0 = r0 * r0;
@@ -107,7 +113,7 @@ public:
         return false;
     }
 
-    virtual color emitted(double u, double v, const point3& p) const override {
+    virtual color emitted(real u, real v, const point3& p) const override {
         return emit->value(u, v, p);
     }
 
@@ -123,11 +129,16 @@ public:
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override {
-        scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
+        scattered = scatter_ray(r_in, rec);
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    // The scattered ray alone, for callers that look the albedo up themselves.
+    static ray scatter_ray(const ray& r_in, const hit_record& rec) {
+        return ray(rec.p, random_in_unit_sphere(), r_in.time());
+    }
+
 public:
     shared_ptr<texture> albedo;
 };
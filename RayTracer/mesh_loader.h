@@ -0,0 +1,539 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "rtweekend.h"
+
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Loaders for Wavefront OBJ and binary PLY meshes. Files are memory mapped and
+// parsed in place straight into a triangle_mesh's buffers, so a mesh of many
+// millions of triangles costs its final arrays plus the BVH build, not a
+// string or object per line or triangle. On failure a loader reports why on
+// std::cerr and returns nullptr.
+
+// A cursor over mapped text that never reads past end.
+struct text_cursor {
+    const char* p;
+    const char* end;
+
+    bool done() const { return p >= end; }
+
+    void skip_spaces() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+    }
+
+    void skip_line() {
+        while (p < end && *p != '\n')
+            p++;
+        if (p < end)
+            p++;
+    }
+
+    bool at_line_end() {
+        skip_spaces();
+        return p >= end || *p == '\n' || *p == '#';
+    }
+
+    // Reads a decimal number such as -1.5e3. Returns false if there is none.
+    bool read_float(float& out) {
+        skip_spaces();
+        const char* start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        double value = 0;
+        int digits = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            value = value * 10 + (*p++ - '0');
+            digits++;
+        }
+        int exponent = 0;
+        if (p < end && *p == '.') {
+            p++;
+            while (p < end && *p >= '0' && *p <= '9') {
+                value = value * 10 + (*p++ - '0');
+                exponent--;
+                digits++;
+            }
+        }
+        if (digits == 0) {
+            p = start;
+            return false;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            int sign = 1, e = 0;
+            if (p < end && (*p == '-' || *p == '+'))
+                sign = (*p++ == '-') ? -1 : 1;
+            while (p < end && *p >= '0' && *p <= '9')
+                e = e * 10 + (*p++ - '0');
+            exponent += sign * e;
+        }
+
+        if (exponent != 0)
+            value *= pow(10.0, exponent);
+        out = static_cast<float>(negative ? -value : value);
+        return true;
+    }
+
+    bool read_int(long long& out) {
+        skip_spaces();
+        const char* start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+        long long value = 0;
+        while (p < end && *p >= '0' && *p <= '9')
+            value = value * 10 + (*p++ - '0');
+        if (p == start || (p == start + 1 && (*start == '-' || *start == '+'))) {
+            p = start;
+            return false;
+        }
+        out = negative ? -value : value;
+        return true;
+    }
+
+    // The next whitespace-delimited word on this line.
+    std::string read_word() {
+        skip_spaces();
+        const char* start = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            p++;
+        return std::string(start, p);
+    }
+};
+
+// Loads the v, vt, vn and f records of an OBJ file as one mesh; polygons are
+// split into fans. Materials, groups and everything else are ignored. When the
+// faces refer to positions only, the positions become the mesh's vertices as
+// they are; otherwise each distinct position/uv/normal triple becomes a vertex.
+shared_ptr<triangle_mesh> load_obj(
+    const std::string& path, shared_ptr<material> mat,
+    const bvh_build_options& options = bvh_build_options())
+{
+    auto file = mapped_file::open(path);
+    if (!file) {
+        std::cerr << "Could not open mesh '" << path << "'.\n";
+        return nullptr;
+    }
+    const char* begin = reinterpret_cast<const char*>(file->data());
+    const char* end = begin + file->size();
+
+    // First pass: count records, so every buffer is allocated once.
+    size_t positions = 0, uvs = 0, normals = 0, corners = 0;
+    bool face_attributes = false;
+    for (text_cursor c{ begin, end }; !c.done(); c.skip_line()) {
+        c.skip_spaces();
+        if (c.end - c.p < 2)
+            continue;
+        if (c.p[0] == 'v' && (c.p[1] == ' ' || c.p[1] == '\t'))
+            positions++;
+        else if (c.p[0] == 'v' && c.p[1] == 't')
+            uvs++;
+        else if (c.p[0] == 'v' && c.p[1] == 'n')
+            normals++;
+        else if (c.p[0] == 'f' && (c.p[1] == ' ' || c.p[1] == '\t')) {
+            for (const char* q = c.p; q < end && *q != '\n'; q++) {
+                if (*q == '/')
+                    face_attributes = true;
+                else if (*q == ' ' && q + 1 < end && q[1] != ' ' && q[1] != '\r' && q[1] != '\n')
+                    corners++;
+            }
+        }
+    }
+
+    auto mesh = make_shared<triangle_mesh>(mat);
+    std::vector<float> obj_uv[2], obj_n[3];
+    if (face_attributes) {
+        mesh->px.reserve(corners); mesh->py.reserve(corners); mesh->pz.reserve(corners);
+        obj_uv[0].reserve(uvs); obj_uv[1].reserve(uvs);
+        for (auto& a : obj_n) a.reserve(normals);
+    }
+    mesh->indices.reserve(3 * corners);
+    std::vector<float> obj_p[3];
+    for (auto& a : obj_p) a.reserve(positions);
+
+    // OBJ indices count from 1, or back from the latest record when negative.
+    auto resolve = [](long long i, size_t count) -> long long {
+        return (i > 0) ? i - 1 : static_cast<long long>(count) + i;
+    };
+    auto in_range = [](long long i, size_t count) {
+        return i >= 0 && i < static_cast<long long>(count);
+    };
+
+    struct corner_key {
+        long long p, t, n;
+        bool operator==(const corner_key& o) const { return p == o.p && t == o.t && n == o.n; }
+    };
+    struct corner_hash {
+        size_t operator()(const corner_key& k) const {
+            return static_cast<size_t>(hash_mix(uint64_t(k.p) ^ hash_mix(uint64_t(k.t) ^ hash_mix(uint64_t(k.n)))));
+        }
+    };
+    std::unordered_map<corner_key, uint32_t, corner_hash> vertex_of;
+
+    size_t line = 0;
+    for (text_cursor c{ begin, end }; !c.done(); c.skip_line()) {
+        line++;
+        c.skip_spaces();
+        if (c.end - c.p < 2 || c.p[0] == '#')
+            continue;
+
+        if (c.p[0] == 'v') {
+            int kind = (c.p[1] == 't') ? 1 : (c.p[1] == 'n') ? 2 : (c.p[1] == ' ' || c.p[1] == '\t') ? 0 : -1;
+            if (kind < 0)
+                continue;
+            c.p += (kind == 0) ? 1 : 2;
+            float x[3] = { 0, 0, 0 };
+            int n = (kind == 1) ? 2 : 3;
+            for (int k = 0; k < n; k++) {
+                if (!c.read_float(x[k])) {
+                    std::cerr << path << ":" << line << ": malformed vertex record.\n";
+                    return nullptr;
+                }
+            }
+            std::vector<float>* dst = (kind == 0) ? obj_p : (kind == 1) ? obj_uv : obj_n;
+            for (int k = 0; k < n; k++)
+                dst[k].push_back(x[k]);
+        }
+        else if (c.p[0] == 'f' && (c.p[1] == ' ' || c.p[1] == '\t')) {
+            c.p++;
+            uint32_t first = 0, previous = 0;
+            int count = 0;
+            while (!c.at_line_end()) {
+                long long p = 0, t = 0, n = 0;
+                bool ok = c.read_int(p);
+                if (ok && c.p < c.end && *c.p == '/') {
+                    c.p++;
+                    if (c.p < c.end && *c.p != '/')
+                        ok = c.read_int(t);
+                    if (ok && c.p < c.end && *c.p == '/') {
+                        c.p++;
+                        ok = c.read_int(n);
+                    }
+                }
+
+                // A uv or normal index of 0 means the corner has none; any
+                // other must name a record, like the position index.
+                bool has_t = t != 0, has_n = n != 0;
+                p = ok ? resolve(p, obj_p[0].size()) : -1;
+                t = has_t ? resolve(t, obj_uv[0].size()) : -1;
+                n = has_n ? resolve(n, obj_n[0].size()) : -1;
+                if (!in_range(p, obj_p[0].size()) || (has_t && !in_range(t, obj_uv[0].size()))
+                    || (has_n && !in_range(n, obj_n[0].size()))) {
+                    std::cerr << path << ":" << line << ": bad face index.\n";
+                    return nullptr;
+                }
+
+                uint32_t vertex = static_cast<uint32_t>(p);
+                if (face_attributes) {
+                    auto inserted = vertex_of.emplace(corner_key{ p, t, n }, uint32_t(mesh->px.size()));
+                    vertex = inserted.first->second;
+                    if (inserted.second) {
+                        mesh->px.push_back(obj_p[0][p]);
+                        mesh->py.push_back(obj_p[1][p]);
+                        mesh->pz.push_back(obj_p[2][p]);
+                        if (uvs > 0) {
+                            mesh->tu.push_back(t >= 0 ? obj_uv[0][t] : 0.0f);
+                            mesh->tv.push_back(t >= 0 ? obj_uv[1][t] : 0.0f);
+                        }
+                        if (normals > 0) {
+                            mesh->nx.push_back(n >= 0 ? obj_n[0][n] : 0.0f);
+                            mesh->ny.push_back(n >= 0 ? obj_n[1][n] : 0.0f);
+                            mesh->nz.push_back(n >= 0 ? obj_n[2][n] : 0.0f);
+                        }
+                    }
+                }
+
+                if (count == 0)
+                    first = vertex;
+                if (count >= 2) {
+                    mesh->indices.push_back(first);
+                    mesh->indices.push_back(previous);
+                    mesh->indices.push_back(vertex);
+                }
+                previous = vertex;
+                count++;
+            }
+        }
+    }
+
+    if (!face_attributes) {
+        mesh->px = std::move(obj_p[0]);
+        mesh->py = std::move(obj_p[1]);
+        mesh->pz = std::move(obj_p[2]);
+    }
+    else {
+        // The first pass could only bound the vertex count by the corner count.
+        for (auto* a : { &mesh->px, &mesh->py, &mesh->pz, &mesh->nx, &mesh->ny, &mesh->nz, &mesh->tu, &mesh->tv })
+            a->shrink_to_fit();
+    }
+    mesh->build(options);
+    return mesh;
+}
+
+// Loads the vertex and face elements of a binary PLY file (either byte order).
+// Vertices may carry nx/ny/nz and u/v (or s/t) besides x/y/z; faces are lists
+// of vertex indices and are split into fans. Other elements and properties are
+// skipped.
+shared_ptr<triangle_mesh> load_ply(
+    const std::string& path, shared_ptr<material> mat,
+    const bvh_build_options& options = bvh_build_options())
+{
+    auto file = mapped_file::open(path);
+    if (!file) {
+        std::cerr << "Could not open mesh '" << path << "'.\n";
+        return nullptr;
+    }
+    const char* begin = reinterpret_cast<const char*>(file->data());
+    const char* end = begin + file->size();
+
+    struct property {
+        std::string name;
+        int size = 0;             // bytes of the value, or of each list item
+        char kind = 'f';          // 'i' signed, 'u' unsigned, 'f' floating
+        int count_size = 0;       // list length bytes; 0 if not a list
+    };
+    struct element {
+        std::string name;
+        size_t count = 0;
+        std::vector<property> properties;
+    };
+
+    auto type_of = [](const std::string& t, int& size, char& kind) {
+        if (t == "char" || t == "int8") { size = 1; kind = 'i'; }
+        else if (t == "uchar" || t == "uint8") { size = 1; kind = 'u'; }
+        else if (t == "short" || t == "int16") { size = 2; kind = 'i'; }
+        else if (t == "ushort" || t == "uint16") { size = 2; kind = 'u'; }
+        else if (t == "int" || t == "int32") { size = 4; kind = 'i'; }
+        else if (t == "uint" || t == "uint32") { size = 4; kind = 'u'; }
+        else if (t == "float" || t == "float32") { size = 4; kind = 'f'; }
+        else if (t == "double" || t == "float64") { size = 8; kind = 'f'; }
+        else return false;
+        return true;
+    };
+
+    // Header: text lines up to end_header.
+    text_cursor c{ begin, end };
+    if (c.read_word() != "ply") {
+        std::cerr << "'" << path << "' is not a PLY file.\n";
+        return nullptr;
+    }
+    c.skip_line();
+
+    bool swap_bytes = false;
+    std::vector<element> elements;
+    while (true) {
+        if (c.done()) {
+            std::cerr << "'" << path << "' has no end_header.\n";
+            return nullptr;
+        }
+        auto word = c.read_word();
+        if (word == "format") {
+            auto format = c.read_word();
+            uint16_t probe = 1;
+            bool little = *reinterpret_cast<uint8_t*>(&probe) == 1;
+            if (format == "binary_little_endian") swap_bytes = !little;
+            else if (format == "binary_big_endian") swap_bytes = little;
+            else {
+                std::cerr << "'" << path << "' is " << format << "; only binary PLY is supported.\n";
+                return nullptr;
+            }
+        }
+        else if (word == "element") {
+            element e;
+            e.name = c.read_word();
+            long long count = 0;
+            c.read_int(count);
+            e.count = static_cast<size_t>(std::max(0LL, count));
+            elements.push_back(e);
+        }
+        else if (word == "property" && !elements.empty()) {
+            property p;
+            auto type = c.read_word();
+            bool ok = true;
+            if (type == "list") {
+                char count_kind;
+                ok = type_of(c.read_word(), p.count_size, count_kind) && count_kind != 'f';
+                type = c.read_word();
+            }
+            ok = ok && type_of(type, p.size, p.kind);
+            if (!ok) {
+                std::cerr << "'" << path << "' has a property of unknown type.\n";
+                return nullptr;
+            }
+            p.name = c.read_word();
+            elements.back().properties.push_back(p);
+        }
+        else if (word == "end_header") {
+            c.skip_line();
+            break;
+        }
+        c.skip_line();
+    }
+
+    const char* p = c.p;
+    auto read = [&](int size, char kind) -> double {
+        unsigned char bytes[8];
+        std::memcpy(bytes, p, size);
+        if (swap_bytes)
+            std::reverse(bytes, bytes + size);
+        p += size;
+        switch (size) {
+        case 1: return (kind == 'i') ? double(int8_t(bytes[0])) : double(bytes[0]);
+        case 2: { uint16_t v; std::memcpy(&v, bytes, 2); return (kind == 'i') ? double(int16_t(v)) : double(v); }
+        case 4: {
+            if (kind == 'f') { float f; std::memcpy(&f, bytes, 4); return f; }
+            uint32_t v; std::memcpy(&v, bytes, 4);
+            return (kind == 'i') ? double(int32_t(v)) : double(v);
+        }
+        default: { double d; std::memcpy(&d, bytes, 8); return d; }
+        }
+    };
+    auto truncated = [&]() {
+        std::cerr << "'" << path << "' is truncated.\n";
+        return nullptr;
+    };
+
+    auto mesh = make_shared<triangle_mesh>(mat);
+    for (const auto& e : elements) {
+        // Bytes per row when no property is a list; 0 otherwise.
+        size_t row_size = 0;
+        for (const auto& prop : e.properties) {
+            if (prop.count_size) { row_size = 0; break; }
+            row_size += prop.size;
+        }
+
+        if (e.name == "vertex") {
+            // Where each wanted attribute comes from: property number or -1.
+            const char* names[8] = { "x", "y", "z", "nx", "ny", "nz", "u", "v" };
+            int source[8];
+            for (int k = 0; k < 8; k++) {
+                source[k] = -1;
+                for (size_t i = 0; i < e.properties.size(); i++) {
+                    const auto& n = e.properties[i].name;
+                    if (n == names[k] || (k == 6 && (n == "s" || n == "texture_u"))
+                        || (k == 7 && (n == "t" || n == "texture_v")))
+                        source[k] = static_cast<int>(i);
+                }
+            }
+            if (source[0] < 0 || source[1] < 0 || source[2] < 0 || row_size == 0) {
+                std::cerr << "'" << path << "' has no plain x/y/z vertex positions.\n";
+                return nullptr;
+            }
+            if (size_t(end - p) / row_size < e.count)
+                return truncated();
+
+            bool normals = source[3] >= 0 && source[4] >= 0 && source[5] >= 0;
+            bool uvs = source[6] >= 0 && source[7] >= 0;
+            std::vector<float>* targets[8] = { &mesh->px, &mesh->py, &mesh->pz,
+                &mesh->nx, &mesh->ny, &mesh->nz, &mesh->tu, &mesh->tv };
+            for (int k = 0; k < 8; k++)
+                if (k < 3 || (k < 6 && normals) || (k >= 6 && uvs))
+                    targets[k]->resize(e.count);
+
+            double value[64];
+            for (size_t v = 0; v < e.count; v++) {
+                for (size_t i = 0; i < e.properties.size(); i++) {
+                    double x = read(e.properties[i].size, e.properties[i].kind);
+                    if (i < 64)
+                        value[i] = x;
+                }
+                for (int k = 0; k < 8; k++)
+                    if (!targets[k]->empty() && source[k] < 64)
+                        (*targets[k])[v] = static_cast<float>(value[source[k]]);
+            }
+        }
+        else if (e.name == "face") {
+            mesh->indices.reserve(3 * e.count);
+            for (size_t f = 0; f < e.count; f++) {
+                for (const auto& prop : e.properties) {
+                    if (!prop.count_size) {
+                        if (end - p < prop.size)
+                            return truncated();
+                        p += prop.size;
+                        continue;
+                    }
+                    if (end - p < prop.count_size)
+                        return truncated();
+                    auto n = static_cast<size_t>(read(prop.count_size, 'u'));
+                    if (size_t(end - p) / prop.size < n)
+                        return truncated();
+
+                    bool is_indices = prop.name == "vertex_indices" || prop.name == "vertex_index";
+                    uint32_t first = 0, previous = 0;
+                    for (size_t k = 0; k < n; k++) {
+                        auto index = read(prop.size, prop.kind);
+                        if (!is_indices)
+                            continue;
+                        // Signed and float index types can hold what no vertex
+                        // number is; check before converting.
+                        if (!(index >= 0 && index < double(mesh->px.size())) || index != std::floor(index)) {
+                            std::cerr << "'" << path << "' has a face index out of range.\n";
+                            return nullptr;
+                        }
+                        auto vertex = static_cast<uint32_t>(index);
+                        if (k == 0)
+                            first = vertex;
+                        if (k >= 2) {
+                            mesh->indices.push_back(first);
+                            mesh->indices.push_back(previous);
+                            mesh->indices.push_back(vertex);
+                        }
+                        previous = vertex;
+                    }
+                }
+            }
+        }
+        else {
+            for (size_t row = 0; row < e.count; row++) {
+                for (const auto& prop : e.properties) {
+                    size_t n = 1;
+                    if (prop.count_size) {
+                        if (end - p < prop.count_size)
+                            return truncated();
+                        n = static_cast<size_t>(read(prop.count_size, 'u'));
+                    }
+                    if (size_t(end - p) / prop.size < n)
+                        return truncated();
+                    p += n * prop.size;
+                }
+            }
+        }
+    }
+
+    mesh->build(options);
+    return mesh;
+}
+
+// Picks the loader by file extension.
+shared_ptr<triangle_mesh> load_mesh(
+    const std::string& path, shared_ptr<material> mat,
+    const bvh_build_options& options = bvh_build_options())
+{
+    auto dot = path.find_last_of('.');
+    std::string ext = (dot == std::string::npos) ? "" : path.substr(dot + 1);
+    for (auto& ch : ext)
+        ch = static_cast<char>(tolower(ch));
+
+    if (ext == "obj")
+        return load_obj(path, mat, options);
+    if (ext == "ply")
+        return load_ply(path, mat, options);
+
+    std::cerr << "Unknown mesh format '" << path << "'.\n";
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+#include <vector>
+
+// One node of a motion BVH: its bounds when its time segment opens and when it
+// closes. Links, counts and axes are those of the linear_bvh_node with the same
+// index in the tree the node was built from.
+struct motion_bvh_node {
+    float bounds[2][2][3];  // [time: open, close][min, max corner][axis]
+    uint32_t offset;
+    uint16_t count;
+    uint8_t axis;
+    uint8_t pad;
+
+    bool is_leaf() const { return count > 0; }
+
+    // Slab test against the node's bounds at time weight w in [0, 1].
+    bool hit(const bvh_ray& r, real w, real t_min, real t_max) const {
+        for (int a = 0; a < 3; a++) {
+            int near = r.dir_is_neg[a];
+            auto lo = bounds[0][near][a] + w * (bounds[1][near][a] - bounds[0][near][a]);
+            auto hi = bounds[0][1 - near][a] + w * (bounds[1][1 - near][a] - bounds[0][1 - near][a]);
+            auto t0 = (lo - r.origin[a]) * r.inv_dir[a];
+            auto t1 = (hi - r.origin[a]) * r.inv_dir[a];
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+                return false;
+        }
+        return true;
+    }
+};
+
+// A BVH over one time segment [time0, time1]. The topology is an ordinary SAH
+// tree over the bounds swept across the segment; each node then keeps its
+// bounds at both ends, and a ray is tested against their interpolation at its
+// own time. That is exact for objects moving linearly within the segment, as
+// moving_sphere does: the interpolated union contains the union of the
+// interpolated boxes.
+class motion_bvh_tree {
+public:
+    void build(
+        const std::vector<shared_ptr<hittable>>& objects, real t0, real t1,
+        const bvh_build_options& options
+    ) {
+        time0 = t0;
+        time1 = t1;
+
+        linear_bvh_tree swept;
+        auto refs = make_primitive_refs(objects, time0, time1);
+        swept.build(refs, options);
+        build_stats = swept.build_stats;
+
+        auto open = make_primitive_refs(objects, time0, time0);
+        auto close = make_primitive_refs(objects, time1, time1);
+
+        nodes.resize(swept.nodes.size());
+        indices = swept.indices;
+
+        // Children follow their parent, so a backwards sweep sees them first.
+        for (size_t i = nodes.size(); i-- > 0;) {
+            const auto& from = swept.nodes[i];
+            auto& n = nodes[i];
+            n.offset = from.offset;
+            n.count = from.count;
+            n.axis = from.axis;
+            n.pad = 0;
+
+            aabb box[2] = { aabb::empty(), aabb::empty() };
+            if (n.is_leaf()) {
+                for (uint32_t k = 0; k < n.count; k++) {
+                    box[0].expand(open[indices[n.offset + k]].box);
+                    box[1].expand(close[indices[n.offset + k]].box);
+                }
+            }
+            else {
+                for (int t = 0; t < 2; t++) {
+                    box[t] = node_box(nodes[i + 1], t);
+                    box[t].expand(node_box(nodes[n.offset], t));
+                }
+            }
+
+            for (int t = 0; t < 2; t++) {
+                for (int a = 0; a < 3; a++) {
+                    n.bounds[t][0][a] = float_round_down(box[t].min()[a]);
+                    n.bounds[t][1][a] = float_round_up(box[t].max()[a]);
+                }
+            }
+        }
+    }
+
+    size_t memory_bytes() const {
+        return nodes.capacity() * sizeof(motion_bvh_node) + indices.capacity() * sizeof(uint32_t);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Everything the tree can reach over its whole segment.
+    aabb bounds() const {
+        if (nodes.empty())
+            return aabb();
+        auto box = node_box(nodes[0], 0);
+        box.expand(node_box(nodes[0], 1));
+        return box;
+    }
+
+    // Same contract as linear_bvh_tree::traverse(), with boxes taken at r.time().
+    template <bool any_hit = false, typename Intersect>
+    bool traverse(const ray& r, real t_min, real t_max, Intersect&& intersect) const {
+        if (nodes.empty())
+            return false;
+
+        auto w = (time1 > time0) ? (r.time() - time0) / (time1 - time0) : real(0);
+        w = clamp(w, 0.0, 1.0);
+
+        bvh_ray q(r);
+        uint32_t stack[linear_bvh_tree::max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = nodes[current];
+            if (node.hit(q, w, t_min, t_max)) {
+                if (node.is_leaf()) {
+                    for (uint32_t i = 0; i < node.count; i++) {
+                        if (intersect(indices[node.offset + i], t_min, t_max)) {
+                            if (any_hit)
+                                return true;
+                            hit_anything = true;
+                        }
+                    }
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                }
+                else if (q.dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            }
+            else {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_anything;
+    }
+
+    static aabb node_box(const motion_bvh_node& n, int t) {
+        return aabb(point3(n.bounds[t][0][0], n.bounds[t][0][1], n.bounds[t][0][2]),
+            point3(n.bounds[t][1][0], n.bounds[t][1][1], n.bounds[t][1][2]));
+    }
+
+public:
+    real time0 = 0, time1 = 0;
+    std::vector<motion_bvh_node> nodes;
+    std::vector<uint32_t> indices;
+    bvh_build_stats build_stats;
+};
+
+// A BVH for motion-blurred content. The shutter [time0, time1] is split into
+// equal segments, each with its own motion_bvh_tree; a ray only walks the tree
+// for the segment holding its time. More segments give tighter boxes for
+// objects whose paths cross, at the cost of one tree per segment.
+class motion_bvh : public hittable {
+public:
+    motion_bvh() {}
+
+    motion_bvh(
+        const hittable_list& list, real _time0, real _time1, int segment_count = 1,
+        const bvh_build_options& options = bvh_build_options())
+        : objects(list.objects), time0(_time0), time1(_time1)
+    {
+        segments.resize(std::max(1, segment_count));
+        for (size_t s = 0; s < segments.size(); s++) {
+            auto t0 = time0 + (time1 - time0) * s / segments.size();
+            auto t1 = time0 + (time1 - time0) * (s + 1) / segments.size();
+            segments[s].build(objects, t0, t1, options);
+
+            build_stats.seconds += segments[s].build_stats.seconds;
+            build_stats.peak_bytes = std::max(build_stats.peak_bytes, segments[s].build_stats.peak_bytes);
+            build_stats.threads = segments[s].build_stats.threads;
+        }
+    }
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return segments[segment(r)].traverse<true>(r, t_min, t_max,
+            [&](uint32_t index, real t0, real t1) {
+                return objects[index]->occluded(r, t0, t1);
+            });
+    }
+
+    // The segment holding the ray's time.
+    size_t segment(const ray& r) const {
+        if (segments.size() <= 1 || time1 <= time0)
+            return 0;
+        auto x = (r.time() - time0) / (time1 - time0) * segments.size();
+        return static_cast<size_t>(clamp(x, 0.0, real(segments.size() - 1)));
+    }
+
+    virtual bool bounding_box(real _time0, real _time1, aabb& output_box) const override {
+        if (objects.empty())
+            return false;
+        output_box = segments[0].bounds();
+        for (const auto& s : segments)
+            output_box.expand(s.bounds());
+        return true;
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        for (const auto& s : segments)
+            bytes += s.memory_bytes();
+        return bytes;
+    }
+
+    size_t node_count() const {
+        size_t count = 0;
+        for (const auto& s : segments)
+            count += s.nodes.size();
+        return count;
+    }
+
+public:
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<motion_bvh_tree> segments;
+    real time0, time1;
+    bvh_build_stats build_stats;
+};
+
+bool motion_bvh::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+    return segments[segment(r)].traverse(r, t_min, t_max, [&](uint32_t index, real t0, real& t1) {
+        if (!objects[index]->intersect(r, t0, t1, hit))
+            return false;
+        t1 = hit.t;
+        return true;
+    });
+}
+
+#endif
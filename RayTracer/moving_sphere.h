@@ -9,30 +9,39 @@ class moving_sphere : public hittable {
 public:
     moving_sphere() {}
     moving_sphere(
-        point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m)
+        point3 cen0, point3 cen1, real _time0, real _time1, real r, shared_ptr<material> m)
         : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m)
     {};
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
 
     virtual bool bounding_box(
-        double _time0, double _time1, aabb& output_box) const override;
+        real _time0, real _time1, aabb& output_box) const override;
 
-    point3 center(double time) const;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    point3 center(real time) const;
 
 public:
     point3 center0, center1;
-    double time0, time1;
-    double radius;
+    real time0, time1;
+    real radius;
     shared_ptr<material> mat_ptr;
 };
 
-point3 moving_sphere::center(double time) const {
+point3 moving_sphere::center(real time) const {
     return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool moving_sphere::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     vec3 oc = r.origin() - center(r.time());
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -50,22 +59,45 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
             return false;
     }
 
-    rec.t = root;
-    rec.p = r.at(rec.t);
-    auto outward_normal = (rec.p - center(r.time())) / radius;
+    hit.set(root, this);
+    return true;
+}
+
+inline void moving_sphere::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    rec.t = hit.t;
+    // Projected back onto the sphere, as in sphere::resolve_hit().
+    auto c = center(r.time());
+    vec3 offset = r.at(rec.t) - c;
+    offset *= fabs(radius) / offset.length();
+    rec.p = c + offset;
+    rec.p_error = error_bound(max_abs(c) + fabs(radius));
+    auto outward_normal = offset / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
 
-    return true;
+inline bool moving_sphere::occluded(const ray& r, real t_min, real t_max) const {
+    vec3 oc = r.origin() - center(r.time());
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // Either root in range will do.
+    auto root = (-half_b - sqrtd) / a;
+    if (!(root < t_min || t_max < root))
+        return true;
+    root = (-half_b + sqrtd) / a;
+    return !(root < t_min || t_max < root);
 }
 
-bool moving_sphere::bounding_box(double _time0, double _time1, aabb& output_box) const {
-    aabb box0(
-        center(_time0) - vec3(radius, radius, radius),
-        center(_time0) + vec3(radius, radius, radius));
-    aabb box1(
-        center(_time1) - vec3(radius, radius, radius),
-        center(_time1) + vec3(radius, radius, radius));
+bool moving_sphere::bounding_box(real _time0, real _time1, aabb& output_box) const {
+    auto r = fabs(radius);
+    aabb box0(center(_time0) - vec3(r, r, r), center(_time0) + vec3(r, r, r));
+    aabb box1(center(_time1) - vec3(r, r, r), center(_time1) + vec3(r, r, r));
     output_box = surrounding_box(box0, box1);
     return true;
 }
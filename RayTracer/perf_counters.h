@@ -0,0 +1,109 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware cache-miss counters for this process, read with perf_event_open(2)
+// on Linux. Threads started between start() and stop() are counted too (the
+// render pool's workers), once they have exited. Other platforms, and virtual
+// machines that expose no hardware events, leave every counter unavailable.
+//
+// There is no portable L2 event. L1D read misses are the loads the L2 has to
+// serve; "LLC references" are what perf calls the requests that reach the last
+// level cache, which on Intel are the L2 misses; LLC misses go to memory.
+class cache_counters {
+public:
+    enum event { l1d_read_misses, llc_references, llc_misses, event_count };
+
+    cache_counters() {
+        for (int e = 0; e < event_count; e++) {
+            fds[e] = -1;
+            counts[e] = 0;
+        }
+
+#ifdef __linux__
+        const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D
+            | (uint64_t(PERF_COUNT_HW_CACHE_OP_READ) << 8)
+            | (uint64_t(PERF_COUNT_HW_CACHE_RESULT_MISS) << 16);
+        fds[l1d_read_misses] = open_event(PERF_TYPE_HW_CACHE, l1d_read_miss);
+        fds[llc_references] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+        fds[llc_misses] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+
+    ~cache_counters() {
+#ifdef __linux__
+        for (int e = 0; e < event_count; e++)
+            if (fds[e] >= 0)
+                close(fds[e]);
+#endif
+    }
+
+    cache_counters(const cache_counters&) = delete;
+    cache_counters& operator=(const cache_counters&) = delete;
+
+    bool available(event e) const { return fds[e] >= 0; }
+
+    bool any_available() const {
+        for (int e = 0; e < event_count; e++)
+            if (available(event(e)))
+                return true;
+        return false;
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int e = 0; e < event_count; e++) {
+            if (fds[e] < 0)
+                continue;
+            ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int e = 0; e < event_count; e++) {
+            if (fds[e] < 0)
+                continue;
+            ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t value = 0;
+            if (read(fds[e], &value, sizeof(value)) == sizeof(value))
+                counts[e] = value;
+        }
+#endif
+    }
+
+    uint64_t count(event e) const { return counts[e]; }
+
+private:
+#ifdef __linux__
+    // User-space counts only, which an unprivileged process may read.
+    static int open_event(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+    int fds[event_count];
+    uint64_t counts[event_count];
+};
+
+#endif
@@ -23,7 +23,7 @@ public:
         delete[] perm_z;
     }
 
-    double noise(const point3& p) const {
+    real noise(const point3& p) const {
         auto u = p.x() - floor(p.x());
         auto v = p.y() - floor(p.y());
         auto w = p.z() - floor(p.z());
@@ -44,7 +44,7 @@ public:
         return perlin_interp(c, u, v, w);
     }
 
-    double turb(const point3& p, int depth = 7) const {
+    real turb(const point3& p, int depth = 7) const {
         auto accum = 0.0;
         auto temp_p = p;
         auto weight = 1.0;
@@ -86,7 +86,7 @@ private:
         }
     }
 
-    static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
+    static real perlin_interp(vec3 c[2][2][2], real u, real v, real w) {
         auto uu = u * u * (3 - 2 * u);
         auto vv = v * v * (3 - 2 * v);
         auto ww = w * w * (3 - 2 * w);
@@ -105,7 +105,7 @@ private:
         return accum;
     }
 
-    static double trilinear_interp(double c[2][2][2], double u, double v, double w) {
+    static real trilinear_interp(real c[2][2][2], real u, real v, real w) {
         auto accum = 0.0;
         for (int i = 0; i < 2; i++)
             for (int j = 0; j < 2; j++)
@@ -0,0 +1,17 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+#include <cstdint>
+
+// Scalar type of the math and tracing core: vectors, rays, boxes, primitives
+// and BVH traversal all compute in it. Define RT_FLOAT when building to get a
+// single-precision renderer; the default is double.
+#ifdef RT_FLOAT
+using real = float;
+using real_bits = int32_t;  // integer of the same width, to step a real by ulps
+#else
+using real = double;
+using real_bits = int64_t;
+#endif
+
+#endif
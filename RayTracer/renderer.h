@@ -0,0 +1,314 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "color.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class tile_order { scanline, morton, hilbert };
+
+struct render_settings {
+    int image_width = 600;
+    int image_height = 338;
+    int samples_per_pixel = 10;
+    int tile_size = 16;
+    tile_order order = tile_order::morton;
+    int thread_count = 0;  // 0 picks the hardware concurrency
+};
+
+// Accumulated (not yet averaged) sample sums, stored as float RGB triples.
+// Row j = 0 is the bottom of the image, matching the camera's v coordinate.
+class framebuffer {
+public:
+    framebuffer(int w, int h) : width(w), height(h), pixels(3 * size_t(w) * h, 0.0f) {}
+
+    void set_pixel(int i, int j, const color& c) {
+        auto p = &pixels[3 * (size_t(j) * width + i)];
+        p[0] = static_cast<float>(c.x());
+        p[1] = static_cast<float>(c.y());
+        p[2] = static_cast<float>(c.z());
+    }
+
+    color pixel(int i, int j) const {
+        auto p = &pixels[3 * (size_t(j) * width + i)];
+        return color(p[0], p[1], p[2]);
+    }
+
+    // Writes the PPM body top row first, the same order the scanline loop used.
+    void write_ppm(std::ofstream& out, int samples_per_pixel) const {
+        out << "P3\n" << width << " " << height << "\n255\n";
+        for (int j = height - 1; j >= 0; --j)
+            for (int i = 0; i < width; ++i)
+                write_color(out, pixel(i, j), samples_per_pixel);
+    }
+
+public:
+    int width, height;
+    std::vector<float> pixels;
+};
+
+// How far apart two 8-bit images of the same size are, in output levels.
+struct image_difference {
+    double rmse = 0;
+    int max = 0;
+    size_t differing = 0;  // channel values that are not equal
+    size_t values = 0;
+};
+
+// Compares two plain PPM (P3) files such as write_ppm() produces. Returns false
+// if either cannot be read or their sizes differ.
+inline bool compare_ppm(const std::string& path_a, const std::string& path_b, image_difference& diff) {
+    std::ifstream a(path_a), b(path_b);
+    std::string magic_a, magic_b;
+    int wa, ha, ma, wb, hb, mb;
+    if (!(a >> magic_a >> wa >> ha >> ma) || !(b >> magic_b >> wb >> hb >> mb))
+        return false;
+    if (magic_a != "P3" || magic_b != "P3" || wa != wb || ha != hb)
+        return false;
+
+    diff = image_difference();
+    diff.values = 3 * size_t(wa) * ha;
+    double sum = 0;
+    for (size_t k = 0; k < diff.values; k++) {
+        int va, vb;
+        if (!(a >> va) || !(b >> vb))
+            return false;
+        int d = std::abs(va - vb);
+        sum += double(d) * d;
+        diff.max = std::max(diff.max, d);
+        diff.differing += d != 0;
+    }
+    diff.rmse = std::sqrt(sum / diff.values);
+    return true;
+}
+
+// Russian roulette: past min_depth bounces a path goes on with probability p,
+// its brightest throughput channel (at most 1), and a surviving path is
+// weighted by 1/p, so the expected value of the estimate is unchanged. Dark
+// paths, which add little, stop early. A min_depth of 0 turns it off.
+inline bool survives_roulette(int bounce, int min_depth, color& throughput) {
+    if (min_depth <= 0 || bounce < min_depth)
+        return true;
+
+    auto p = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), real(1));
+    if (random_double() >= p)
+        return false;
+    throughput /= p;
+    return true;
+}
+
+// Wall time of one render() call, and how long until its first tile was done.
+struct render_stats {
+    double seconds = 0;
+    double first_tile_seconds = 0;
+};
+
+struct tile {
+    int x0, y0, x1, y1;
+};
+
+// Interleaves the low 16 bits of x and y into a Z-order (Morton) index.
+inline unsigned morton_index(unsigned x, unsigned y) {
+    auto spread = [](unsigned v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Distance of (x, y) along the Hilbert curve filling an n x n grid (n a power of two).
+inline unsigned hilbert_index(unsigned n, unsigned x, unsigned y) {
+    unsigned d = 0;
+    for (unsigned s = n / 2; s > 0; s /= 2) {
+        unsigned rx = (x & s) > 0;
+        unsigned ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Splits the image into tiles and orders them along the requested curve, so
+// consecutive tiles (and therefore each worker's share) stay spatially close.
+inline std::vector<tile> make_tiles(int width, int height, int tile_size, tile_order order) {
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+
+    unsigned grid = 1;
+    while (grid < unsigned(std::max(tiles_x, tiles_y)))
+        grid *= 2;
+
+    std::vector<std::pair<unsigned, tile>> keyed;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            // Count tile rows from the top so every order starts where the old loop did.
+            unsigned row = unsigned(tiles_y - 1 - ty);
+            unsigned key = (order == tile_order::morton) ? morton_index(tx, row)
+                : (order == tile_order::hilbert) ? hilbert_index(grid, tx, row)
+                : row * tiles_x + tx;
+
+            tile t;
+            t.x0 = tx * tile_size;
+            t.y0 = ty * tile_size;
+            t.x1 = std::min(t.x0 + tile_size, width);
+            t.y1 = std::min(t.y0 + tile_size, height);
+            keyed.push_back({ key, t });
+        }
+    }
+
+    std::sort(keyed.begin(), keyed.end(),
+        [](const std::pair<unsigned, tile>& a, const std::pair<unsigned, tile>& b) {
+            return a.first < b.first;
+        });
+
+    std::vector<tile> tiles;
+    for (const auto& k : keyed)
+        tiles.push_back(k.second);
+    return tiles;
+}
+
+// Runs render_tile(tile, worker) for every tile of the image on a work-stealing
+// pool. Each worker starts on a contiguous run of tiles in curve order; idle
+// workers steal from the end of another worker's run. worker identifies the
+// thread, so a kernel can keep scratch memory per worker.
+template <typename TileKernel>
+render_stats render_tiles(const render_settings& settings, const TileKernel& render_tile) {
+    auto start_time = std::chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    };
+    render_stats stats;
+
+    auto tiles = make_tiles(settings.image_width, settings.image_height, settings.tile_size, settings.order);
+
+    thread_pool pool(settings.thread_count);
+    std::atomic<size_t> tiles_done{ 0 };
+    std::mutex progress_mutex;
+    int last_percent = -1;
+
+    for (size_t t = 0; t < tiles.size(); t++) {
+        int worker = static_cast<int>(t * pool.size() / tiles.size());
+        pool.submit(worker, [&, t](int current_worker) {
+            render_tile(tiles[t], current_worker);
+
+            auto done = ++tiles_done;
+            if (done == 1)
+                stats.first_tile_seconds = elapsed();
+
+            int percent = static_cast<int>(100 * done / tiles.size());
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            if (percent > last_percent) {
+                last_percent = percent;
+                std::cerr << "\rPicture Progress: " << percent << '%' << std::flush;
+            }
+        });
+    }
+
+    pool.run_all();
+    std::cerr << '\n';
+
+    stats.seconds = elapsed();
+    return stats;
+}
+
+// Renders the image one sample at a time: radiance(r) returns the color
+// carried back along r.
+template <typename Radiance>
+render_stats render(
+    const camera& cam, const render_settings& settings, framebuffer& fb, const Radiance& radiance
+) {
+    const int image_width = settings.image_width;
+    const int image_height = settings.image_height;
+    const int samples_per_pixel = settings.samples_per_pixel;
+
+    return render_tiles(settings, [&](const tile& tl, int) {
+        for (int j = tl.y0; j < tl.y1; ++j) {
+            for (int i = tl.x0; i < tl.x1; ++i) {
+                color pixel_color(0, 0, 0);
+                for (int s = 0; s < samples_per_pixel; ++s) {
+                    seed_sample(size_t(j) * image_width + i, s);
+                    auto u = (i + random_double()) / (image_width - 1);
+                    auto v = (j + random_double()) / (image_height - 1);
+                    ray r = cam.get_ray(u, v);
+                    pixel_color += radiance(r);
+                }
+                fb.set_pixel(i, j, pixel_color);
+            }
+        }
+    });
+}
+
+// render() for integrators that trace camera rays in packets. The samples of a
+// tile are made in the same order and from the same random numbers as in
+// render(), then handed over packet_size at a time to trace(rays, keys, count,
+// radiance), which fills in radiance[k] for rays[k]; keys[k] is that sample's
+// key (see sample_key()). Pixels add their samples up in the same order too.
+template <typename TracePacket>
+render_stats render_packets(
+    const camera& cam, const render_settings& settings, framebuffer& fb, int packet_size,
+    const TracePacket& trace
+) {
+    const int image_width = settings.image_width;
+    const int image_height = settings.image_height;
+    const int samples_per_pixel = settings.samples_per_pixel;
+
+    return render_tiles(settings, [&](const tile& tl, int) {
+        int tile_width = tl.x1 - tl.x0;
+        std::vector<color> sums(size_t(tile_width) * (tl.y1 - tl.y0), color(0, 0, 0));
+        std::vector<ray> rays(packet_size);
+        std::vector<uint64_t> keys(packet_size);
+        std::vector<color> radiance(packet_size);
+        std::vector<size_t> owner(packet_size);
+        int count = 0;
+
+        auto flush = [&] {
+            trace(rays.data(), keys.data(), count, radiance.data());
+            for (int k = 0; k < count; k++)
+                sums[owner[k]] += radiance[k];
+            count = 0;
+        };
+
+        for (int j = tl.y0; j < tl.y1; ++j) {
+            for (int i = tl.x0; i < tl.x1; ++i) {
+                for (int s = 0; s < samples_per_pixel; ++s) {
+                    seed_sample(size_t(j) * image_width + i, s);
+                    auto u = (i + random_double()) / (image_width - 1);
+                    auto v = (j + random_double()) / (image_height - 1);
+                    rays[count] = cam.get_ray(u, v);
+                    keys[count] = sample_key();
+                    owner[count] = size_t(j - tl.y0) * tile_width + (i - tl.x0);
+                    if (++count == packet_size)
+                        flush();
+                }
+            }
+        }
+        if (count > 0)
+            flush();
+
+        for (int j = tl.y0; j < tl.y1; ++j)
+            for (int i = tl.x0; i < tl.x1; ++i)
+                fb.set_pixel(i, j, sums[size_t(j - tl.y0) * tile_width + (i - tl.x0)]);
+    });
+}
+
+#endif
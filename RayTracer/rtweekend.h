@@ -4,9 +4,12 @@
 #include <cmath>
 #include <limits>
 #include <memory>
+#include <cstdint>
 #include <cstdlib>
 #include <random>
 
+#include "precision.h"
+
 // Usings
 
 using std::shared_ptr;
@@ -15,26 +18,109 @@ using std::sqrt;
 
 // Constants
 
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = 3.1415926535897932385;
 
 // Utility Functions
 
-inline double degrees_to_radians(double degrees) {
+inline real degrees_to_radians(real degrees) {
     return degrees * pi / 180.0;
 }
 
-inline double random_double() {
+// Random Numbers
+//
+// Every thread owns a PCG32 generator, so sampling never touches shared state.
+// The renderer re-keys it from (pixel, sample) before each camera sample and
+// from (pixel, sample, bounce) at each bounce, which makes the numbers a path
+// consumes independent of the thread, tile order and earlier bounces.
+
+class pcg32 {
+public:
+    pcg32() { seed(0x853c49e6748fea9bULL); }
+
+    void seed(uint64_t initstate, uint64_t initseq = 0xda3e39cb94b95bdbULL) {
+        state = 0;
+        inc = (initseq << 1) | 1;
+        next_uint();
+        state += initstate;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t oldstate = state;
+        state = oldstate * 6364136223846793005ULL + inc;
+        auto xorshifted = static_cast<uint32_t>(((oldstate >> 18) ^ oldstate) >> 27);
+        auto rot = static_cast<uint32_t>(oldstate >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+    }
+
+    double next_double() {
+        // 53 random bits from two draws, scaled into [0,1).
+        uint64_t hi = next_uint() >> 5;
+        uint64_t lo = next_uint() >> 6;
+        return (hi * 67108864.0 + lo) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+inline uint64_t hash_mix(uint64_t x) {
+    // SplitMix64 finalizer.
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+struct sampler_state {
+    pcg32 gen;
+    uint64_t key = 0;
+};
+
+inline sampler_state& thread_sampler() {
+    thread_local sampler_state sampler;
+    return sampler;
+}
+
+inline void seed_sample(uint64_t pixel, uint64_t sample) {
+    auto& s = thread_sampler();
+    s.key = hash_mix(hash_mix(pixel) ^ (sample + 0x9e3779b97f4a7c15ULL));
+    s.gen.seed(s.key);
+}
+
+inline void seed_bounce(int bounce) {
+    auto& s = thread_sampler();
+    s.gen.seed(hash_mix(s.key + static_cast<uint64_t>(bounce) + 1));
+}
+
+// For integrators that interleave many samples on one thread: the key of the
+// current sample, and a way back to it before its next seed_bounce().
+inline uint64_t sample_key() {
+    return thread_sampler().key;
+}
+
+inline void resume_sample(uint64_t key) {
+    thread_sampler().key = key;
+}
+
+inline real random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    // The same draw in either precision, so float and double renders follow
+    // the same paths; rounding must not carry it up to 1.
+    real x = static_cast<real>(thread_sampler().gen.next_double());
+    return x < 1 ? x : std::nextafter(real(1), real(0));
 }
 
-inline double random_double(double min, double max) {
+inline real random_double(real min, real max) {
     // Returns a random real in [min,max).
     return min + (max - min) * random_double();
 }
 
-inline double clamp(double x, double min, double max) {
+inline real clamp(real x, real min, real max) {
     if (x < min) return min;
     if (x > max) return max;
     return x;
@@ -0,0 +1,105 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using std::shared_ptr;
+
+// Storage for everything that lives as long as the scene: objects, materials
+// and textures are placed one after another in large blocks and destroyed
+// together, in reverse order, when the arena goes.
+//
+// make() hands out shared_ptrs without a control block (the aliasing
+// constructor over an empty owner), so they fit every interface that takes a
+// shared_ptr while copying or dropping one does no reference counting at all.
+// They must not outlive the arena.
+class scene_arena {
+public:
+    explicit scene_arena(size_t _block_size = 256 * 1024) : block_size(_block_size) {}
+
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    ~scene_arena() { clear(); }
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+            destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+        objects++;
+        return shared_ptr<T>(shared_ptr<T>(), object);
+    }
+
+    // Destroys every object and releases the blocks.
+    void clear() {
+        for (auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+            d->destroy(d->object);
+        destructors.clear();
+        blocks.clear();
+        current = nullptr;
+        objects = 0;
+        used = capacity = 0;
+        bytes = reserved = 0;
+    }
+
+    size_t object_count() const { return objects; }
+    size_t bytes_used() const { return bytes; }
+    size_t bytes_reserved() const { return reserved; }
+
+private:
+    struct destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    void* allocate(size_t size, size_t alignment) {
+        // Objects larger than a quarter block get a block of their own, so
+        // the tail of the current one is not wasted.
+        if (size + alignment > block_size / 4) {
+            char* block = new_block(size + alignment);
+            bytes += size;
+            return block + padding(block, alignment);
+        }
+
+        if (!current || used + padding(current + used, alignment) + size > capacity) {
+            current = new_block(block_size);
+            used = 0;
+            capacity = block_size;
+        }
+
+        used += padding(current + used, alignment);
+        void* p = current + used;
+        used += size;
+        bytes += size;
+        return p;
+    }
+
+    char* new_block(size_t size) {
+        blocks.emplace_back(new char[size]);
+        reserved += size;
+        return blocks.back().get();
+    }
+
+    // Bytes to skip from p to the next multiple of alignment.
+    static size_t padding(const char* p, size_t alignment) {
+        auto address = reinterpret_cast<uintptr_t>(p);
+        return (alignment - address % alignment) % alignment;
+    }
+
+    size_t block_size;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<destructor> destructors;
+    char* current = nullptr;
+    size_t objects = 0;
+    size_t used = 0, capacity = 0;
+    size_t bytes = 0, reserved = 0;
+};
+
+#endif
@@ -0,0 +1,699 @@
+#ifndef SCENE_OPTIMIZER_H
+#define SCENE_OPTIMIZER_H
+
+#include "rtweekend.h"
+
+#include "aarect.h"
+#include "box.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "lazy_bvh.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "motion_bvh.h"
+#include "moving_sphere.h"
+#include "scene_arena.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "texture.h"
+#include "triangle_mesh.h"
+#include "wide_bvh.h"
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Counts of what a scene is made of, for the optimizer's before/after report.
+// Objects reached along several paths are counted once.
+struct scene_summary {
+    size_t primitives = 0;  // everything that is not a list, BVH or wrapper
+    size_t wrappers = 0;    // translate, rotate_y and instance
+    size_t aggregates = 0;  // lists and BVHs
+    size_t materials = 0;
+    size_t textures = 0;
+    size_t bytes = 0;       // objects with their arrays; materials and textures at a nominal size
+
+    size_t objects() const { return primitives + wrappers + aggregates; }
+};
+
+// The children of a list or BVH, or an empty list for any other object. A
+// median-split bvh_node over one object names it on both sides; callers that
+// must not see it twice skip objects they have visited.
+inline std::vector<shared_ptr<hittable>> aggregate_children(const hittable& object) {
+    const auto& type = typeid(object);
+    if (type == typeid(hittable_list))
+        return static_cast<const hittable_list&>(object).objects;
+    if (type == typeid(bvh_node)) {
+        const auto& node = static_cast<const bvh_node&>(object);
+        return { node.left, node.right };
+    }
+    if (type == typeid(linear_bvh))
+        return static_cast<const linear_bvh&>(object).objects;
+    if (type == typeid(wide_bvh))
+        return static_cast<const wide_bvh&>(object).objects;
+    if (type == typeid(motion_bvh))
+        return static_cast<const motion_bvh&>(object).objects;
+    if (type == typeid(lazy_bvh))
+        return static_cast<const lazy_bvh&>(object).objects;
+    return {};
+}
+
+// What a BVH was built over: the objects of a linear, wide, motion or lazy
+// BVH, or the leaves below a tree of bvh_nodes. Each is named once.
+inline std::vector<shared_ptr<hittable>> bvh_leaves(const hittable& object) {
+    if (typeid(object) != typeid(bvh_node))
+        return aggregate_children(object);
+
+    std::vector<shared_ptr<hittable>> leaves;
+    std::unordered_set<const hittable*> seen;
+    std::vector<const bvh_node*> stack{ static_cast<const bvh_node*>(&object) };
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+        for (const auto& child : { node->right, node->left }) {
+            if (!seen.insert(child.get()).second)
+                continue;
+            if (typeid(*child) == typeid(bvh_node))
+                stack.push_back(static_cast<const bvh_node*>(child.get()));
+            else
+                leaves.push_back(child);
+        }
+    }
+    return leaves;
+}
+
+inline bool is_aggregate(const hittable& object) {
+    const auto& type = typeid(object);
+    return type == typeid(hittable_list) || type == typeid(bvh_node) || type == typeid(linear_bvh)
+        || type == typeid(wide_bvh) || type == typeid(motion_bvh) || type == typeid(lazy_bvh);
+}
+
+// The object under a translate, rotate_y or instance, or nullptr.
+inline shared_ptr<hittable> wrapped_object(const hittable& object) {
+    const auto& type = typeid(object);
+    if (type == typeid(translate))
+        return static_cast<const translate&>(object).ptr;
+    if (type == typeid(rotate_y))
+        return static_cast<const rotate_y&>(object).ptr;
+    if (type == typeid(instance))
+        return static_cast<const instance&>(object).ptr;
+    return nullptr;
+}
+
+// The material of one of the built-in primitives, or nullptr.
+inline shared_ptr<material> primitive_material(const hittable& object) {
+    const auto& type = typeid(object);
+    if (type == typeid(sphere)) return static_cast<const sphere&>(object).mat_ptr;
+    if (type == typeid(moving_sphere)) return static_cast<const moving_sphere&>(object).mat_ptr;
+    if (type == typeid(xy_rect)) return static_cast<const xy_rect&>(object).mp;
+    if (type == typeid(xz_rect)) return static_cast<const xz_rect&>(object).mp;
+    if (type == typeid(yz_rect)) return static_cast<const yz_rect&>(object).mp;
+    if (type == typeid(box)) return static_cast<const box&>(object).mp;
+    if (type == typeid(triangle_mesh)) return static_cast<const triangle_mesh&>(object).mat_ptr;
+    if (type == typeid(constant_medium)) return static_cast<const constant_medium&>(object).phase_function;
+    return nullptr;
+}
+
+// The textures a material samples, or an empty list.
+inline std::vector<const texture*> material_textures(const material& m) {
+    const auto& type = typeid(m);
+    if (type == typeid(lambertian)) return { static_cast<const lambertian&>(m).albedo.get() };
+    if (type == typeid(diffuse_light)) return { static_cast<const diffuse_light&>(m).emit.get() };
+    if (type == typeid(isotropic)) return { static_cast<const isotropic&>(m).albedo.get() };
+    return {};
+}
+
+// Whether what a texture returns depends on the surface (u, v) of a hit, so
+// that moving the surface under it would change the picture. Unknown types are
+// assumed to.
+inline bool texture_uses_uv(const texture& t) {
+    const auto& type = typeid(t);
+    if (type == typeid(solid_color) || type == typeid(noise_texture))
+        return false;
+    if (type == typeid(checker_texture)) {
+        const auto& checker = static_cast<const checker_texture&>(t);
+        return texture_uses_uv(*checker.odd) || texture_uses_uv(*checker.even);
+    }
+    return true;
+}
+
+inline bool material_uses_uv(const material& m) {
+    const auto& type = typeid(m);
+    if (type == typeid(metal) || type == typeid(dielectric))
+        return false;
+    if (type == typeid(lambertian) || type == typeid(diffuse_light) || type == typeid(isotropic)) {
+        for (auto t : material_textures(m))
+            if (texture_uses_uv(*t))
+                return true;
+        return false;
+    }
+    return true;
+}
+
+inline size_t object_bytes(const hittable& object) {
+    const auto& type = typeid(object);
+    if (type == typeid(sphere)) return sizeof(sphere);
+    if (type == typeid(moving_sphere)) return sizeof(moving_sphere);
+    if (type == typeid(xy_rect)) return sizeof(xy_rect);
+    if (type == typeid(xz_rect)) return sizeof(xz_rect);
+    if (type == typeid(yz_rect)) return sizeof(yz_rect);
+    if (type == typeid(box)) return sizeof(box);
+    if (type == typeid(translate)) return sizeof(translate);
+    if (type == typeid(rotate_y)) return sizeof(rotate_y);
+    if (type == typeid(instance)) return sizeof(instance);
+    if (type == typeid(constant_medium)) return sizeof(constant_medium);
+    if (type == typeid(bvh_node)) return sizeof(bvh_node);
+    if (type == typeid(triangle_mesh))
+        return sizeof(triangle_mesh) + static_cast<const triangle_mesh&>(object).memory_bytes();
+    if (type == typeid(sphere_set))
+        return sizeof(sphere_set) + static_cast<const sphere_set&>(object).memory_bytes();
+    if (type == typeid(linear_bvh)) {
+        const auto& bvh = static_cast<const linear_bvh&>(object);
+        return sizeof(linear_bvh) + bvh.tree.memory_bytes() + bvh.objects.capacity() * sizeof(bvh.objects[0]);
+    }
+    if (type == typeid(wide_bvh)) {
+        const auto& bvh = static_cast<const wide_bvh&>(object);
+        return sizeof(wide_bvh) + bvh.memory_bytes() + bvh.objects.capacity() * sizeof(bvh.objects[0]);
+    }
+    if (type == typeid(motion_bvh)) {
+        const auto& bvh = static_cast<const motion_bvh&>(object);
+        return sizeof(motion_bvh) + bvh.memory_bytes() + bvh.objects.capacity() * sizeof(bvh.objects[0]);
+    }
+    if (type == typeid(hittable_list)) {
+        const auto& list = static_cast<const hittable_list&>(object);
+        return sizeof(hittable_list) + list.objects.capacity() * sizeof(list.objects[0]);
+    }
+    return sizeof(hittable);
+}
+
+inline scene_summary summarize_scene(const hittable_list& world) {
+    scene_summary summary;
+    std::unordered_set<const void*> seen;
+    std::vector<shared_ptr<hittable>> stack(world.objects.rbegin(), world.objects.rend());
+
+    auto add_texture = [&](const texture* t, auto& self) -> void {
+        if (!t || !seen.insert(t).second)
+            return;
+        summary.textures++;
+        summary.bytes += sizeof(solid_color);
+        if (typeid(*t) == typeid(checker_texture)) {
+            self(static_cast<const checker_texture*>(t)->odd.get(), self);
+            self(static_cast<const checker_texture*>(t)->even.get(), self);
+        }
+    };
+    auto add_material = [&](const material* m) {
+        if (!m || !seen.insert(m).second)
+            return;
+        summary.materials++;
+        summary.bytes += sizeof(metal);
+        for (auto t : material_textures(*m))
+            add_texture(t, add_texture);
+    };
+
+    while (!stack.empty()) {
+        auto object = stack.back();
+        stack.pop_back();
+        if (!object || !seen.insert(object.get()).second)
+            continue;
+        summary.bytes += object_bytes(*object);
+
+        if (is_aggregate(*object)) {
+            summary.aggregates++;
+            auto children = aggregate_children(*object);
+            stack.insert(stack.end(), children.rbegin(), children.rend());
+        }
+        else if (auto inner = wrapped_object(*object)) {
+            summary.wrappers++;
+            stack.push_back(inner);
+        }
+        else {
+            summary.primitives++;
+            if (typeid(*object) == typeid(constant_medium))
+                stack.push_back(static_cast<const constant_medium&>(*object).boundary);
+            if (typeid(*object) == typeid(sphere_set))
+                for (const auto& m : static_cast<const sphere_set&>(*object).materials)
+                    add_material(m.get());
+            else
+                add_material(primitive_material(*object).get());
+        }
+    }
+    return summary;
+}
+
+// A pass over a scene before rendering, which takes out the levels that only
+// cost time on every ray:
+// - nested lists are opened up into the list or BVH that holds them; a BVH is
+//   kept as built unless what it holds changed, and is then rebuilt with the
+//   given builder. A list that has to stay whole under a transform gets a BVH
+//   from the builder, so scenes may leave their trees to this pass;
+// - chains of translate / rotate_y / instance are baked into world-space
+//   copies of the primitives underneath where that gives the same surface:
+//   any translation, rigid motions of spheres and boxes whose materials do not
+//   look at (u, v), and for boxes only quarter turns. Other chains become a
+//   single instance;
+// - materials with the same parameters become one, their textures compared by
+//   value (solid colors and checkers of them) rather than by address.
+// Objects reached through more than one path (bottom-level structures shared
+// by instances) are left as they are, so nothing is copied many times.
+class scene_optimizer {
+public:
+    using bvh_builder = std::function<shared_ptr<hittable>(const hittable_list&)>;
+
+    scene_optimizer(scene_arena& _arena, bvh_builder _build) : arena(_arena), build(_build) {}
+
+    // The objects of world, flattened, baked and with merged materials.
+    hittable_list optimize(const hittable_list& world);
+
+    // objects under one BVH, except any whose box is about as large as the
+    // whole scene's (ground spheres, enclosing media): nearly every ray
+    // enters those anyway, and inside the tree they would make the boxes
+    // above them cover everything.
+    hittable_list accelerate(const hittable_list& objects) const;
+
+public:
+    size_t baked = 0;             // primitives moved out from under wrappers
+    size_t collapsed = 0;         // wrapper chains turned into one instance
+    size_t materials_merged = 0;  // primitives given an identical, shared material
+
+private:
+    void count_references(const shared_ptr<hittable>& object);
+    void add(const shared_ptr<hittable>& object, const transform& to_world, int wrappers,
+        const shared_ptr<hittable>& chain, hittable_list& out);
+    bool can_bake(const hittable& object, const transform& to_world) const;
+    shared_ptr<hittable> bake(const hittable& object, const transform& to_world);
+    shared_ptr<hittable> with_material(const shared_ptr<hittable>& object);
+    shared_ptr<hittable> tree_for(const shared_ptr<hittable>& list);
+    shared_ptr<hittable> with_leaves(const shared_ptr<hittable>& node,
+        const std::unordered_map<const hittable*, shared_ptr<hittable>>& replaced);
+    shared_ptr<material> canonical_material(const shared_ptr<material>& m);
+    std::string texture_key(const texture* t) const;
+
+    static bool is_translation(const transform& t);
+    static bool is_rigid(const transform& t);
+    static bool is_quarter_turn(const transform& t);
+
+    template <typename T, typename... Args>
+    shared_ptr<hittable> make(Args&&... args) {
+        return arena.make<T>(std::forward<Args>(args)...);
+    }
+
+private:
+    scene_arena& arena;
+    bvh_builder build;
+    std::unordered_map<const hittable*, int> references;
+    std::unordered_set<const hittable*> visited;
+    std::unordered_map<const hittable*, shared_ptr<hittable>> trees;
+    std::unordered_map<std::string, shared_ptr<material>> materials_by_key;
+    std::unordered_map<const material*, shared_ptr<material>> canonical;
+};
+
+hittable_list scene_optimizer::optimize(const hittable_list& world) {
+    for (const auto& object : world.objects)
+        count_references(object);
+
+    hittable_list out;
+    for (const auto& object : world.objects)
+        add(object, transform(), 0, nullptr, out);
+
+    references.clear();
+    visited.clear();
+    trees.clear();
+    return out;
+}
+
+hittable_list scene_optimizer::accelerate(const hittable_list& objects) const {
+    aabb scene_box = aabb::empty();
+    std::vector<aabb> boxes(objects.objects.size());
+    std::vector<bool> has_box(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        has_box[i] = objects.objects[i]->bounding_box(0, 1, boxes[i]);
+        if (has_box[i])
+            scene_box.expand(boxes[i]);
+    }
+
+    hittable_list bounded, large;
+    for (size_t i = 0; i < boxes.size(); i++) {
+        if (!has_box[i] || boxes[i].surface_area() > 0.25 * scene_box.surface_area())
+            large.add(objects.objects[i]);
+        else
+            bounded.add(objects.objects[i]);
+    }
+
+    hittable_list out;
+    if (bounded.objects.size() > 1)
+        out.add(build(bounded));
+    else if (!bounded.objects.empty())
+        out.add(bounded.objects[0]);
+    for (const auto& object : large.objects)
+        out.add(object);
+    return out;
+}
+
+void scene_optimizer::count_references(const shared_ptr<hittable>& object) {
+    if (references[object.get()]++ > 0)
+        return;
+    if (is_aggregate(*object)) {
+        std::unordered_set<const hittable*> children;
+        for (const auto& child : aggregate_children(*object))
+            if (children.insert(child.get()).second)
+                count_references(child);
+    }
+    else if (auto inner = wrapped_object(*object)) {
+        count_references(inner);
+    }
+    else if (typeid(*object) == typeid(constant_medium)) {
+        count_references(static_cast<const constant_medium&>(*object).boundary);
+    }
+}
+
+// Adds object, placed by to_world, to out. wrappers is the length of the chain
+// of wrappers above it, chain the outermost of them.
+void scene_optimizer::add(
+    const shared_ptr<hittable>& object, const transform& to_world, int wrappers,
+    const shared_ptr<hittable>& chain, hittable_list& out
+) {
+    const auto& type = typeid(*object);
+    bool shared = references[object.get()] > 1;
+
+    // Wrappers compose into the transform of what they hold.
+    if (auto inner = wrapped_object(*object)) {
+        transform local;
+        if (type == typeid(translate))
+            local = transform::translate(static_cast<const translate&>(*object).offset);
+        else if (type == typeid(rotate_y)) {
+            const auto& r = static_cast<const rotate_y&>(*object);
+            local = transform::rotate_y(r.sin_theta, r.cos_theta);
+        }
+        else
+            local = static_cast<const instance&>(*object).to_world;
+
+        if (!shared) {
+            add(inner, to_world * local, wrappers + 1, wrappers == 0 ? object : chain, out);
+            return;
+        }
+        // A shared wrapper is kept whole, under whatever is above it.
+        if (wrappers == 0) {
+            out.add(object);
+            return;
+        }
+    }
+
+    bool placed = wrappers > 0;
+    if (placed && (shared || !can_bake(*object, to_world))) {
+        // Keep the object, under one transform instead of the whole chain.
+        auto kept = type == typeid(hittable_list) ? tree_for(object) : object;
+        if (wrappers == 1 && kept == object)
+            out.add(chain);
+        else {
+            out.add(make<instance>(kept, to_world));
+            if (wrappers > 1)
+                collapsed++;
+        }
+        return;
+    }
+
+    if (type == typeid(hittable_list)) {
+        std::unordered_set<const hittable*> children;
+        for (const auto& child : aggregate_children(*object))
+            if (children.insert(child.get()).second)
+                add(child, to_world, wrappers, chain, out);
+        return;
+    }
+
+    if (is_aggregate(*object)) {
+        auto leaves = bvh_leaves(*object);
+        hittable_list contents;
+        std::unordered_map<const hittable*, shared_ptr<hittable>> replaced;
+        bool one_to_one = !placed;
+        for (const auto& leaf : leaves) {
+            auto count = contents.objects.size();
+            add(leaf, to_world, wrappers, chain, contents);
+            if (contents.objects.size() == count + 1)
+                replaced[leaf.get()] = contents.objects.back();
+            else
+                one_to_one = false;
+        }
+
+        // Leaves that only changed material keep their bounds, so a tree of
+        // bvh_nodes is kept too: its median splits pick random axes, and a
+        // rebuild may well be worse.
+        if (!placed && contents.objects == leaves)
+            out.add(object);
+        else if (one_to_one && type == typeid(bvh_node))
+            out.add(with_leaves(object, replaced));
+        else if (contents.objects.size() == 1)
+            out.add(contents.objects[0]);
+        else if (!contents.objects.empty())
+            out.add(build(contents));
+        return;
+    }
+
+    if (!visited.insert(object.get()).second)
+        return;
+
+    if (placed) {
+        out.add(bake(*object, to_world));
+        baked++;
+    }
+    else if (type == typeid(constant_medium)) {
+        // The boundary is only asked for its interval, so a chain of wrappers
+        // above it can become one instance.
+        const auto& medium = static_cast<const constant_medium&>(*object);
+        auto inner = wrapped_object(*medium.boundary);
+        if (inner && wrapped_object(*inner)) {
+            transform boundary_to_world;
+            auto base = unwrap_transforms(medium.boundary, boundary_to_world);
+            auto copy = arena.make<constant_medium>(medium);
+            copy->boundary = make<instance>(base, boundary_to_world);
+            out.add(copy);
+            collapsed++;
+        }
+        else
+            out.add(object);
+    }
+    else
+        out.add(with_material(object));
+}
+
+bool scene_optimizer::can_bake(const hittable& object, const transform& to_world) const {
+    if (is_aggregate(object)) {
+        for (const auto& child : aggregate_children(object))
+            if (references.at(child.get()) > 1 || !can_bake(*child, to_world))
+                return false;
+        return true;
+    }
+
+    const auto& type = typeid(object);
+    bool translation = is_translation(to_world);
+    if (type == typeid(xy_rect) || type == typeid(xz_rect) || type == typeid(yz_rect))
+        return translation;
+    if (type == typeid(moving_sphere))
+        return is_rigid(to_world);  // it sets no (u, v)
+    if (type == typeid(sphere))
+        return translation || (is_rigid(to_world) && !material_uses_uv(*primitive_material(object)));
+    if (type == typeid(box))
+        return translation || (is_quarter_turn(to_world) && !material_uses_uv(*primitive_material(object)));
+    return false;
+}
+
+shared_ptr<hittable> scene_optimizer::bake(const hittable& object, const transform& to_world) {
+    const auto& type = typeid(object);
+    vec3 offset(to_world.m[0][3], to_world.m[1][3], to_world.m[2][3]);
+
+    if (type == typeid(sphere)) {
+        const auto& s = static_cast<const sphere&>(object);
+        return make<sphere>(to_world.point(s.center), s.radius, canonical_material(s.mat_ptr));
+    }
+    if (type == typeid(moving_sphere)) {
+        const auto& s = static_cast<const moving_sphere&>(object);
+        return make<moving_sphere>(to_world.point(s.center0), to_world.point(s.center1),
+            s.time0, s.time1, s.radius, canonical_material(s.mat_ptr));
+    }
+    if (type == typeid(xy_rect)) {
+        const auto& r = static_cast<const xy_rect&>(object);
+        return make<xy_rect>(r.x0 + offset.x(), r.x1 + offset.x(), r.y0 + offset.y(), r.y1 + offset.y(),
+            r.k + offset.z(), canonical_material(r.mp));
+    }
+    if (type == typeid(xz_rect)) {
+        const auto& r = static_cast<const xz_rect&>(object);
+        return make<xz_rect>(r.x0 + offset.x(), r.x1 + offset.x(), r.z0 + offset.z(), r.z1 + offset.z(),
+            r.k + offset.y(), canonical_material(r.mp));
+    }
+    if (type == typeid(yz_rect)) {
+        const auto& r = static_cast<const yz_rect&>(object);
+        return make<yz_rect>(r.y0 + offset.y(), r.y1 + offset.y(), r.z0 + offset.z(), r.z1 + offset.z(),
+            r.k + offset.x(), canonical_material(r.mp));
+    }
+
+    // A box: any translation, or a quarter turn, whose corners map to corners.
+    const auto& b = static_cast<const box&>(object);
+    auto bounds = to_world.box(aabb(b.box_min, b.box_max));
+    return make<box>(bounds.min(), bounds.max(), canonical_material(b.mp));
+}
+
+// object itself, or a copy of it that uses the shared copy of its material.
+shared_ptr<hittable> scene_optimizer::with_material(const shared_ptr<hittable>& object) {
+    auto m = primitive_material(*object);
+    const auto& type = typeid(*object);
+    if (!m || references[object.get()] > 1 || type == typeid(triangle_mesh)
+        || type == typeid(constant_medium))
+        return object;
+
+    auto shared_material = canonical_material(m);
+    if (shared_material == m)
+        return object;
+
+    materials_merged++;
+    if (type == typeid(sphere)) {
+        auto copy = arena.make<sphere>(static_cast<const sphere&>(*object));
+        copy->mat_ptr = shared_material;
+        return copy;
+    }
+    if (type == typeid(moving_sphere)) {
+        auto copy = arena.make<moving_sphere>(static_cast<const moving_sphere&>(*object));
+        copy->mat_ptr = shared_material;
+        return copy;
+    }
+    if (type == typeid(xy_rect)) {
+        auto copy = arena.make<xy_rect>(static_cast<const xy_rect&>(*object));
+        copy->mp = shared_material;
+        return copy;
+    }
+    if (type == typeid(xz_rect)) {
+        auto copy = arena.make<xz_rect>(static_cast<const xz_rect&>(*object));
+        copy->mp = shared_material;
+        return copy;
+    }
+    if (type == typeid(yz_rect)) {
+        auto copy = arena.make<yz_rect>(static_cast<const yz_rect&>(*object));
+        copy->mp = shared_material;
+        return copy;
+    }
+    auto copy = arena.make<box>(static_cast<const box&>(*object));
+    copy->mp = shared_material;
+    return copy;
+}
+
+// A copy of a tree of bvh_nodes with its leaves replaced.
+shared_ptr<hittable> scene_optimizer::with_leaves(
+    const shared_ptr<hittable>& node,
+    const std::unordered_map<const hittable*, shared_ptr<hittable>>& replaced
+) {
+    if (typeid(*node) != typeid(bvh_node))
+        return replaced.at(node.get());
+
+    auto copy = arena.make<bvh_node>(static_cast<const bvh_node&>(*node));
+    copy->left = with_leaves(copy->left, replaced);
+    copy->right = copy->right == static_cast<const bvh_node&>(*node).left ? copy->left
+        : with_leaves(copy->right, replaced);
+    return copy;
+}
+
+// The first material seen with the same type and parameters as m, textures
+// compared by what they return. Types it does not know are never merged.
+// The BVH over a list that stays whole under a transform, built once however
+// many chains lead to it.
+shared_ptr<hittable> scene_optimizer::tree_for(const shared_ptr<hittable>& list) {
+    auto& tree = trees[list.get()];
+    if (!tree) {
+        const auto& objects = static_cast<const hittable_list&>(*list);
+        tree = objects.objects.size() > 1 ? build(objects) : list;
+    }
+    return tree;
+}
+
+shared_ptr<material> scene_optimizer::canonical_material(const shared_ptr<material>& m) {
+    auto found = canonical.find(m.get());
+    if (found != canonical.end())
+        return found->second;
+
+    auto hex = [](real x) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%a ", static_cast<double>(x));
+        return std::string(buffer);
+    };
+    auto colour = [&](const color& c) { return hex(c.x()) + hex(c.y()) + hex(c.z()); };
+
+    std::string key;
+    const auto& type = typeid(*m);
+    if (type == typeid(lambertian))
+        key = "lambertian " + texture_key(static_cast<const lambertian&>(*m).albedo.get());
+    else if (type == typeid(metal)) {
+        const auto& metal_m = static_cast<const metal&>(*m);
+        key = "metal " + colour(metal_m.albedo) + hex(metal_m.fuzz);
+    }
+    else if (type == typeid(dielectric))
+        key = "dielectric " + hex(static_cast<const dielectric&>(*m).ir);
+    else if (type == typeid(diffuse_light))
+        key = "light " + texture_key(static_cast<const diffuse_light&>(*m).emit.get());
+    else if (type == typeid(isotropic))
+        key = "isotropic " + texture_key(static_cast<const isotropic&>(*m).albedo.get());
+
+    shared_ptr<material> result = m;
+    if (!key.empty()) {
+        auto inserted = materials_by_key.insert({ key, m });
+        result = inserted.first->second;
+    }
+    canonical[m.get()] = result;
+    return result;
+}
+
+// Equal for textures that return the same values everywhere: solid colors and
+// checkers are compared by value, anything else only to itself.
+std::string scene_optimizer::texture_key(const texture* t) const {
+    const auto& type = typeid(*t);
+    if (type == typeid(solid_color)) {
+        auto c = t->value(0, 0, point3(0, 0, 0));
+        char buffer[96];
+        snprintf(buffer, sizeof(buffer), "(%a %a %a)",
+            static_cast<double>(c.x()), static_cast<double>(c.y()), static_cast<double>(c.z()));
+        return buffer;
+    }
+    if (type == typeid(checker_texture)) {
+        const auto& checker = static_cast<const checker_texture&>(*t);
+        return "checker(" + texture_key(checker.odd.get()) + texture_key(checker.even.get()) + ")";
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "<%p>", static_cast<const void*>(t));
+    return buffer;
+}
+
+bool scene_optimizer::is_translation(const transform& t) {
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            if (t.m[i][j] != (i == j ? 1 : 0))
+                return false;
+    return true;
+}
+
+// Rotation (or reflection) and translation only: columns of unit length and
+// at right angles, up to rounding.
+bool scene_optimizer::is_rigid(const transform& t) {
+    for (int a = 0; a < 3; a++) {
+        for (int b = a; b < 3; b++) {
+            real d = t.m[0][a] * t.m[0][b] + t.m[1][a] * t.m[1][b] + t.m[2][a] * t.m[2][b];
+            if (fabs(d - (a == b ? 1 : 0)) > 1e-6)
+                return false;
+        }
+    }
+    return true;
+}
+
+// A rigid motion that maps axes onto axes, so boxes stay axis aligned.
+bool scene_optimizer::is_quarter_turn(const transform& t) {
+    if (!is_rigid(t))
+        return false;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            if (fabs(t.m[i][j]) > 1e-6 && fabs(fabs(t.m[i][j]) - 1) > 1e-6)
+                return false;
+    return true;
+}
+
+#endif
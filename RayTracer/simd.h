@@ -0,0 +1,61 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// SSE/AVX support. SSE2 is part of every x86-64 target, so SSE kernels are
+// always compiled there. AVX2 kernels are compiled with a per-function target
+// attribute and only called after cpu_has_avx2() says the CPU can run them.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(RT_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RT_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define RT_TARGET_AVX2
+#endif
+
+// AVX without FMA, for double kernels that must round exactly like the scalar
+// code they replace: with FMA enabled the compiler may fuse a multiply and add.
+// Every CPU that passes cpu_has_avx2() has it.
+#if defined(RT_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RT_TARGET_AVX __attribute__((target("avx")))
+#else
+#define RT_TARGET_AVX
+#endif
+
+inline bool cpu_has_avx2() {
+#if defined(RT_X86) && (defined(__GNUC__) || defined(__clang__))
+    static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has;
+#elif defined(RT_X86) && defined(_MSC_VER)
+    static const bool has = [] {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool fma = (info[2] & (1 << 12)) != 0;
+        if (!osxsave || !fma)
+            return false;
+
+        // The OS must save the YMM registers on context switches.
+        if ((_xgetbv(0) & 0x6) != 0x6)
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }();
+    return has;
+#else
+    return false;
+#endif
+}
+
+#endif
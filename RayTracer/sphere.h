@@ -8,21 +8,34 @@
 class sphere : public hittable {
 public:
     sphere() {}
-    sphere(point3 cen, double r, shared_ptr<material> m)
+    sphere(point3 cen, real r, shared_ptr<material> m)
         : center(cen), radius(r), mat_ptr(m) {};
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool hit_interval(const ray& r, real& t_enter, real& t_exit) const override;
+
+    virtual void intersect_packet(ray_packet& p, uint32_t active) const override;
 
 public:
     point3 center;
-    double radius;
+    real radius;
     shared_ptr<material> mat_ptr;
 
-private:
-    static void get_sphere_uv(const point3& p, double& u, double& v) {
+public:
+    static void get_sphere_uv(const point3& p, real& u, real& v) {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
         // v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -39,7 +52,7 @@ private:
 
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool sphere::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -57,20 +70,97 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
             return false;
     }
 
-    rec.t = root;
-    rec.p = r.at(rec.t);
-    vec3 outward_normal = (rec.p - center) / radius;
+    hit.set(root, this);
+    return true;
+}
+
+// intersect() for every lane, with the terms that only depend on the shared
+// origin worked out once per packet.
+inline void sphere::intersect_packet(ray_packet& p, uint32_t active) const {
+    if (!p.coherent) {
+        hittable::intersect_packet(p, active);
+        return;
+    }
+
+    vec3 oc = p.origin - center;
+    auto c = oc.length_squared() - radius * radius;
+
+    for (; active; active &= active - 1) {
+        int k = lowest_lane(active);
+        vec3 d = p.rays[k].direction();
+        auto a = d.length_squared();
+        auto half_b = dot(oc, d);
+
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) continue;
+        auto sqrtd = sqrt(discriminant);
+
+        auto root = (-half_b - sqrtd) / a;
+        if (root < 0 || p.t_max[k] < root) {
+            root = (-half_b + sqrtd) / a;
+            if (root < 0 || p.t_max[k] < root)
+                continue;
+        }
+
+        p.hits[k].set(root, this);
+        p.t_max[k] = root;
+        p.found |= 1u << k;
+    }
+}
+
+inline void sphere::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    rec.t = hit.t;
+    // r.at(t) can be off the sphere by far more than its own rounding when the
+    // sphere is large or the ray starts far away, so project it back on.
+    vec3 offset = r.at(rec.t) - center;
+    offset *= fabs(radius) / offset.length();
+    rec.p = center + offset;
+    rec.p_error = error_bound(max_abs(center) + fabs(radius));
+    vec3 outward_normal = offset / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
 
-    return true;
+inline bool sphere::occluded(const ray& r, real t_min, real t_max) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // Either root in range will do.
+    auto root = (-half_b - sqrtd) / a;
+    if (!(root < t_min || t_max < root))
+        return true;
+    root = (-half_b + sqrtd) / a;
+    return !(root < t_min || t_max < root);
+}
+
+bool sphere::hit_interval(const ray& r, real& t_enter, real& t_exit) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // Both roots; a grazing ray whose roots nearly coincide counts as a miss,
+    // as it did when the exit was searched for past the entry plus 0.0001.
+    t_enter = (-half_b - sqrtd) / a;
+    t_exit = (-half_b + sqrtd) / a;
+    return t_exit >= t_enter + 0.0001;
 }
 
-bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
-    output_box = aabb(
-        center - vec3(radius, radius, radius),
-        center + vec3(radius, radius, radius));
+bool sphere::bounding_box(real time0, real time1, aabb& output_box) const {
+    // A negative radius (a hollow glass shell) bounds the same sphere.
+    auto r = fabs(radius);
+    output_box = aabb(center - vec3(r, r, r), center + vec3(r, r, r));
     return true;
 }
 
@@ -0,0 +1,446 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "moving_sphere.h"
+#include "simd.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Ray data broadcast once per query for the sphere kernels.
+struct sphere_set_ray {
+    explicit sphere_set_ray(const ray& r) : a(r.direction().length_squared()), time(r.time()) {
+        for (int k = 0; k < 3; k++) {
+            origin[k] = r.origin()[k];
+            dir[k] = r.direction()[k];
+        }
+    }
+
+    double origin[3];
+    double dir[3];
+    double a;
+    double time;
+};
+
+// Sphere attributes, one array per component. Moving spheres keep their path
+// as delta = center1 - center0 over [time0, time0 + span]; a set without any
+// leaves those arrays empty. Arrays are padded to a whole block so kernels
+// may always load block_width entries.
+struct sphere_set_arrays {
+    std::vector<double> cx, cy, cz, radius;
+    std::vector<double> dx, dy, dz, time0, span;
+
+    bool moving() const { return !dx.empty(); }
+};
+
+// Spheres handled by one kernel call: the leaf size of a sphere_set's BVH.
+const int sphere_set_block_width = 4;
+
+// The lanes of a block that hold one of the remaining spheres of a leaf.
+inline unsigned sphere_set_block_mask(uint32_t remaining) {
+    return remaining >= uint32_t(sphere_set_block_width)
+        ? (1u << sphere_set_block_width) - 1 : (1u << remaining) - 1;
+}
+
+// Tests the spheres [base, base + block_width) against q within [t_min, t_max].
+// Returns the lanes with a root in range; near_mask marks the lanes whose near
+// root is the one, and roots receive both roots per lane. The arithmetic is
+// that of sphere::hit and moving_sphere::hit, step for step.
+inline unsigned sphere_set_lanes(
+    const sphere_set_arrays& s, size_t base, const sphere_set_ray& q, double t_min, double t_max,
+    double* near_root, double* far_root, unsigned& near_mask
+) {
+    unsigned hits = 0;
+    near_mask = 0;
+    for (int k = 0; k < sphere_set_block_width; k++) {
+        size_t i = base + k;
+        double c[3] = { s.cx[i], s.cy[i], s.cz[i] };
+        if (s.moving()) {
+            double f = (q.time - s.time0[i]) / s.span[i];
+            c[0] = c[0] + f * s.dx[i];
+            c[1] = c[1] + f * s.dy[i];
+            c[2] = c[2] + f * s.dz[i];
+        }
+        double oc[3] = { q.origin[0] - c[0], q.origin[1] - c[1], q.origin[2] - c[2] };
+        double half_b = oc[0] * q.dir[0] + oc[1] * q.dir[1] + oc[2] * q.dir[2];
+        double cc = (oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2]) - s.radius[i] * s.radius[i];
+        double disc = half_b * half_b - q.a * cc;
+        if (!(disc >= 0))
+            continue;
+        double sqrtd = sqrt(disc);
+        near_root[k] = (-half_b - sqrtd) / q.a;
+        far_root[k] = (-half_b + sqrtd) / q.a;
+        bool in_near = near_root[k] >= t_min && near_root[k] <= t_max;
+        bool in_far = far_root[k] >= t_min && far_root[k] <= t_max;
+        if (in_near)
+            near_mask |= 1u << k;
+        if (in_near || in_far)
+            hits |= 1u << k;
+    }
+    return hits;
+}
+
+#ifdef RT_X86
+// Two spheres per instruction. Negation flips the sign bit, as -x does.
+inline unsigned sphere_set_lanes_sse(
+    const sphere_set_arrays& s, size_t base, const sphere_set_ray& q, double t_min, double t_max,
+    double* near_root, double* far_root, unsigned& near_mask
+) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    const __m128d a = _mm_set1_pd(q.a);
+    const __m128d lo = _mm_set1_pd(t_min);
+    const __m128d hi = _mm_set1_pd(t_max);
+
+    unsigned hits = 0;
+    near_mask = 0;
+    for (int h = 0; h < sphere_set_block_width; h += 2) {
+        size_t i = base + h;
+        __m128d cx = _mm_loadu_pd(&s.cx[i]);
+        __m128d cy = _mm_loadu_pd(&s.cy[i]);
+        __m128d cz = _mm_loadu_pd(&s.cz[i]);
+        if (s.moving()) {
+            __m128d f = _mm_div_pd(_mm_sub_pd(_mm_set1_pd(q.time), _mm_loadu_pd(&s.time0[i])), _mm_loadu_pd(&s.span[i]));
+            cx = _mm_add_pd(cx, _mm_mul_pd(f, _mm_loadu_pd(&s.dx[i])));
+            cy = _mm_add_pd(cy, _mm_mul_pd(f, _mm_loadu_pd(&s.dy[i])));
+            cz = _mm_add_pd(cz, _mm_mul_pd(f, _mm_loadu_pd(&s.dz[i])));
+        }
+        __m128d ox = _mm_sub_pd(_mm_set1_pd(q.origin[0]), cx);
+        __m128d oy = _mm_sub_pd(_mm_set1_pd(q.origin[1]), cy);
+        __m128d oz = _mm_sub_pd(_mm_set1_pd(q.origin[2]), cz);
+        __m128d half_b = _mm_add_pd(_mm_add_pd(
+            _mm_mul_pd(ox, _mm_set1_pd(q.dir[0])), _mm_mul_pd(oy, _mm_set1_pd(q.dir[1]))),
+            _mm_mul_pd(oz, _mm_set1_pd(q.dir[2])));
+        __m128d r = _mm_loadu_pd(&s.radius[i]);
+        __m128d cc = _mm_sub_pd(
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(ox, ox), _mm_mul_pd(oy, oy)), _mm_mul_pd(oz, oz)),
+            _mm_mul_pd(r, r));
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, cc));
+        __m128d sqrtd = _mm_sqrt_pd(disc);
+        __m128d neg_b = _mm_xor_pd(half_b, sign);
+        __m128d r0 = _mm_div_pd(_mm_sub_pd(neg_b, sqrtd), a);
+        __m128d r1 = _mm_div_pd(_mm_add_pd(neg_b, sqrtd), a);
+        _mm_storeu_pd(near_root + h, r0);
+        _mm_storeu_pd(far_root + h, r1);
+
+        __m128d ok = _mm_cmpge_pd(disc, _mm_setzero_pd());
+        __m128d in0 = _mm_and_pd(_mm_cmpge_pd(r0, lo), _mm_cmple_pd(r0, hi));
+        __m128d in1 = _mm_and_pd(_mm_cmpge_pd(r1, lo), _mm_cmple_pd(r1, hi));
+        near_mask |= unsigned(_mm_movemask_pd(_mm_and_pd(ok, in0))) << h;
+        hits |= unsigned(_mm_movemask_pd(_mm_and_pd(ok, _mm_or_pd(in0, in1)))) << h;
+    }
+    return hits;
+}
+
+// Four spheres per instruction.
+RT_TARGET_AVX
+inline unsigned sphere_set_lanes_avx(
+    const sphere_set_arrays& s, size_t base, const sphere_set_ray& q, double t_min, double t_max,
+    double* near_root, double* far_root, unsigned& near_mask
+) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d a = _mm256_set1_pd(q.a);
+
+    __m256d cx = _mm256_loadu_pd(&s.cx[base]);
+    __m256d cy = _mm256_loadu_pd(&s.cy[base]);
+    __m256d cz = _mm256_loadu_pd(&s.cz[base]);
+    if (s.moving()) {
+        __m256d f = _mm256_div_pd(
+            _mm256_sub_pd(_mm256_set1_pd(q.time), _mm256_loadu_pd(&s.time0[base])), _mm256_loadu_pd(&s.span[base]));
+        cx = _mm256_add_pd(cx, _mm256_mul_pd(f, _mm256_loadu_pd(&s.dx[base])));
+        cy = _mm256_add_pd(cy, _mm256_mul_pd(f, _mm256_loadu_pd(&s.dy[base])));
+        cz = _mm256_add_pd(cz, _mm256_mul_pd(f, _mm256_loadu_pd(&s.dz[base])));
+    }
+    __m256d ox = _mm256_sub_pd(_mm256_set1_pd(q.origin[0]), cx);
+    __m256d oy = _mm256_sub_pd(_mm256_set1_pd(q.origin[1]), cy);
+    __m256d oz = _mm256_sub_pd(_mm256_set1_pd(q.origin[2]), cz);
+    __m256d half_b = _mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(ox, _mm256_set1_pd(q.dir[0])), _mm256_mul_pd(oy, _mm256_set1_pd(q.dir[1]))),
+        _mm256_mul_pd(oz, _mm256_set1_pd(q.dir[2])));
+    __m256d r = _mm256_loadu_pd(&s.radius[base]);
+    __m256d cc = _mm256_sub_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ox, ox), _mm256_mul_pd(oy, oy)), _mm256_mul_pd(oz, oz)),
+        _mm256_mul_pd(r, r));
+    __m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, cc));
+    __m256d sqrtd = _mm256_sqrt_pd(disc);
+    __m256d neg_b = _mm256_xor_pd(half_b, sign);
+    __m256d r0 = _mm256_div_pd(_mm256_sub_pd(neg_b, sqrtd), a);
+    __m256d r1 = _mm256_div_pd(_mm256_add_pd(neg_b, sqrtd), a);
+    _mm256_storeu_pd(near_root, r0);
+    _mm256_storeu_pd(far_root, r1);
+
+    const __m256d lo = _mm256_set1_pd(t_min);
+    const __m256d hi = _mm256_set1_pd(t_max);
+    __m256d ok = _mm256_cmp_pd(disc, _mm256_setzero_pd(), _CMP_GE_OQ);
+    __m256d in0 = _mm256_and_pd(_mm256_cmp_pd(r0, lo, _CMP_GE_OQ), _mm256_cmp_pd(r0, hi, _CMP_LE_OQ));
+    __m256d in1 = _mm256_and_pd(_mm256_cmp_pd(r1, lo, _CMP_GE_OQ), _mm256_cmp_pd(r1, hi, _CMP_LE_OQ));
+    near_mask = unsigned(_mm256_movemask_pd(_mm256_and_pd(ok, in0)));
+    return unsigned(_mm256_movemask_pd(_mm256_and_pd(ok, _mm256_or_pd(in0, in1))));
+}
+#endif
+
+// Many spheres and moving spheres as one object: their attributes in
+// sphere_set_arrays, materials by index, and a BVH whose leaves each hold one
+// kernel block of spheres stored next to each other. A leaf is tested with a
+// single kernel call (AVX when the CPU has it, else SSE2, else scalar), or one
+// per block for the larger leaves the builder leaves at its depth limit, and
+// only the closest sphere's shading data is worked out. Hits are exactly those
+// of the sphere and moving_sphere objects the set was made from.
+class sphere_set : public hittable {
+public:
+    sphere_set() : use_avx(cpu_has_avx2()) {}
+
+    void add(const sphere& s) {
+        add(s.center, vec3(0, 0, 0), 0, 1, s.radius, s.mat_ptr, false);
+    }
+
+    void add(const moving_sphere& s) {
+        add(s.center0, s.center1 - s.center0, s.time0, s.time1 - s.time0, s.radius, s.mat_ptr, true);
+    }
+
+    size_t size() const { return staged.size() + material_id.size(); }
+
+    // Builds the BVH over [time0, time1] and lays the spheres out in leaf
+    // order. Call once every sphere has been added.
+    void build(real time0, real time1, bvh_build_options options = bvh_build_options()) {
+        // A block costs about one sphere test, so the SAH should fill leaves.
+        options.max_leaf_size = sphere_set_block_width;
+        options.intersection_cost /= sphere_set_block_width;
+        options.spatial_split_budget = 0;
+
+        std::vector<bvh_primitive_ref> refs(staged.size());
+        for (size_t i = 0; i < staged.size(); i++) {
+            const auto& s = staged[i];
+            auto r = fabs(s.radius);
+            vec3 extent(r, r, r);
+            aabb box0(s.center0 - extent, s.center0 + extent);
+            auto box = box0;
+            if (s.moving) {
+                auto c0 = s.center0 + ((time0 - s.time0) / s.span) * s.delta;
+                auto c1 = s.center0 + ((time1 - s.time0) / s.span) * s.delta;
+                box = surrounding_box(aabb(c0 - extent, c0 + extent), aabb(c1 - extent, c1 + extent));
+            }
+            refs[i].box = box;
+            refs[i].centroid = box.centroid();
+            refs[i].index = i;
+        }
+        tree.build(refs, options);
+
+        // Leaf entries [offset, offset + count) of the index array become the
+        // spheres at those positions, so the kernels read them contiguously.
+        bool any_moving = false;
+        for (const auto& s : staged)
+            any_moving = any_moving || s.moving;
+
+        size_t n = tree.index_count();
+        size_t padded = n + sphere_set_block_width;
+        auto& a = arrays;
+        for (auto* v : { &a.cx, &a.cy, &a.cz, &a.radius })
+            v->assign(padded, 0.0);
+        if (any_moving) {
+            for (auto* v : { &a.dx, &a.dy, &a.dz, &a.time0 })
+                v->assign(padded, 0.0);
+            a.span.assign(padded, 1.0);
+        }
+        material_id.assign(n, 0);
+        moving.assign(n, 0);
+
+        const auto* index = tree.index_data();
+        for (size_t k = 0; k < n; k++) {
+            const auto& s = staged[index[k]];
+            a.cx[k] = s.center0.x(); a.cy[k] = s.center0.y(); a.cz[k] = s.center0.z();
+            a.radius[k] = s.radius;
+            if (any_moving) {
+                a.dx[k] = s.delta.x(); a.dy[k] = s.delta.y(); a.dz[k] = s.delta.z();
+                a.time0[k] = s.time0;
+                a.span[k] = s.span;
+            }
+            material_id[k] = s.material;
+            moving[k] = s.moving;
+        }
+        staged.clear();
+        staged.shrink_to_fit();
+    }
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    // The hit's primitive is the sphere's position in the arrays.
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        sphere_set_ray q(r);
+        return tree.traverse_leaves<true>(r, t_min, t_max,
+            [&](uint32_t first, uint32_t count, real t0, real t1) {
+                double near_root[sphere_set_block_width], far_root[sphere_set_block_width];
+                unsigned near_mask;
+                for (uint32_t base = 0; base < count; base += sphere_set_block_width) {
+                    unsigned valid = sphere_set_block_mask(count - base);
+                    if (lanes(first + base, q, t0, t1, near_root, far_root, near_mask) & valid)
+                        return true;
+                }
+                return false;
+            });
+    }
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+        if (tree.empty())
+            return false;
+        output_box = tree.bounds();
+        return true;
+    }
+
+    unsigned lanes(
+        size_t base, const sphere_set_ray& q, double t_min, double t_max,
+        double* near_root, double* far_root, unsigned& near_mask
+    ) const {
+#ifdef RT_X86
+        if (use_avx)
+            return sphere_set_lanes_avx(arrays, base, q, t_min, t_max, near_root, far_root, near_mask);
+        return sphere_set_lanes_sse(arrays, base, q, t_min, t_max, near_root, far_root, near_mask);
+#else
+        return sphere_set_lanes(arrays, base, q, t_min, t_max, near_root, far_root, near_mask);
+#endif
+    }
+
+    size_t memory_bytes() const {
+        size_t doubles = 0;
+        for (const auto* v : { &arrays.cx, &arrays.cy, &arrays.cz, &arrays.radius,
+            &arrays.dx, &arrays.dy, &arrays.dz, &arrays.time0, &arrays.span })
+            doubles += v->capacity();
+        return doubles * sizeof(double) + material_id.capacity() * sizeof(uint32_t)
+            + moving.capacity() + tree.memory_bytes();
+    }
+
+private:
+    struct staged_sphere {
+        point3 center0;
+        vec3 delta;
+        double time0, span, radius;
+        uint32_t material;
+        bool moving;
+    };
+
+    void add(
+        const point3& center0, const vec3& delta, double time0, double span, double radius,
+        shared_ptr<material> m, bool is_moving
+    ) {
+        auto found = material_index.find(m.get());
+        uint32_t id;
+        if (found != material_index.end()) {
+            id = found->second;
+        }
+        else {
+            id = static_cast<uint32_t>(materials.size());
+            materials.push_back(m);
+            material_index[m.get()] = id;
+        }
+        staged.push_back({ center0, delta, time0, span, radius, id, is_moving });
+    }
+
+public:
+    sphere_set_arrays arrays;
+    std::vector<uint32_t> material_id;   // per sphere, into materials
+    std::vector<uint8_t> moving;         // per sphere: a moving_sphere (no uv)
+    std::vector<shared_ptr<material>> materials;
+    linear_bvh_tree tree;
+    bool use_avx;
+
+private:
+    std::vector<staged_sphere> staged;
+    std::unordered_map<const material*, uint32_t> material_index;
+};
+
+bool sphere_set::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+    sphere_set_ray q(r);
+    size_t closest_sphere = 0;
+    double closest = t_max;
+
+    bool hit_anything = tree.traverse_leaves(r, t_min, t_max,
+        [&](uint32_t first, uint32_t count, real t0, real& t1) {
+            double near_root[sphere_set_block_width], far_root[sphere_set_block_width];
+            unsigned near_mask;
+            bool found = false;
+            for (uint32_t base = 0; base < count; base += sphere_set_block_width) {
+                unsigned valid = sphere_set_block_mask(count - base);
+                unsigned hits = lanes(first + base, q, t0, t1, near_root, far_root, near_mask) & valid;
+
+                // In lane order, a later sphere at the same distance wins, as
+                // it does when the spheres are tested one after another.
+                for (int k = 0; k < sphere_set_block_width; k++) {
+                    if (!(hits & (1u << k)))
+                        continue;
+                    double root = (near_mask & (1u << k)) ? near_root[k] : far_root[k];
+                    if (root <= t1) {
+                        t1 = closest = root;
+                        closest_sphere = first + base + k;
+                        found = true;
+                    }
+                }
+            }
+            return found;
+        });
+    if (!hit_anything)
+        return false;
+
+    hit.set(closest, this, static_cast<uint32_t>(closest_sphere));
+    return true;
+}
+
+void sphere_set::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    size_t i = hit.primitive;
+    point3 center(arrays.cx[i], arrays.cy[i], arrays.cz[i]);
+    if (moving[i])
+        center = center + ((r.time() - arrays.time0[i]) / arrays.span[i])
+            * vec3(arrays.dx[i], arrays.dy[i], arrays.dz[i]);
+
+    rec.t = hit.t;
+    // Projected back onto the sphere, as in sphere::resolve_hit().
+    real radius = arrays.radius[i];
+    vec3 offset = r.at(rec.t) - center;
+    offset *= fabs(radius) / offset.length();
+    rec.p = center + offset;
+    rec.p_error = error_bound(max_abs(center) + fabs(radius));
+    vec3 outward_normal = offset / radius;
+    rec.set_face_normal(r, outward_normal);
+    if (!moving[i])
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_ptr = materials[material_id[i]].get();
+}
+
+// Replaces the spheres and moving spheres among objects with one sphere_set
+// built over [time0, time1]; everything else is kept as it is.
+hittable_list gather_spheres(
+    const hittable_list& objects, real time0, real time1,
+    const bvh_build_options& options = bvh_build_options())
+{
+    auto set = make_shared<sphere_set>();
+    hittable_list rest;
+    for (const auto& object : objects.objects) {
+        if (auto s = std::dynamic_pointer_cast<sphere>(object))
+            set->add(*s);
+        else if (auto m = std::dynamic_pointer_cast<moving_sphere>(object))
+            set->add(*m);
+        else
+            rest.add(object);
+    }
+
+    if (set->size() == 0 && rest.objects.size() == objects.objects.size())
+        return objects;
+    set->build(time0, time1, options);
+    rest.add(set);
+    return rest;
+}
+
+#endif
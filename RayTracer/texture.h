@@ -7,7 +7,7 @@
 
 class texture {
 public:
-    virtual color value(double u, double v, const point3& p) const = 0;
+    virtual color value(real u, real v, const point3& p) const = 0;
 };
 
 class solid_color : public texture {
@@ -15,10 +15,10 @@ public:
     solid_color() {}
     solid_color(color c) : color_value(c) {}
 
-    solid_color(double red, double green, double blue)
+    solid_color(real red, real green, real blue)
         : solid_color(color(red, green, blue)) {}
 
-    virtual color value(double u, double v, const vec3& p) const override {
+    virtual color value(real u, real v, const vec3& p) const override {
         return color_value;
     }
 
@@ -36,14 +36,19 @@ public:
     checker_texture(color c1, color c2)
         : even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
 
-    virtual color value(double u, double v, const point3& p) const override {
-        auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
-        if (sines < 0)
+    virtual color value(real u, real v, const point3& p) const override {
+        if (odd_cell(p))
             return odd->value(u, v, p);
         else
             return even->value(u, v, p);
     }
 
+    // Whether p lies in a cell that takes the odd texture.
+    static bool odd_cell(const point3& p) {
+        auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+        return sines < 0;
+    }
+
 public:
     shared_ptr<texture> odd;
     shared_ptr<texture> even;
@@ -52,9 +57,9 @@ public:
 class noise_texture : public texture {
 public:
     noise_texture() {}
-    noise_texture(double sc) : scale(sc) {}
+    noise_texture(real sc) : scale(sc) {}
 
-    virtual color value(double u, double v, const point3& p) const override {
+    virtual color value(real u, real v, const point3& p) const override {
         //return color(1, 1, 1) * 0.5 * (1.0 + noise.noise(scale * p));
         //return color(1, 1, 1) * noise.turb(scale * p);
         
@@ -64,7 +69,7 @@ public:
 
 public:
     perlin noise;
-    double scale;
+    real scale;
 };
 
 class image_texture : public texture {
@@ -92,7 +97,7 @@ public:
         delete data;
     }
 
-    virtual color value(double u, double v, const vec3& p) const override {
+    virtual color value(real u, real v, const vec3& p) const override {
         // If we have no texture data, then return solid cyan as a debugging aid.
         if (data == nullptr)
             return color(0, 1, 1);
@@ -0,0 +1,105 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool for bulk-synchronous jobs (the tiles of a
+// frame, the subtrees of a BVH build). Every worker owns a deque: it runs its
+// own tasks in submission order from the front and, once that is empty, steals
+// from the back of the other workers' deques. Tasks may submit more tasks while
+// running.
+
+class thread_pool {
+public:
+    using task = std::function<void(int worker)>;
+
+    explicit thread_pool(int thread_count = 0)
+        : queues(default_thread_count(thread_count))
+    {}
+
+    static int default_thread_count(int thread_count) {
+        if (thread_count <= 0)
+            thread_count = static_cast<int>(std::thread::hardware_concurrency());
+        return thread_count > 0 ? thread_count : 1;
+    }
+
+    int size() const { return static_cast<int>(queues.size()); }
+
+    // Queue a task, distributing tasks round-robin over the workers.
+    void submit(task t) {
+        submit(next_queue++ % size(), std::move(t));
+    }
+
+    // Queue a task on a specific worker, e.g. the one currently running.
+    void submit(int worker, task t) {
+        pending++;
+        std::lock_guard<std::mutex> lock(queues[worker].mutex);
+        queues[worker].tasks.push_back(std::move(t));
+    }
+
+    // Run until every queued task (and everything they queue) has finished.
+    // The calling thread works as worker 0.
+    void run_all() {
+        std::vector<std::thread> threads;
+        for (int w = 1; w < size(); w++)
+            threads.emplace_back([this, w] { work(w); });
+
+        work(0);
+
+        for (auto& t : threads)
+            t.join();
+    }
+
+private:
+    struct worker_queue {
+        std::mutex mutex;
+        std::deque<task> tasks;
+    };
+
+    void work(int worker) {
+        while (pending > 0) {
+            task t;
+            if (pop(worker, t) || steal(worker, t)) {
+                t(worker);
+                pending--;
+            }
+            else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool pop(int worker, task& t) {
+        std::lock_guard<std::mutex> lock(queues[worker].mutex);
+        if (queues[worker].tasks.empty())
+            return false;
+        t = std::move(queues[worker].tasks.front());
+        queues[worker].tasks.pop_front();
+        return true;
+    }
+
+    bool steal(int worker, task& t) {
+        for (int k = 1; k < size(); k++) {
+            auto& victim = queues[(worker + k) % size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty())
+                continue;
+            t = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+private:
+    std::vector<worker_queue> queues;
+    std::atomic<int> pending{ 0 };
+    std::atomic<unsigned> next_queue{ 0 };
+};
+
+#endif
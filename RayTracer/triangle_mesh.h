@@ -0,0 +1,214 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+// A ray prepared for the watertight triangle test of Woop, Benthin and Wald
+// (JCGT 2013): the axis the direction is longest along becomes z, and a shear
+// maps the ray onto the +z axis, so every triangle is tested in the same 2D
+// frame. Edges shared by two triangles then give the same edge function
+// values on both sides and no ray slips through between them.
+struct watertight_ray {
+    explicit watertight_ray(const ray& r) : origin(r.origin()) {
+        auto d = r.direction();
+        kz = (fabs(d.x()) > fabs(d.y()))
+            ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2)
+            : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    }
+
+    point3 origin;
+    int kx, ky, kz;
+    real sx, sy, sz;
+};
+
+// A mesh of triangles over shared vertices. Attributes are kept as one array
+// per component (structure of arrays) and triangles as three indices each;
+// normals and texture coordinates are optional and, when present, have one
+// entry per vertex. The mesh carries its own BVH over its triangles, so it is
+// a single object to the scene and to any BVH built over the scene.
+class triangle_mesh : public hittable {
+public:
+    triangle_mesh() {}
+    triangle_mesh(shared_ptr<material> m) : mat_ptr(m) {}
+
+    size_t vertex_count() const { return px.size(); }
+    size_t triangle_count() const { return indices.size() / 3; }
+    bool has_normals() const { return !nx.empty(); }
+    bool has_uvs() const { return !tu.empty(); }
+
+    point3 position(uint32_t v) const { return point3(px[v], py[v], pz[v]); }
+
+    // Builds the internal BVH. Call once the buffers are filled.
+    void build(const bvh_build_options& options = bvh_build_options()) {
+        std::vector<bvh_primitive_ref> refs(triangle_count());
+        for (size_t t = 0; t < refs.size(); t++) {
+            aabb box = aabb::empty();
+            for (int k = 0; k < 3; k++)
+                box.expand(position(indices[3 * t + k]));
+
+            // Vertices lie on the faces of their boxes, where rounding in the
+            // slab test can cull a ray aimed right at them. Any padding at all
+            // grows the float node bounds by one step, which is enough.
+            point3 lo = box.min(), hi = box.max();
+            for (int a = 0; a < 3; a++) {
+                lo[a] -= 1e-9 * (1 + fabs(lo[a]));
+                hi[a] += 1e-9 * (1 + fabs(hi[a]));
+            }
+            box = aabb(lo, hi);
+            refs[t].box = box;
+            refs[t].centroid = box.centroid();
+            refs[t].index = t;
+        }
+        tree.build(refs, options);
+    }
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    // The hit's primitive is the triangle and b its barycentric weights.
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual void resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        watertight_ray w(r);
+        return tree.traverse<true>(r, t_min, t_max, [&](uint32_t t, real t0, real t1) {
+            real b[3], t_hit;
+            return intersect(w, t, t0, t1, b, t_hit);
+        });
+    }
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+        if (tree.empty())
+            return false;
+        output_box = tree.bounds();
+        return true;
+    }
+
+    // Watertight test of triangle t against w within (t_min, t_max). On a hit
+    // stores the barycentric weights of the three corners and the distance.
+    bool intersect(
+        const watertight_ray& w, uint32_t t, real t_min, real t_max, real* b, real& t_hit
+    ) const {
+        const uint32_t* tri = &indices[3 * size_t(t)];
+        vec3 a = position(tri[0]) - w.origin;
+        vec3 bv = position(tri[1]) - w.origin;
+        vec3 c = position(tri[2]) - w.origin;
+
+        // Shear and scale the corners into the ray's frame.
+        auto ax = a[w.kx] - w.sx * a[w.kz], ay = a[w.ky] - w.sy * a[w.kz];
+        auto bx = bv[w.kx] - w.sx * bv[w.kz], by = bv[w.ky] - w.sy * bv[w.kz];
+        auto cx = c[w.kx] - w.sx * c[w.kz], cy = c[w.ky] - w.sy * c[w.kz];
+
+        // Scaled barycentrics: the ray passes inside when all three agree in sign.
+        auto u = cx * by - cy * bx;
+        auto v = ax * cy - ay * cx;
+        auto e = bx * ay - by * ax;
+        if ((u < 0 || v < 0 || e < 0) && (u > 0 || v > 0 || e > 0))
+            return false;
+
+        auto det = u + v + e;
+        if (det == 0)
+            return false;
+
+        auto dist = (u * a[w.kz] + v * bv[w.kz] + e * c[w.kz]) * w.sz / det;
+        if (!(dist > t_min && dist < t_max))
+            return false;
+
+        b[0] = u / det;
+        b[1] = v / det;
+        b[2] = e / det;
+        t_hit = dist;
+        return true;
+    }
+
+    size_t memory_bytes() const {
+        return (px.capacity() + py.capacity() + pz.capacity() + nx.capacity() + ny.capacity()
+            + nz.capacity() + tu.capacity() + tv.capacity()) * sizeof(float)
+            + indices.capacity() * sizeof(uint32_t) + tree.memory_bytes();
+    }
+
+public:
+    std::vector<float> px, py, pz;   // positions
+    std::vector<float> nx, ny, nz;   // shading normals, empty if the mesh has none
+    std::vector<float> tu, tv;       // texture coordinates, empty if the mesh has none
+    std::vector<uint32_t> indices;   // three vertices per triangle, counter-clockwise from the front
+    shared_ptr<material> mat_ptr;
+    linear_bvh_tree tree;
+};
+
+bool triangle_mesh::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+    watertight_ray w(r);
+    uint32_t hit_triangle = 0;
+    real b[3], closest = t_max;
+    bool hit_anything = tree.traverse(r, t_min, t_max, [&](uint32_t t, real t0, real& t1) {
+        real tb[3], t_hit;
+        if (!intersect(w, t, t0, t1, tb, t_hit))
+            return false;
+        hit_triangle = t;
+        b[0] = tb[0]; b[1] = tb[1]; b[2] = tb[2];
+        t1 = closest = t_hit;
+        return true;
+    });
+    if (!hit_anything)
+        return false;
+
+    hit.set(closest, this, hit_triangle);
+    hit.b[0] = b[0]; hit.b[1] = b[1]; hit.b[2] = b[2];
+    return true;
+}
+
+void triangle_mesh::resolve_hit(const ray& r, const surface_hit& hit, hit_record& rec) const {
+    const real* b = hit.b;
+    const uint32_t* tri = &indices[3 * size_t(hit.primitive)];
+    auto p0 = position(tri[0]), p1 = position(tri[1]), p2 = position(tri[2]);
+
+    rec.t = hit.t;
+    rec.p = b[0] * p0 + b[1] * p1 + b[2] * p2;
+    rec.p_error = error_bound(fmax(max_abs(p0), fmax(max_abs(p1), max_abs(p2))));
+    rec.mat_ptr = mat_ptr.get();
+    rec.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+
+    if (has_normals()) {
+        vec3 n(0, 0, 0);
+        for (int k = 0; k < 3; k++)
+            n += b[k] * vec3(nx[tri[k]], ny[tri[k]], nz[tri[k]]);
+        // Corners the file gave no normal are stored as zero; where that
+        // leaves nothing to interpolate, the geometric normal stays. Keep the
+        // shading normal on the side the geometric one faces.
+        auto length_squared = n.length_squared();
+        if (length_squared > 1e-12) {
+            n /= sqrt(length_squared);
+            rec.normal = rec.front_face ? n : -n;
+        }
+    }
+
+    if (has_uvs()) {
+        rec.u = b[0] * tu[tri[0]] + b[1] * tu[tri[1]] + b[2] * tu[tri[2]];
+        rec.v = b[0] * tv[tri[0]] + b[1] * tv[tri[1]] + b[2] * tv[tri[2]];
+    }
+    else {
+        rec.u = b[1];
+        rec.v = b[2];
+    }
+}
+
+#endif
@@ -0,0 +1,419 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "compiled_scene.h"
+#include "hittable.h"
+#include "material.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// The paths of one batch, a column per field (structure of arrays), so each
+// stage below streams through only the fields it needs. Paths stay in their
+// slots; the stages pass lists of slot indices between them.
+struct path_queue {
+    std::vector<real> ox, oy, oz;     // ray origin
+    std::vector<real> dx, dy, dz;     // ray direction
+    std::vector<real> time;
+    std::vector<real> tr, tg, tb;     // throughput
+    std::vector<real> lr, lg, lb;     // radiance gathered so far
+    std::vector<int> bounces;
+    std::vector<uint64_t> keys;       // sample key, for seed_bounce()
+    std::vector<pcg32> rng;           // generator state from extend to shade
+    std::vector<hit_record> hits;
+    std::vector<uint8_t> kinds;       // material kind of the hit
+    std::vector<uint8_t> alive;
+
+    void resize(size_t n) {
+        for (auto v : { &ox, &oy, &oz, &dx, &dy, &dz, &time, &tr, &tg, &tb, &lr, &lg, &lb })
+            v->resize(n);
+        bounces.resize(n);
+        keys.resize(n);
+        rng.resize(n);
+        hits.resize(n);
+        kinds.resize(n);
+        alive.resize(n);
+    }
+
+    ray get_ray(size_t i) const {
+        return ray(point3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]), time[i]);
+    }
+
+    void set_ray(size_t i, const ray& r) {
+        ox[i] = r.origin().x(); oy[i] = r.origin().y(); oz[i] = r.origin().z();
+        dx[i] = r.direction().x(); dy[i] = r.direction().y(); dz[i] = r.direction().z();
+        time[i] = r.time();
+    }
+
+    color throughput(size_t i) const { return color(tr[i], tg[i], tb[i]); }
+
+    void set_throughput(size_t i, const color& c) {
+        tr[i] = c.x(); tg[i] = c.y(); tb[i] = c.z();
+    }
+
+    color radiance(size_t i) const { return color(lr[i], lg[i], lb[i]); }
+
+    void add_radiance(size_t i, const color& c) {
+        lr[i] += c.x(); lg[i] += c.y(); lb[i] += c.z();
+    }
+
+    // Per-worker slot lists, kept here so their memory is reused.
+    std::vector<uint32_t> active, hit, sorted;
+
+    // Scratch for reordering the active list by ray key.
+    std::vector<uint64_t> ray_keys, ray_keys_scratch;
+    std::vector<uint32_t> active_scratch;
+};
+
+// How the extend stage orders secondary rays. Scattered rays point every which
+// way, so in slot order consecutive rays walk unrelated parts of the BVH;
+// grouping them by where they start and which way they go lets one ray find
+// the nodes and primitives the previous one just pulled into cache.
+// - none: slot order, as generated;
+// - octant: by the signs of the direction (eight buckets);
+// - morton: by octant, then by the Morton code of the origin on a 1024^3 grid
+//   over the scene bounds.
+enum class ray_sort { none, octant, morton };
+
+// Spreads the low 10 bits of v out to every third bit.
+inline uint32_t morton_spread3(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Qualified calls are not virtual: in a loop over one material kind each
+// compiles to a direct call of that material's code.
+inline bool scatter_as(const lambertian& m, const ray& r, const hit_record& rec, color& a, ray& s) {
+    return m.lambertian::scatter(r, rec, a, s);
+}
+inline bool scatter_as(const metal& m, const ray& r, const hit_record& rec, color& a, ray& s) {
+    return m.metal::scatter(r, rec, a, s);
+}
+inline bool scatter_as(const dielectric& m, const ray& r, const hit_record& rec, color& a, ray& s) {
+    return m.dielectric::scatter(r, rec, a, s);
+}
+inline bool scatter_as(const isotropic& m, const ray& r, const hit_record& rec, color& a, ray& s) {
+    return m.isotropic::scatter(r, rec, a, s);
+}
+inline bool scatter_as(const material& m, const ray& r, const hit_record& rec, color& a, ray& s) {
+    return m.scatter(r, rec, a, s);
+}
+
+// Wavefront (stream) path tracing: instead of following one path to its end,
+// each tile keeps a batch of paths in a path_queue and runs every stage over
+// the whole batch before the next:
+// - generate: camera rays for every pixel and sample of the batch;
+// - reorder: sort the live paths by ray key (see ray_sort), from the second
+//   bounce on; camera rays are already coherent in pixel order;
+// - extend: trace each live path's ray;
+// - sort: group the hits by material kind;
+// - shade: emission, scatter and Russian roulette, one material kind at a time;
+// - compact: drop the paths that ended, keeping the rest in slot order.
+// The scene has no light sampling, so there is no connection stage. Every
+// path draws the same random numbers as ray_color() would, whatever order the
+// stages visit it in, so the images match the one-path-at-a-time integrator.
+class wavefront_integrator {
+public:
+    using material_kind = compiled_scene::material_kind;
+
+    wavefront_integrator(const hittable& _world, const color& _background, int _max_depth, int _roulette_depth)
+        : world(_world), background(_background), max_depth(_max_depth), roulette_depth(_roulette_depth) {}
+
+    render_stats render(const camera& cam, const render_settings& settings, framebuffer& fb);
+
+public:
+    size_t batch_size = 1 << 14;   // paths in flight per worker, at most
+    ray_sort order = ray_sort::none;
+    std::atomic<uint64_t> segments{ 0 };  // rays traced
+
+    // Seconds spent in each stage, summed over workers. Writing the pixels
+    // back counts as part of generate.
+    enum stage {
+        generate_stage, reorder_stage, extend_stage, sort_stage, shade_stage, compact_stage, stage_count
+    };
+    double stage_seconds[stage_count] = {};
+
+private:
+    void render_tile(const camera& cam, const render_settings& settings, framebuffer& fb, const tile& tl,
+        path_queue& q, double* seconds);
+    void reorder(path_queue& q);
+    uint64_t ray_key(const path_queue& q, uint32_t i) const;
+    void extend(path_queue& q);
+    void sort_by_material(path_queue& q, size_t* offsets);
+    void shade_lights(path_queue& q, const uint32_t* first, const uint32_t* last);
+    template <typename M>
+    void shade(path_queue& q, const uint32_t* first, const uint32_t* last, bool emissive);
+    void compact(path_queue& q);
+
+    static material_kind kind_of(const material& m);
+
+private:
+    const hittable& world;
+    color background;
+    int max_depth;
+    int roulette_depth;
+    bool has_bounds = false;
+    aabb bounds;                             // of the scene, for ray_key()
+    std::vector<path_queue> queues;          // one per worker
+    std::vector<std::vector<double>> times;  // stage seconds per worker
+};
+
+render_stats wavefront_integrator::render(const camera& cam, const render_settings& settings, framebuffer& fb) {
+    int workers = thread_pool::default_thread_count(settings.thread_count);
+    queues.assign(workers, path_queue());
+    times.assign(workers, std::vector<double>(stage_count, 0.0));
+    segments = 0;
+    has_bounds = world.bounding_box(0, 1, bounds);
+
+    auto stats = render_tiles(settings, [&](const tile& tl, int worker) {
+        render_tile(cam, settings, fb, tl, queues[worker], times[worker].data());
+    });
+
+    for (int s = 0; s < stage_count; s++) {
+        stage_seconds[s] = 0;
+        for (const auto& t : times)
+            stage_seconds[s] += t[s];
+    }
+    queues.clear();
+    return stats;
+}
+
+void wavefront_integrator::render_tile(
+    const camera& cam, const render_settings& settings, framebuffer& fb, const tile& tl,
+    path_queue& q, double* seconds
+) {
+    auto clock = std::chrono::steady_clock::now();
+    auto lap = [&](stage s) {
+        auto now = std::chrono::steady_clock::now();
+        seconds[s] += std::chrono::duration<double>(now - clock).count();
+        clock = now;
+    };
+
+    const int tile_width = tl.x1 - tl.x0;
+    const int pixel_count = tile_width * (tl.y1 - tl.y0);
+    const int spp = settings.samples_per_pixel;
+
+    // As many samples per pixel as fit in a batch; the sums are added up in
+    // sample order, the same order render() adds them in.
+    int samples_per_batch = static_cast<int>(std::max<size_t>(1, batch_size / pixel_count));
+    samples_per_batch = std::min(samples_per_batch, spp);
+    std::vector<color> pixel_sums(pixel_count, color(0, 0, 0));
+
+    for (int s0 = 0; s0 < spp; s0 += samples_per_batch) {
+        int n = std::min(samples_per_batch, spp - s0);
+        q.resize(size_t(pixel_count) * n);
+        q.active.clear();
+
+        // Generate: slot p * n + k holds sample s0 + k of pixel p.
+        for (int p = 0; p < pixel_count; p++) {
+            int i = tl.x0 + p % tile_width;
+            int j = tl.y0 + p / tile_width;
+            for (int k = 0; k < n; k++) {
+                uint32_t slot = static_cast<uint32_t>(p * n + k);
+                seed_sample(size_t(j) * settings.image_width + i, s0 + k);
+                auto u = (i + random_double()) / (settings.image_width - 1);
+                auto v = (j + random_double()) / (settings.image_height - 1);
+                q.set_ray(slot, cam.get_ray(u, v));
+                q.set_throughput(slot, color(1, 1, 1));
+                q.lr[slot] = q.lg[slot] = q.lb[slot] = 0;
+                q.bounces[slot] = 0;
+                q.keys[slot] = sample_key();
+                q.active.push_back(slot);
+            }
+        }
+        lap(generate_stage);
+
+        for (bool first_bounce = true; !q.active.empty(); first_bounce = false) {
+            if (!first_bounce && order != ray_sort::none) {
+                reorder(q);
+                lap(reorder_stage);
+            }
+
+            extend(q);
+            lap(extend_stage);
+
+            size_t offsets[7];
+            sort_by_material(q, offsets);
+            lap(sort_stage);
+
+            const uint32_t* sorted = q.sorted.data();
+            shade<lambertian>(q, sorted + offsets[0], sorted + offsets[1], false);
+            shade<metal>(q, sorted + offsets[1], sorted + offsets[2], false);
+            shade<dielectric>(q, sorted + offsets[2], sorted + offsets[3], false);
+            shade_lights(q, sorted + offsets[3], sorted + offsets[4]);
+            shade<isotropic>(q, sorted + offsets[4], sorted + offsets[5], false);
+            shade<material>(q, sorted + offsets[5], sorted + offsets[6], true);
+            lap(shade_stage);
+
+            compact(q);
+            lap(compact_stage);
+        }
+
+        for (int p = 0; p < pixel_count; p++)
+            for (int k = 0; k < n; k++)
+                pixel_sums[p] += q.radiance(size_t(p) * n + k);
+    }
+
+    for (int p = 0; p < pixel_count; p++)
+        fb.set_pixel(tl.x0 + p % tile_width, tl.y0 + p / tile_width, pixel_sums[p]);
+    lap(generate_stage);
+}
+
+// The sort key of path i's ray: the octant of its direction in the top bits
+// and, for ray_sort::morton, the Morton code of its origin cell below.
+uint64_t wavefront_integrator::ray_key(const path_queue& q, uint32_t i) const {
+    uint64_t octant = (q.dx[i] < 0 ? 1 : 0) | (q.dy[i] < 0 ? 2 : 0) | (q.dz[i] < 0 ? 4 : 0);
+    if (order != ray_sort::morton || !has_bounds)
+        return octant;
+
+    const real o[3] = { q.ox[i], q.oy[i], q.oz[i] };
+    uint32_t code = 0;
+    for (int a = 0; a < 3; a++) {
+        real extent = bounds.max()[a] - bounds.min()[a];
+        real x = extent > 0 ? (o[a] - bounds.min()[a]) / extent : 0;
+        auto cell = static_cast<uint32_t>(fmin(fmax(x, real(0)), real(1)) * 1023);
+        code |= morton_spread3(cell) << a;
+    }
+    return (octant << 30) | code;
+}
+
+// A stable LSD radix sort of the active list by ray_key(), eight bits a pass.
+// Passes stop once the remaining bits are zero in every key.
+void wavefront_integrator::reorder(path_queue& q) {
+    size_t n = q.active.size();
+    q.ray_keys.resize(n);
+    q.ray_keys_scratch.resize(n);
+    q.active_scratch.resize(n);
+
+    uint64_t all_bits = 0;
+    for (size_t k = 0; k < n; k++) {
+        q.ray_keys[k] = ray_key(q, q.active[k]);
+        all_bits |= q.ray_keys[k];
+    }
+
+    for (int shift = 0; (all_bits >> shift) != 0; shift += 8) {
+        size_t offsets[257] = {};
+        for (size_t k = 0; k < n; k++)
+            offsets[((q.ray_keys[k] >> shift) & 0xff) + 1]++;
+        for (int d = 0; d < 256; d++)
+            offsets[d + 1] += offsets[d];
+
+        for (size_t k = 0; k < n; k++) {
+            auto dst = offsets[(q.ray_keys[k] >> shift) & 0xff]++;
+            q.ray_keys_scratch[dst] = q.ray_keys[k];
+            q.active_scratch[dst] = q.active[k];
+        }
+        q.ray_keys.swap(q.ray_keys_scratch);
+        q.active.swap(q.active_scratch);
+    }
+}
+
+// Traces the ray of every active path. Misses take the background and end;
+// hits are recorded, with the generator as it stands, for shading.
+void wavefront_integrator::extend(path_queue& q) {
+    q.hit.clear();
+    for (auto i : q.active) {
+        resume_sample(q.keys[i]);
+        seed_bounce(max_depth - q.bounces[i]);
+        q.bounces[i]++;
+
+        auto& rec = q.hits[i];
+        if (!world.hit(q.get_ray(i), 0, infinity, rec)) {
+            q.add_radiance(i, q.throughput(i) * background);
+            continue;
+        }
+        q.rng[i] = thread_sampler().gen;
+        q.kinds[i] = static_cast<uint8_t>(kind_of(*rec.mat_ptr));
+        q.hit.push_back(i);
+    }
+    segments.fetch_add(q.active.size(), std::memory_order_relaxed);
+}
+
+// A stable counting sort of the hits by material kind: offsets[k] is where
+// kind k starts in q.sorted, offsets[6] where the list ends.
+void wavefront_integrator::sort_by_material(path_queue& q, size_t* offsets) {
+    size_t counts[6] = {};
+    for (auto i : q.hit)
+        counts[q.kinds[i]]++;
+
+    offsets[0] = 0;
+    for (int k = 0; k < 6; k++)
+        offsets[k + 1] = offsets[k] + counts[k];
+
+    size_t next[6];
+    std::copy(offsets, offsets + 6, next);
+    q.sorted.resize(q.hit.size());
+    for (auto i : q.hit)
+        q.sorted[next[q.kinds[i]]++] = i;
+}
+
+// Lights only emit; their paths end here.
+void wavefront_integrator::shade_lights(path_queue& q, const uint32_t* first, const uint32_t* last) {
+    for (auto it = first; it != last; ++it) {
+        auto i = *it;
+        const auto& rec = q.hits[i];
+        const auto& light = static_cast<const diffuse_light&>(*rec.mat_ptr);
+        q.add_radiance(i, q.throughput(i) * light.diffuse_light::emitted(rec.u, rec.v, rec.p));
+        q.alive[i] = 0;
+    }
+}
+
+// Scatters every path in [first, last), whose hits all have material M (or any
+// material, through virtual calls, for M = material). The others emit nothing.
+template <typename M>
+void wavefront_integrator::shade(path_queue& q, const uint32_t* first, const uint32_t* last, bool emissive) {
+    for (auto it = first; it != last; ++it) {
+        auto i = *it;
+        thread_sampler().gen = q.rng[i];
+        const auto& rec = q.hits[i];
+        const auto& m = static_cast<const M&>(*rec.mat_ptr);
+        auto throughput = q.throughput(i);
+        if (emissive)
+            q.add_radiance(i, throughput * m.emitted(rec.u, rec.v, rec.p));
+
+        ray scattered;
+        color attenuation;
+        q.alive[i] = 0;
+        if (!scatter_as(m, q.get_ray(i), rec, attenuation, scattered))
+            continue;
+
+        throughput = throughput * attenuation;
+        if (!survives_roulette(q.bounces[i], roulette_depth, throughput) || q.bounces[i] >= max_depth)
+            continue;
+
+        q.set_throughput(i, throughput);
+        q.set_ray(i, scattered);
+        q.alive[i] = 1;
+    }
+}
+
+// Keeps the paths that go on, in the order extend traced them: slot order,
+// unless reorder() sorted them.
+void wavefront_integrator::compact(path_queue& q) {
+    q.active.clear();
+    for (auto i : q.hit)
+        if (q.alive[i])
+            q.active.push_back(i);
+}
+
+wavefront_integrator::material_kind wavefront_integrator::kind_of(const material& m) {
+    const auto& type = typeid(m);
+    if (type == typeid(lambertian)) return material_kind::lambertian;
+    if (type == typeid(metal)) return material_kind::metal;
+    if (type == typeid(dielectric)) return material_kind::dielectric;
+    if (type == typeid(diffuse_light)) return material_kind::diffuse_light;
+    if (type == typeid(isotropic)) return material_kind::isotropic;
+    return material_kind::other;
+}
+
+#endif
@@ -0,0 +1,368 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "rtweekend.h"
+
+#include "linear_bvh.h"
+#include "simd.h"
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+// A W-wide BVH node. The bounds of all children are stored structure-of-arrays
+// so one SIMD slab test covers the whole node. Unused lanes get an inverted box
+// that no ray can hit.
+template <int W>
+struct wide_bvh_node {
+    float bounds[6][W];    // per lane: min x, y, z, then max x, y, z
+    uint32_t child[W];     // inner child: node index; leaf child: first index entry
+    uint16_t count[W];     // 0 for an inner child, primitive count of a leaf child
+};
+
+// Ray data for the float kernels. near[a] / far[a] select the row of bounds
+// holding the entry / exit plane on axis a.
+struct wide_ray {
+    explicit wide_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = static_cast<float>(1 / r.direction()[a]);
+            near[a] = (inv_dir[a] < 0) ? a + 3 : a;
+            far[a] = (inv_dir[a] < 0) ? a : a + 3;
+        }
+    }
+
+    float origin[3];
+    float inv_dir[3];
+    int near[3];
+    int far[3];
+};
+
+// Exit distances are scaled up by 1 + 2 * gamma(3) so float rounding in the slab
+// test cannot reject a box the ray actually touches (Ize, "Robust BVH Ray Traversal").
+const float wide_bvh_far_scale = 1.0f + 2.0f * (3 * FLT_EPSILON / 2) / (1 - 3 * FLT_EPSILON / 2);
+
+template <int W>
+int wide_bvh_hit_lanes(
+    const wide_bvh_node<W>& n, const wide_ray& r, float t_min, float t_max, float* t_near
+) {
+    int mask = 0;
+    for (int k = 0; k < W; k++) {
+        float t0 = t_min;
+        float t1 = t_max;
+        for (int a = 0; a < 3; a++) {
+            float tn = (n.bounds[r.near[a]][k] - r.origin[a]) * r.inv_dir[a];
+            float tf = (n.bounds[r.far[a]][k] - r.origin[a]) * r.inv_dir[a] * wide_bvh_far_scale;
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        t_near[k] = t0;
+        if (t0 <= t1)
+            mask |= 1 << k;
+    }
+    return mask;
+}
+
+#ifdef RT_X86
+inline int wide_bvh_hit_lanes_sse(
+    const wide_bvh_node<4>& n, const wide_ray& r, float t_min, float t_max, float* t_near
+) {
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    const __m128 scale = _mm_set1_ps(wide_bvh_far_scale);
+
+    for (int a = 0; a < 3; a++) {
+        const __m128 o = _mm_set1_ps(r.origin[a]);
+        const __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+        __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bounds[r.near[a]]), o), inv);
+        __m128 tf = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bounds[r.far[a]]), o), inv), scale);
+        // With a NaN operand max/min return the second one, so 0 * inf keeps the old interval.
+        t0 = _mm_max_ps(tn, t0);
+        t1 = _mm_min_ps(tf, t1);
+    }
+
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+RT_TARGET_AVX2
+inline int wide_bvh_hit_lanes_avx2(
+    const wide_bvh_node<8>& n, const wide_ray& r, float t_min, float t_max, float* t_near
+) {
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    const __m256 scale = _mm256_set1_ps(wide_bvh_far_scale);
+
+    for (int a = 0; a < 3; a++) {
+        const __m256 o = _mm256_set1_ps(r.origin[a]);
+        const __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+        __m256 tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n.bounds[r.near[a]]), o), inv);
+        __m256 tf = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n.bounds[r.far[a]]), o), inv), scale);
+        t0 = _mm256_max_ps(tn, t0);
+        t1 = _mm256_min_ps(tf, t1);
+    }
+
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// Lane test for one node, using the widest kernel the build and CPU support.
+template <int W>
+struct wide_bvh_kernel {
+    static int hit(const wide_bvh_node<W>& n, const wide_ray& r, float t_min, float t_max, float* t_near) {
+        return wide_bvh_hit_lanes<W>(n, r, t_min, t_max, t_near);
+    }
+};
+
+#ifdef RT_X86
+template <>
+struct wide_bvh_kernel<4> {
+    static int hit(const wide_bvh_node<4>& n, const wide_ray& r, float t_min, float t_max, float* t_near) {
+        return wide_bvh_hit_lanes_sse(n, r, t_min, t_max, t_near);
+    }
+};
+
+template <>
+struct wide_bvh_kernel<8> {
+    static int hit(const wide_bvh_node<8>& n, const wide_ray& r, float t_min, float t_max, float* t_near) {
+        return wide_bvh_hit_lanes_avx2(n, r, t_min, t_max, t_near);
+    }
+};
+#endif
+
+// A BVH with W children per node, collapsed from a binary linear_bvh_tree by
+// repeatedly opening the largest inner child until every lane is used.
+template <int W>
+class wide_bvh_tree {
+public:
+    void collapse(const linear_bvh_tree& binary) {
+        nodes.clear();
+        indices = binary.indices;
+        if (binary.empty())
+            return;
+
+        // Pad the float bounds by the rounding error of float ray origins in a
+        // scene of this size; the kernels only see float copies of the rays.
+        auto root = binary.bounds();
+        real magnitude = 0;
+        for (int a = 0; a < 3; a++)
+            magnitude = std::max(magnitude, std::max(fabs(root.min()[a]), fabs(root.max()[a])));
+        padding = static_cast<float>(4 * FLT_EPSILON * magnitude);
+
+        collapse_node(binary, 0);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Same contract as linear_bvh_tree::traverse().
+    template <bool any_hit = false, typename Intersect>
+    bool traverse(const ray& r, real t_min, real t_max, Intersect&& intersect) const {
+        if (nodes.empty())
+            return false;
+
+        struct entry {
+            uint32_t ref;
+            uint32_t count;
+            float t;
+        };
+
+        wide_ray q(r);
+        entry stack[W * linear_bvh_tree::max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, 0, -std::numeric_limits<float>::infinity() };
+        bool hit_anything = false;
+
+        while (stack_size > 0) {
+            auto e = stack[--stack_size];
+            if (e.t > t_max)
+                continue;
+
+            if (e.count > 0) {
+                for (uint32_t i = 0; i < e.count; i++) {
+                    if (intersect(indices[e.ref + i], t_min, t_max)) {
+                        if (any_hit)
+                            return true;
+                        hit_anything = true;
+                    }
+                }
+                continue;
+            }
+
+            const auto& node = nodes[e.ref];
+            float t_near[W];
+            int mask = wide_bvh_kernel<W>::hit(
+                node, q, static_cast<float>(t_min), float_round_up(t_max), t_near);
+
+            // Push the hit children far to near so the nearest is popped first.
+            entry hits[W];
+            int hit_count = 0;
+            for (int k = 0; k < W; k++) {
+                if (!(mask & (1 << k)))
+                    continue;
+                entry h = { node.child[k], node.count[k], t_near[k] };
+                int p = hit_count++;
+                while (p > 0 && hits[p - 1].t < h.t) {
+                    hits[p] = hits[p - 1];
+                    p--;
+                }
+                hits[p] = h;
+            }
+            for (int k = 0; k < hit_count; k++)
+                stack[stack_size++] = hits[k];
+        }
+
+        return hit_anything;
+    }
+
+    size_t memory_bytes() const {
+        return nodes.size() * sizeof(wide_bvh_node<W>) + indices.size() * sizeof(uint32_t);
+    }
+
+public:
+    std::vector<wide_bvh_node<W>> nodes;
+    std::vector<uint32_t> indices;
+
+private:
+    uint32_t collapse_node(const linear_bvh_tree& binary, uint32_t root) {
+        // Gather up to W binary subtrees below root, always opening the widest.
+        uint32_t lanes[W];
+        int lane_count = 0;
+        const auto& r = binary.nodes[root];
+        if (r.is_leaf()) {
+            lanes[lane_count++] = root;
+        }
+        else {
+            lanes[lane_count++] = root + 1;
+            lanes[lane_count++] = r.offset;
+        }
+
+        while (lane_count < W) {
+            int widest = -1;
+            real widest_area = -1;
+            for (int k = 0; k < lane_count; k++) {
+                const auto& n = binary.nodes[lanes[k]];
+                auto area = linear_bvh_tree::node_box(n).surface_area();
+                if (!n.is_leaf() && area > widest_area) {
+                    widest = k;
+                    widest_area = area;
+                }
+            }
+            if (widest < 0)
+                break;
+
+            auto opened = lanes[widest];
+            lanes[widest] = opened + 1;
+            lanes[lane_count++] = binary.nodes[opened].offset;
+        }
+
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        for (int k = 0; k < W; k++) {
+            for (int a = 0; a < 3; a++) {
+                nodes[index].bounds[a][k] = std::numeric_limits<float>::infinity();
+                nodes[index].bounds[a + 3][k] = -std::numeric_limits<float>::infinity();
+            }
+            nodes[index].child[k] = 0;
+            nodes[index].count[k] = 0;
+        }
+
+        for (int k = 0; k < lane_count; k++) {
+            const auto& n = binary.nodes[lanes[k]];
+            for (int a = 0; a < 3; a++) {
+                nodes[index].bounds[a][k] = n.bounds[0][a] - padding;
+                nodes[index].bounds[a + 3][k] = n.bounds[1][a] + padding;
+            }
+
+            if (n.is_leaf()) {
+                nodes[index].child[k] = n.offset;
+                nodes[index].count[k] = n.count;
+            }
+            else {
+                auto child = collapse_node(binary, lanes[k]);
+                nodes[index].child[k] = child;
+            }
+        }
+
+        return index;
+    }
+
+private:
+    float padding = 0;
+};
+
+// Drop-in hittable over a wide BVH. It is eight wide when the CPU runs AVX2 and
+// four wide (SSE, or plain C++ off x86) otherwise.
+class wide_bvh : public hittable {
+public:
+    wide_bvh() {}
+
+    wide_bvh(
+        const hittable_list& list, real time0, real time1,
+        const bvh_build_options& options = bvh_build_options())
+        : objects(list.objects), use_bvh8(cpu_has_avx2())
+    {
+        linear_bvh_tree binary;
+        auto refs = make_primitive_refs(objects, time0, time1);
+        binary.build(refs, options);
+        box = binary.bounds();
+        build_stats = binary.build_stats;
+
+        if (use_bvh8)
+            tree8.collapse(binary);
+        else
+            tree4.collapse(binary);
+    }
+
+    virtual bool hit(
+        const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return intersect_and_resolve(*this, r, t_min, t_max, rec);
+    }
+
+    virtual bool intersect(
+        const ray& r, real t_min, real t_max, surface_hit& hit) const override;
+
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+        if (objects.empty())
+            return false;
+        output_box = box;
+        return true;
+    }
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        auto test = [&](uint32_t index, real t0, real t1) {
+            return objects[index]->occluded(r, t0, t1);
+        };
+
+        return use_bvh8
+            ? tree8.traverse<true>(r, t_min, t_max, test)
+            : tree4.traverse<true>(r, t_min, t_max, test);
+    }
+
+    int width() const { return use_bvh8 ? 8 : 4; }
+    size_t node_count() const { return use_bvh8 ? tree8.nodes.size() : tree4.nodes.size(); }
+    size_t memory_bytes() const { return use_bvh8 ? tree8.memory_bytes() : tree4.memory_bytes(); }
+
+public:
+    std::vector<shared_ptr<hittable>> objects;
+    bool use_bvh8 = false;
+    wide_bvh_tree<4> tree4;
+    wide_bvh_tree<8> tree8;
+    aabb box;
+    bvh_build_stats build_stats;
+};
+
+bool wide_bvh::intersect(const ray& r, real t_min, real t_max, surface_hit& hit) const {
+    auto intersect_object = [&](uint32_t index, real t0, real& t1) {
+        if (!objects[index]->intersect(r, t0, t1, hit))
+            return false;
+        t1 = hit.t;
+        return true;
+    };
+
+    return use_bvh8
+        ? tree8.traverse(r, t_min, t_max, intersect_object)
+        : tree4.traverse(r, t_min, t_max, intersect_object);
+}
+
+#endif